@@ -31,7 +31,11 @@
 #include <xtm_api.h>
 
 #include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <errno.h>
 #include <benchmark/benchmark.h>
 
@@ -53,10 +57,16 @@ enum {
 	BATCH_COUNT_MAX = 1024,
 	/** Count of messages in test */
 	TEST_MSG_COUNT = 1024 * 1024,
+	/** Linger of auto notification policy, in microseconds. */
+	LINGER_USEC = 50,
+	/** Sample period of consumer profiler. */
+	PROFILE_SAMPLE_PERIOD = 64,
 };
 
 struct xtm_msg {
 	unsigned number;
+	/** Time of push, used to measure latency. */
+	uint64_t push_nsec;
 };
 
 /**
@@ -110,6 +120,53 @@ consumer_thread_push_and_invoke_fun(void *arg)
 	return NULL;
 }
 
+static void
+consumer_msg_batch_func(void **args, unsigned count)
+{
+	for (unsigned i = 0; i < count; i++)
+		consumer_msg_func(args[i]);
+}
+
+static void *
+consumer_thread_batch_funs(void *arg)
+{
+	fail_unless(xtm_queue_set_batch_fun(xtm_queue, consumer_msg_func,
+					    consumer_msg_batch_func) == 0);
+	return consumer_thread_push_and_invoke_fun(arg);
+}
+
+static void *
+consumer_thread_profiled(void *arg)
+{
+	fail_unless(xtm_queue_set_profiling(xtm_queue,
+					    PROFILE_SAMPLE_PERIOD) == 0);
+	return consumer_thread_push_and_invoke_fun(arg);
+}
+
+static void *
+consumer_thread_edge_triggered(void *arg)
+{
+	unsigned invoked = 0;
+	int epfd = epoll_create1(0);
+	(void)arg;
+
+	fail_unless(epfd >= 0);
+	fail_unless(xtm_queue_consumer_epoll_add(xtm_queue, epfd, NULL) == 0);
+	while (invoked < TEST_MSG_COUNT) {
+		struct epoll_event ev;
+		int rc;
+		while ((rc = epoll_wait(epfd, &ev, 1, -1)) < 0 && errno == EINTR)
+			;
+		fail_unless(rc == 1);
+		invoked += xtm_queue_invoke_funs_all(xtm_queue);
+		/* Try to notify producer again, if queue was full */
+		if (xtm_queue_get_reset_was_full(xtm_queue))
+			fail_unless(xtm_queue_notify_producer(xtm_queue) == 0);
+	}
+	close(epfd);
+	return NULL;
+}
+
 static void *
 consumer_thread_push_and_pop_ptr(void *arg)
 {
@@ -138,16 +195,83 @@ consumer_thread_push_and_pop_ptr(void *arg)
 	return NULL;
 }
 
+static uint64_t
+clock_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Total latency of messages received by polling consumer. */
+static uint64_t total_latency_nsec;
+/**
+ * Messages received by polling consumer, freed after the test,
+ * so that consumer is faster than producer and queue stays short.
+ */
+static struct xtm_msg *polled_msg_arr[TEST_MSG_COUNT];
+
+static void *
+consumer_thread_poll_ptrs(void *arg)
+{
+	unsigned received = 0;
+	uint64_t latency = 0;
+	(void)arg;
+
+	while (received < TEST_MSG_COUNT) {
+		void *ptr_array[BATCH_COUNT_MAX];
+		unsigned rc = xtm_queue_pop_ptrs(xtm_queue, ptr_array,
+						 BATCH_COUNT_MAX);
+		if (rc == 0)
+			continue;
+		uint64_t now = clock_nsec();
+		for (unsigned i = 0; i < rc; i++) {
+			struct xtm_msg *msg = (struct xtm_msg *)ptr_array[i];
+			latency += now - msg->push_nsec;
+			xtm_msg_arr[msg->number] = NULL;
+			polled_msg_arr[msg->number] = msg;
+		}
+		received += rc;
+	}
+	total_latency_nsec = latency;
+	return NULL;
+}
+
+static void
+consumer_ptr_func(void *ptr, void *ctx)
+{
+	(void)ctx;
+	consumer_msg_func(ptr);
+}
+
+static void *
+consumer_thread_drain_ptrs(void *arg)
+{
+	unsigned received = 0;
+	int fd = xtm_queue_consumer_fd(xtm_queue);
+	(void)arg;
+
+	while (received < TEST_MSG_COUNT) {
+		fail_unless(wait_for_fd(fd) > 0);
+		int rc = xtm_queue_drain(xtm_queue, consumer_ptr_func, NULL);
+		fail_unless(rc >= 0);
+		received += rc;
+	}
+	return NULL;
+}
+
 /**
  * The function makes all the necessary preparation for performance testing.
  * Creates consumer thread, producer and consumer xtm queues, sets all global
  * variables and etc.
  * @param[in] state - benchmark state
  * @param[in] thread_func - consumer thread function
+ * @param[in] queue_flags - flags passed to xtm_queue_new_ex
  * @retval return true if success, otherwise return false
  */
 static bool
-setup_xtm_perf_test(benchmark::State& state, void *(*thread_func)(void *))
+setup_xtm_perf_test(benchmark::State& state, void *(*thread_func)(void *),
+		    unsigned queue_flags = 0)
 {
 	unsigned i;
 	for (i = 0; i < TEST_MSG_COUNT; i++) {
@@ -159,7 +283,7 @@ setup_xtm_perf_test(benchmark::State& state, void *(*thread_func)(void *))
 		}
 
 	}
-	xtm_queue = xtm_queue_new(XTM_TEST_QUEUE_SIZE);
+	xtm_queue = xtm_queue_new_ex(XTM_TEST_QUEUE_SIZE, queue_flags);
 	if (xtm_queue == NULL) {
 		state.SkipWithError("Failed to create xtm queue");
 		goto fail;
@@ -216,13 +340,18 @@ create_test_arguments(benchmark::internal::Benchmark* b)
 }
 
 static void
-xtm_push_and_invoke_funs(benchmark::State& state)
+push_funs(benchmark::State& state, void *(*thread_func)(void *),
+	  unsigned queue_flags)
 {
 	unsigned number = 0;
 	unsigned batch = state.range(0);
-	if (!setup_xtm_perf_test(state, consumer_thread_push_and_invoke_fun))
+	bool auto_notify = (queue_flags & XTM_QUEUE_AUTO_NOTIFY) != 0;
+	if (!setup_xtm_perf_test(state, thread_func, queue_flags))
 		return;
 	int fd = xtm_queue_producer_fd(xtm_queue);
+	if (auto_notify &&
+	    xtm_queue_set_auto_notify(xtm_queue, batch, LINGER_USEC) != 0)
+		state.SkipWithError("Failed to set auto notify policy");
 
 	for (auto _ : state) {
 		/*
@@ -247,7 +376,8 @@ xtm_push_and_invoke_funs(benchmark::State& state)
 			 * fails sleep again.
 			 */
 		}
-		if (number % batch == 0 || number == TEST_MSG_COUNT - 1) {
+		if (!auto_notify &&
+		    (number % batch == 0 || number == TEST_MSG_COUNT - 1)) {
 			if (xtm_queue_notify_consumer(xtm_queue) != 0) {
 				state.SkipWithError("Failed to notify "
 						    "consumer thread");
@@ -256,20 +386,85 @@ xtm_push_and_invoke_funs(benchmark::State& state)
 		}
 		number++;
 	}
+	if (auto_notify && xtm_queue_flush(xtm_queue) != 0)
+		state.SkipWithError("Failed to flush queue");
 
 	state.SetItemsProcessed(number);
 	teardown_xtm_perf_test(state, number);
 }
+
+static void
+xtm_push_and_invoke_funs(benchmark::State& state)
+{
+	push_funs(state, consumer_thread_push_and_invoke_fun, 0);
+}
 BENCHMARK(xtm_push_and_invoke_funs)
 	->Iterations(TEST_MSG_COUNT)
 	->Apply(create_test_arguments);
 
+/**
+ * Same as xtm_push_and_invoke_funs, but consumer registers batch
+ * function, so all pushed functions are invoked in batches.
+ */
 static void
-xtm_push_and_pop_ptrs(benchmark::State& state)
+xtm_push_and_invoke_batch_funs(benchmark::State& state)
+{
+	push_funs(state, consumer_thread_batch_funs, 0);
+}
+BENCHMARK(xtm_push_and_invoke_batch_funs)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_push_and_invoke_funs, but consumer profiles invoked
+ * functions, timing one of PROFILE_SAMPLE_PERIOD invocations.
+ */
+static void
+xtm_push_and_invoke_funs_profiled(benchmark::State& state)
+{
+	push_funs(state, consumer_thread_profiled, 0);
+}
+BENCHMARK(xtm_push_and_invoke_funs_profiled)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_push_and_invoke_funs, but consumer watches its fd with
+ * edge-triggered epoll and doesn't read notifications, while producer
+ * writes to the fd only if consumer is waiting.
+ */
+static void
+xtm_push_and_invoke_funs_edge_triggered(benchmark::State& state)
+{
+	push_funs(state, consumer_thread_edge_triggered,
+		  XTM_QUEUE_EDGE_TRIGGERED);
+}
+BENCHMARK(xtm_push_and_invoke_funs_edge_triggered)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_push_and_invoke_funs, but producer doesn't notify
+ * consumer explicitly, push does it according to auto notification
+ * policy, batch is the test parameter.
+ */
+static void
+xtm_push_and_invoke_funs_auto_notify(benchmark::State& state)
+{
+	push_funs(state, consumer_thread_push_and_invoke_fun,
+		  XTM_QUEUE_AUTO_NOTIFY);
+}
+BENCHMARK(xtm_push_and_invoke_funs_auto_notify)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+static void
+push_ptrs(benchmark::State& state, void *(*thread_func)(void *),
+	  unsigned queue_flags)
 {
 	unsigned number = 0;
 	unsigned batch = state.range(0);
-	if (!setup_xtm_perf_test(state, consumer_thread_push_and_pop_ptr))
+	if (!setup_xtm_perf_test(state, thread_func, queue_flags))
 		return;
 	int fd = xtm_queue_producer_fd(xtm_queue);
 
@@ -309,8 +504,233 @@ xtm_push_and_pop_ptrs(benchmark::State& state)
 	state.SetItemsProcessed(number);
 	teardown_xtm_perf_test(state, number);
 }
+
+static void
+xtm_push_and_pop_ptrs(benchmark::State& state)
+{
+	push_ptrs(state, consumer_thread_push_and_pop_ptr, 0);
+}
 BENCHMARK(xtm_push_and_pop_ptrs)
 	->Iterations(TEST_MSG_COUNT)
 	->Apply(create_test_arguments);
 
+/**
+ * Same as xtm_push_and_pop_ptrs, but consumer uses xtm_queue_drain
+ * instead of consume/count/pop_ptrs/get_reset_was_full sequence.
+ */
+static void
+xtm_push_and_drain_ptrs(benchmark::State& state)
+{
+	push_ptrs(state, consumer_thread_drain_ptrs, 0);
+}
+BENCHMARK(xtm_push_and_drain_ptrs)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_push_and_pop_ptrs, but queue has 8-byte slots.
+ */
+static void
+xtm_push_and_pop_ptrs_ptr_only(benchmark::State& state)
+{
+	push_ptrs(state, consumer_thread_push_and_pop_ptr,
+		  XTM_QUEUE_PTR_ONLY);
+}
+BENCHMARK(xtm_push_and_pop_ptrs_ptr_only)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_push_and_drain_ptrs, but queue has 8-byte slots.
+ */
+static void
+xtm_push_and_drain_ptrs_ptr_only(benchmark::State& state)
+{
+	push_ptrs(state, consumer_thread_drain_ptrs, XTM_QUEUE_PTR_ONLY);
+}
+BENCHMARK(xtm_push_and_drain_ptrs_ptr_only)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+/**
+ * Producer pushes pointers one by one to polled queue, consumer
+ * busy-polls it, so the only interaction between threads is through
+ * queue indexes. Test parameter is publish batch (see
+ * xtm_queue_set_publish_batch), 1 means that queue is created without
+ * XTM_QUEUE_DEFERRED_PUBLISH flag. Average latency from push to pop
+ * is reported in latency_ns counter.
+ */
+static void
+xtm_push_and_poll_ptrs(benchmark::State& state)
+{
+	unsigned number = 0;
+	unsigned publish_batch = state.range(0);
+	unsigned queue_flags = XTM_QUEUE_POLLED;
+	if (publish_batch > 1)
+		queue_flags |= XTM_QUEUE_DEFERRED_PUBLISH;
+	if (!setup_xtm_perf_test(state, consumer_thread_poll_ptrs,
+				 queue_flags))
+		return;
+	if (publish_batch > 1 &&
+	    xtm_queue_set_publish_batch(xtm_queue, publish_batch) != 0)
+		state.SkipWithError("Failed to set publish batch");
+
+	for (auto _ : state) {
+		xtm_msg_arr[number]->number = number;
+		xtm_msg_arr[number]->push_nsec = clock_nsec();
+		while (xtm_queue_push_ptr(xtm_queue, xtm_msg_arr[number],
+					  0) != 0)
+			;
+		number++;
+	}
+	if (xtm_queue_flush(xtm_queue) != 0)
+		state.SkipWithError("Failed to flush xtm queue");
+
+	state.SetItemsProcessed(number);
+	teardown_xtm_perf_test(state, number);
+	state.counters["latency_ns"] = (double)total_latency_nsec / number;
+	for (unsigned i = 0; i < number; i++) {
+		free(polled_msg_arr[i]);
+		polled_msg_arr[i] = NULL;
+	}
+}
+BENCHMARK(xtm_push_and_poll_ptrs)
+	->Iterations(TEST_MSG_COUNT)
+	->ArgName("publish_batch")
+	->Arg(1)
+	->Arg(4)
+	->Arg(16)
+	->Arg(64);
+
+/** Mailbox for mailbox test. */
+static struct xtm_mailbox *xtm_mailbox;
+/** Count of values read by mailbox consumer. */
+static unsigned mailbox_read_count;
+
+static void *
+consumer_thread_mailbox(void *arg)
+{
+	int fd = xtm_mailbox_consumer_fd(xtm_mailbox);
+	unsigned last = 0;
+	(void)arg;
+
+	mailbox_read_count = 0;
+	while (last < TEST_MSG_COUNT) {
+		fail_unless(wait_for_fd(fd) > 0);
+		fail_unless(xtm_queue_consume(fd) == 0);
+		const unsigned *value =
+			(const unsigned *)xtm_mailbox_read(xtm_mailbox);
+		if (value == NULL)
+			continue;
+		last = *value;
+		mailbox_read_count++;
+	}
+	return NULL;
+}
+
+/**
+ * Producer writes a stream of values to mailbox, consumer reads
+ * only the latest ones. Count of values, actually read by consumer,
+ * is reported in reads counter.
+ */
+static void
+xtm_mailbox_write_and_read(benchmark::State& state)
+{
+	unsigned value = 0;
+	xtm_mailbox = xtm_mailbox_new(sizeof(value));
+	if (xtm_mailbox == NULL) {
+		state.SkipWithError("Failed to create xtm mailbox");
+		return;
+	}
+	if (pthread_create(&consumer_thread, NULL,
+			   consumer_thread_mailbox, NULL) != 0) {
+		xtm_mailbox_delete(xtm_mailbox,
+				   XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD);
+		state.SkipWithError("Failed to create consumer thread");
+		return;
+	}
+
+	for (auto _ : state) {
+		value++;
+		if (xtm_mailbox_write(xtm_mailbox, &value) != 0) {
+			state.SkipWithError("Failed to write to mailbox");
+			break;
+		}
+	}
+
+	state.SetItemsProcessed(value);
+	if (value < TEST_MSG_COUNT)
+		pthread_cancel(consumer_thread);
+	pthread_join(consumer_thread, NULL);
+	state.counters["reads"] = mailbox_read_count;
+	if (xtm_mailbox_delete(xtm_mailbox,
+			       XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD) != 0)
+		state.SkipWithError("Failed to delete xtm mailbox");
+}
+BENCHMARK(xtm_mailbox_write_and_read)
+	->Iterations(TEST_MSG_COUNT);
+
+/**
+ * Cost of queue creation and destruction, test parameter is
+ * flags passed to xtm_queue_new_ex.
+ */
+static void
+xtm_queue_new_and_delete(benchmark::State& state)
+{
+	unsigned queue_flags = state.range(0);
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (auto _ : state) {
+		struct xtm_queue *queue = xtm_queue_new_ex(1024, queue_flags);
+		if (queue == NULL) {
+			state.SkipWithError("Failed to create xtm queue");
+			break;
+		}
+		if (xtm_queue_delete(queue, flags) != 0) {
+			state.SkipWithError("Failed to delete xtm queue");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(xtm_queue_new_and_delete)
+	->ArgName("flags")
+	->Arg(0)
+	->Arg(XTM_QUEUE_LAZY_FDS)
+	->Arg(XTM_QUEUE_POLLED);
+
+/**
+ * Same as xtm_queue_new_and_delete, but queue is taken from
+ * and returned to xtm_queue_pool.
+ */
+static void
+xtm_queue_pool_acquire_and_release(benchmark::State& state)
+{
+	unsigned queue_flags = state.range(0);
+	struct xtm_queue_pool *pool = xtm_queue_pool_new(1024, queue_flags, 1);
+	if (pool == NULL) {
+		state.SkipWithError("Failed to create xtm queue pool");
+		return;
+	}
+	for (auto _ : state) {
+		struct xtm_queue *queue = xtm_queue_pool_acquire(pool);
+		if (queue == NULL) {
+			state.SkipWithError("Failed to acquire xtm queue");
+			break;
+		}
+		if (xtm_queue_pool_release(pool, queue) != 0) {
+			state.SkipWithError("Failed to release xtm queue");
+			break;
+		}
+	}
+	state.SetItemsProcessed(state.iterations());
+	if (xtm_queue_pool_delete(pool) != 0)
+		state.SkipWithError("Failed to delete xtm queue pool");
+}
+BENCHMARK(xtm_queue_pool_acquire_and_release)
+	->ArgName("flags")
+	->Arg(0)
+	->Arg(XTM_QUEUE_LAZY_FDS)
+	->Arg(XTM_QUEUE_POLLED);
+
 BENCHMARK_MAIN();
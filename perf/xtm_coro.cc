@@ -0,0 +1,198 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_coro.h>
+
+#include <pthread.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Maximum message count in xtm queue. */
+	XTM_TEST_QUEUE_SIZE = 64 * 1024,
+	/**
+	 * Maximum number of messages sent without notification.
+	 * Upper bound for the test parameter.
+	 */
+	BATCH_COUNT_MAX = 1024,
+	/** Count of messages in test */
+	TEST_MSG_COUNT = 1024 * 1024,
+};
+
+/**
+ * Fire-and-forget coroutine type, enough to drive awaiters.
+ */
+struct xtm_perf_task {
+	struct promise_type {
+		xtm_perf_task
+		get_return_object(void)
+		{
+			return xtm_perf_task();
+		}
+		std::suspend_never
+		initial_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+		std::suspend_never
+		final_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+		void
+		return_void(void) {}
+		void
+		unhandled_exception(void)
+		{
+			abort();
+		}
+	};
+};
+
+/** Global pointer to xtm queue. */
+static struct xtm_queue *xtm_queue;
+/** Consumer thread id */
+static pthread_t consumer_thread;
+/** Count of messages received by consumer coroutine. */
+static unsigned received;
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static xtm_perf_task
+consumer_coro(struct xtm_coro_queue *q)
+{
+	while (received < TEST_MSG_COUNT) {
+		void *ptr_array[BATCH_COUNT_MAX];
+		unsigned rc = co_await q->pop_batch(ptr_array, BATCH_COUNT_MAX);
+		for (unsigned i = 0; i < rc; i++)
+			benchmark::DoNotOptimize(ptr_array[i]);
+		received += rc;
+	}
+}
+
+static void *
+consumer_thread_coro_pop_batch(void *arg)
+{
+	struct xtm_coro_epoll_reactor reactor;
+	(void)arg;
+	fail_unless(reactor.create() == 0);
+	{
+		struct xtm_coro_queue q(xtm_queue, &reactor);
+		consumer_coro(&q);
+		while (received < TEST_MSG_COUNT)
+			fail_unless(reactor.run_once(-1) >= 0);
+	}
+	reactor.destroy();
+	return NULL;
+}
+
+static void
+create_test_arguments(benchmark::internal::Benchmark* b)
+{
+	for (unsigned batch = 1; batch <= BATCH_COUNT_MAX; batch *= 4)
+		b->Args({batch});
+}
+
+/**
+ * Same as xtm_push_and_pop_ptrs from xtm.cc, but consumer is
+ * a coroutine, which awaits on xtm_coro_queue::pop_batch.
+ */
+static void
+xtm_push_and_coro_pop_batch(benchmark::State& state)
+{
+	unsigned number = 0;
+	unsigned batch = state.range(0);
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	received = 0;
+	xtm_queue = xtm_queue_new(XTM_TEST_QUEUE_SIZE);
+	if (xtm_queue == NULL) {
+		state.SkipWithError("Failed to create xtm queue");
+		return;
+	}
+	if (pthread_create(&consumer_thread, NULL,
+			   consumer_thread_coro_pop_batch, NULL) != 0) {
+		xtm_queue_delete(xtm_queue, flags);
+		state.SkipWithError("Failed to create consumer thread");
+		return;
+	}
+	int fd = xtm_queue_producer_fd(xtm_queue);
+
+	for (auto _ : state) {
+		unsigned push_flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+		while (xtm_queue_push_ptr(xtm_queue, &number,
+					  push_flags) != 0) {
+			if (wait_for_fd(fd) <= 0 ||
+			    xtm_queue_consume(fd) != 0) {
+				state.SkipWithError("Failed to wait for fd");
+				break;
+			}
+		}
+		if (number % batch == 0 || number == TEST_MSG_COUNT - 1) {
+			if (xtm_queue_notify_consumer(xtm_queue) != 0) {
+				state.SkipWithError("Failed to notify "
+						    "consumer thread");
+				break;
+			}
+		}
+		number++;
+	}
+
+	state.SetItemsProcessed(number);
+	if (number < TEST_MSG_COUNT)
+		pthread_cancel(consumer_thread);
+	pthread_join(consumer_thread, NULL);
+	if (xtm_queue_delete(xtm_queue, flags) != 0)
+		state.SkipWithError("Failed to delete xtm queue");
+}
+BENCHMARK(xtm_push_and_coro_pop_batch)
+	->Iterations(TEST_MSG_COUNT)
+	->Apply(create_test_arguments);
+
+BENCHMARK_MAIN();
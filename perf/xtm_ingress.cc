@@ -0,0 +1,255 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_api.h>
+#include <xtm_ingress.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Size of ring of each CPU and of each producer queue. */
+	XTM_TEST_QUEUE_SIZE = 1024,
+	/** Count of pointers pushed by each producer per iteration. */
+	PUSH_COUNT = 1024,
+	/** Maximum count of pointers popped at once. */
+	POP_BATCH = 256,
+	/** Maximum count of epoll events handled at once. */
+	EVENT_BATCH = 64,
+};
+
+/** Ingress, which producers push to. */
+static struct xtm_ingress *ingress;
+/** Queues of producers, used instead of ingress in baseline. */
+static std::vector<struct xtm_queue *> queues;
+/** Number of iteration, which producers must run. */
+static unsigned generation;
+/** Flag, which stops producers. */
+static bool stop;
+
+/**
+ * Wait until benchmark thread starts the next iteration. Returns
+ * false, if producer must stop.
+ */
+static bool
+producer_wait_generation(unsigned *seen)
+{
+	unsigned gen;
+	while ((gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) ==
+	       *seen) {
+		if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+			return false;
+		sched_yield();
+	}
+	*seen = gen;
+	return true;
+}
+
+static void *
+ingress_producer(void *arg)
+{
+	(void)arg;
+	unsigned seen = 0;
+	while (producer_wait_generation(&seen)) {
+		for (uintptr_t i = 0; i < PUSH_COUNT; i++) {
+			while (xtm_ingress_push(ingress, (void *)i) != 0) {
+				fail_unless(errno == ENOBUFS);
+				sched_yield();
+			}
+		}
+	}
+	return NULL;
+}
+
+static void *
+queue_producer(void *arg)
+{
+	struct xtm_queue *queue = (struct xtm_queue *)arg;
+	unsigned seen = 0;
+	while (producer_wait_generation(&seen)) {
+		for (uintptr_t i = 0; i < PUSH_COUNT; i++) {
+			while (xtm_queue_push_ptr(queue, (void *)i, 0) != 0) {
+				fail_unless(errno == ENOBUFS);
+				sched_yield();
+			}
+		}
+	}
+	return NULL;
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void
+start_producers(std::vector<pthread_t> &threads,
+		void *(*producer)(void *), bool per_queue)
+{
+	generation = 0;
+	stop = false;
+	for (unsigned i = 0; i < threads.size(); i++) {
+		void *arg = per_queue ? queues[i] : NULL;
+		fail_unless(pthread_create(&threads[i], NULL,
+					   producer, arg) == 0);
+	}
+}
+
+static void
+stop_producers(std::vector<pthread_t> &threads)
+{
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	for (unsigned i = 0; i < threads.size(); i++)
+		fail_unless(pthread_join(threads[i], NULL) == 0);
+}
+
+/**
+ * Each of producer threads, whose count is the test parameter,
+ * pushes PUSH_COUNT pointers to the shared ingress per iteration,
+ * benchmark thread pops all of them.
+ */
+static void
+xtm_ingress_push_and_pop(benchmark::State& state)
+{
+	std::vector<pthread_t> threads(state.range(0));
+	fail_unless((ingress = xtm_ingress_new(XTM_TEST_QUEUE_SIZE)) != NULL);
+	int fd = xtm_ingress_consumer_fd(ingress);
+	start_producers(threads, ingress_producer, false);
+	uint64_t popped = 0;
+
+	for (auto _ : state) {
+		uint64_t expected = popped + threads.size() * PUSH_COUNT;
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+		while (popped < expected) {
+			void *ptrs[POP_BATCH];
+			unsigned count = xtm_ingress_pop(ingress, ptrs,
+							 POP_BATCH);
+			popped += count;
+			if (count < POP_BATCH && popped < expected) {
+				fail_unless(wait_for_fd(fd) > 0);
+				fail_unless(xtm_queue_consume(fd) == 0);
+			}
+		}
+	}
+
+	state.SetItemsProcessed(popped);
+	state.counters["rseq"] = xtm_ingress_uses_rseq(ingress);
+	stop_producers(threads);
+	fail_unless(xtm_ingress_delete(ingress) == 0);
+}
+BENCHMARK(xtm_ingress_push_and_pop)
+	->ArgName("producers")
+	->Arg(4)
+	->Arg(32)
+	->Arg(256)
+	->UseRealTime();
+
+/**
+ * Baseline for xtm_ingress_push_and_pop: each producer thread has
+ * its own edge-triggered queue, benchmark thread waits for all of
+ * them on epoll.
+ */
+static void
+xtm_queue_per_producer_push_and_pop(benchmark::State& state)
+{
+	std::vector<pthread_t> threads(state.range(0));
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	fail_unless(epfd >= 0);
+	queues.resize(threads.size());
+	for (unsigned i = 0; i < queues.size(); i++) {
+		queues[i] = xtm_queue_new_ex(XTM_TEST_QUEUE_SIZE,
+					     XTM_QUEUE_EDGE_TRIGGERED |
+					     XTM_QUEUE_AUTO_NOTIFY);
+		fail_unless(queues[i] != NULL);
+		fail_unless(xtm_queue_consumer_epoll_add(queues[i], epfd,
+							 queues[i]) == 0);
+	}
+	start_producers(threads, queue_producer, true);
+	uint64_t popped = 0;
+
+	for (auto _ : state) {
+		uint64_t expected = popped + threads.size() * PUSH_COUNT;
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+		while (popped < expected) {
+			struct epoll_event events[EVENT_BATCH];
+			int rc = epoll_wait(epfd, events, EVENT_BATCH, -1);
+			fail_unless(rc >= 0 || errno == EINTR);
+			for (int i = 0; i < rc; i++) {
+				struct xtm_queue *queue =
+					(struct xtm_queue *)events[i].data.ptr;
+				void *ptrs[POP_BATCH];
+				unsigned count;
+				do {
+					count = xtm_queue_pop_ptrs(queue, ptrs,
+								   POP_BATCH);
+					popped += count;
+				} while (count == POP_BATCH);
+			}
+		}
+	}
+
+	state.SetItemsProcessed(popped);
+	stop_producers(threads);
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < queues.size(); i++)
+		fail_unless(xtm_queue_delete(queues[i], flags) == 0);
+	fail_unless(close(epfd) == 0);
+}
+BENCHMARK(xtm_queue_per_producer_push_and_pop)
+	->ArgName("producers")
+	->Arg(4)
+	->Arg(32)
+	->Arg(256)
+	->UseRealTime();
+
+BENCHMARK_MAIN();
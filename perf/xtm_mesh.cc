@@ -0,0 +1,305 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_api.h>
+#include <xtm_mesh.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Size of each ring and of each queue. */
+	XTM_TEST_QUEUE_SIZE = 256,
+	/** Count of pointers sent by each thread to each peer per iteration. */
+	PUSH_COUNT = 64,
+	/** Maximum count of pointers popped from queue at once. */
+	POP_BATCH = 256,
+	/** Maximum count of epoll events handled at once. */
+	EVENT_BATCH = 64,
+};
+
+/** Mesh, which threads message each other through. */
+static struct xtm_mesh *mesh;
+/** Queues from each thread to each thread, used instead of mesh. */
+static std::vector<struct xtm_queue *> queues;
+/** Count of threads. */
+static unsigned thread_count;
+/** Number of iteration, which threads must run. */
+static unsigned generation;
+/** Count of threads, which started or finished the current iteration. */
+static unsigned finished;
+/** Flag, which stops threads. */
+static bool stop;
+
+/** State of a benchmark thread. */
+struct perf_thread {
+	/** Id of the thread. */
+	unsigned id;
+	/** Count of received pointers. */
+	uint64_t received;
+	/** Epoll instance watching incoming queues, in baseline. */
+	int epfd;
+};
+
+/**
+ * Wait until benchmark thread starts the next iteration. Returns
+ * false, if thread must stop.
+ */
+static bool
+wait_generation(unsigned *seen)
+{
+	unsigned gen;
+	while ((gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE)) ==
+	       *seen) {
+		if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE))
+			return false;
+		sched_yield();
+	}
+	*seen = gen;
+	return true;
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void
+mesh_receive(void *ctx, unsigned from, void *ptr)
+{
+	(void)from;
+	benchmark::DoNotOptimize(ptr);
+	((struct perf_thread *)ctx)->received++;
+}
+
+static void *
+mesh_thread(void *arg)
+{
+	struct perf_thread *thread = (struct perf_thread *)arg;
+	int fd = xtm_mesh_fd(mesh, thread->id);
+	/* Rings of the thread are allocated on its own node. */
+	fail_unless(xtm_mesh_attach(mesh, thread->id) == 0);
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	unsigned seen = 0;
+	while (wait_generation(&seen)) {
+		uint64_t expected = thread->received +
+				    (uint64_t)thread_count * PUSH_COUNT;
+		for (uintptr_t i = 0; i < PUSH_COUNT; i++) {
+			for (unsigned to = 0; to < thread_count; to++) {
+				while (xtm_mesh_push(mesh, thread->id, to,
+						     (void *)i) != 0) {
+					fail_unless(errno == ENOBUFS);
+					fail_unless(xtm_mesh_flush(mesh,
+						thread->id) >= 0);
+					xtm_mesh_poll_all(mesh, thread->id,
+							  mesh_receive, thread);
+				}
+			}
+		}
+		fail_unless(xtm_mesh_flush(mesh, thread->id) >= 0);
+		while (thread->received < expected) {
+			if (xtm_mesh_poll_all(mesh, thread->id, mesh_receive,
+					      thread) == 0) {
+				fail_unless(wait_for_fd(fd) > 0);
+				fail_unless(xtm_queue_consume(fd) == 0);
+			}
+		}
+		__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * Pop pointers from incoming queues, which are ready, waiting for
+ * them, if block is true.
+ */
+static void
+queue_receive(struct perf_thread *thread, bool block)
+{
+	struct epoll_event events[EVENT_BATCH];
+	int rc = epoll_wait(thread->epfd, events, EVENT_BATCH, block ? -1 : 0);
+	fail_unless(rc >= 0 || errno == EINTR);
+	for (int i = 0; i < rc; i++) {
+		struct xtm_queue *queue =
+			(struct xtm_queue *)events[i].data.ptr;
+		void *ptrs[POP_BATCH];
+		unsigned count;
+		do {
+			count = xtm_queue_pop_ptrs(queue, ptrs, POP_BATCH);
+			thread->received += count;
+		} while (count == POP_BATCH);
+	}
+}
+
+static void *
+queue_thread(void *arg)
+{
+	struct perf_thread *thread = (struct perf_thread *)arg;
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	unsigned seen = 0;
+	while (wait_generation(&seen)) {
+		uint64_t expected = thread->received +
+				    (uint64_t)thread_count * PUSH_COUNT;
+		for (uintptr_t i = 0; i < PUSH_COUNT; i++) {
+			for (unsigned to = 0; to < thread_count; to++) {
+				struct xtm_queue *queue =
+					queues[thread->id * thread_count + to];
+				while (xtm_queue_push_ptr(queue, (void *)i,
+							  0) != 0) {
+					fail_unless(errno == ENOBUFS);
+					queue_receive(thread, false);
+				}
+			}
+		}
+		while (thread->received < expected)
+			queue_receive(thread, true);
+		__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * Run benchmark iterations: in each of them every thread sends
+ * PUSH_COUNT pointers to every thread and receives all pointers
+ * sent to it.
+ */
+static void
+run_iterations(benchmark::State& state, void *(*thread_f)(void *),
+	       std::vector<struct perf_thread> &threads)
+{
+	std::vector<pthread_t> tids(thread_count);
+	generation = 0;
+	finished = 0;
+	stop = false;
+	for (unsigned i = 0; i < thread_count; i++)
+		fail_unless(pthread_create(&tids[i], NULL, thread_f,
+					   &threads[i]) == 0);
+	/* Wait until all threads are ready to receive. */
+	while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) < thread_count)
+		sched_yield();
+	uint64_t items = 0;
+	for (auto _ : state) {
+		__atomic_store_n(&finished, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+		while (__atomic_load_n(&finished, __ATOMIC_ACQUIRE) <
+		       thread_count)
+			sched_yield();
+		items += (uint64_t)thread_count * thread_count * PUSH_COUNT;
+	}
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	for (unsigned i = 0; i < thread_count; i++)
+		fail_unless(pthread_join(tids[i], NULL) == 0);
+	state.SetItemsProcessed(items);
+}
+
+static void
+xtm_mesh_all_to_all(benchmark::State& state)
+{
+	thread_count = state.range(0);
+	std::vector<struct perf_thread> threads(thread_count);
+	fail_unless((mesh = xtm_mesh_new(thread_count,
+					 XTM_TEST_QUEUE_SIZE)) != NULL);
+	for (unsigned i = 0; i < thread_count; i++)
+		threads[i].id = i;
+	run_iterations(state, mesh_thread, threads);
+	state.counters["fds"] = thread_count;
+	fail_unless(xtm_mesh_delete(mesh) == 0);
+}
+BENCHMARK(xtm_mesh_all_to_all)
+	->ArgName("threads")
+	->Arg(2)
+	->Arg(8)
+	->Arg(32)
+	->UseRealTime();
+
+/**
+ * Baseline for xtm_mesh_all_to_all: an edge-triggered xtm_queue from
+ * each thread to each thread, each thread waits for its incoming
+ * queues on epoll.
+ */
+static void
+xtm_queue_all_to_all(benchmark::State& state)
+{
+	thread_count = state.range(0);
+	std::vector<struct perf_thread> threads(thread_count);
+	queues.resize(thread_count * thread_count);
+	for (unsigned i = 0; i < thread_count; i++) {
+		threads[i].id = i;
+		threads[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+		fail_unless(threads[i].epfd >= 0);
+	}
+	for (unsigned i = 0; i < queues.size(); i++) {
+		queues[i] = xtm_queue_new_ex(XTM_TEST_QUEUE_SIZE,
+					     XTM_QUEUE_EDGE_TRIGGERED |
+					     XTM_QUEUE_AUTO_NOTIFY);
+		fail_unless(queues[i] != NULL);
+		int epfd = threads[i % thread_count].epfd;
+		fail_unless(xtm_queue_consumer_epoll_add(queues[i], epfd,
+							 queues[i]) == 0);
+	}
+	run_iterations(state, queue_thread, threads);
+	state.counters["fds"] = 2 * queues.size();
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < queues.size(); i++)
+		fail_unless(xtm_queue_delete(queues[i], flags) == 0);
+	for (unsigned i = 0; i < thread_count; i++)
+		fail_unless(close(threads[i].epfd) == 0);
+}
+BENCHMARK(xtm_queue_all_to_all)
+	->ArgName("threads")
+	->Arg(2)
+	->Arg(8)
+	->Arg(32)
+	->UseRealTime();
+
+BENCHMARK_MAIN();
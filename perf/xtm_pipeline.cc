@@ -0,0 +1,163 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_pipeline.h>
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <string>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Size of queues between stages. */
+	XTM_TEST_QUEUE_SIZE = 1024,
+	/** Count of items in test. */
+	TEST_ITEM_COUNT = 1024 * 1024,
+	/** Maximum count of items popped at once. */
+	POP_BATCH = 256,
+	/** Duration of the middle stage, in nanoseconds. */
+	HEAVY_STAGE_NSEC = 200,
+	/** Count of pipeline stages. */
+	STAGE_COUNT = 3,
+};
+
+static void *
+light_stage(void *ctx, void *item)
+{
+	(void)ctx;
+	return item;
+}
+
+static void *
+heavy_stage(void *ctx, void *item)
+{
+	(void)ctx;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t deadline = ts.tv_sec * 1000000000ull + ts.tv_nsec +
+			    HEAVY_STAGE_NSEC;
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	} while (ts.tv_sec * 1000000000ull + ts.tv_nsec < deadline);
+	return item;
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+/**
+ * Decode -> execute -> encode pipeline, where execute stage is the
+ * heavy one and runs on the number of threads given by the test
+ * parameter. Items are pushed and popped by the benchmark thread.
+ * Busy share of each stage is reported, the bottleneck stage has
+ * the largest one.
+ */
+static void
+xtm_pipeline_push_and_pop(benchmark::State& state)
+{
+	unsigned threads = state.range(0);
+	struct xtm_pipeline *pipeline = xtm_pipeline_new(XTM_TEST_QUEUE_SIZE);
+	fail_unless(pipeline != NULL);
+	fail_unless(xtm_pipeline_add_stage(pipeline, light_stage,
+					   NULL, 1) == 0);
+	fail_unless(xtm_pipeline_add_stage(pipeline, heavy_stage,
+					   NULL, threads) == 1);
+	fail_unless(xtm_pipeline_add_stage(pipeline, light_stage,
+					   NULL, 1) == 2);
+	fail_unless(xtm_pipeline_start(pipeline) == 0);
+	int fd = xtm_pipeline_output_fd(pipeline);
+	uintptr_t number = 1;
+	unsigned popped = 0;
+
+	for (auto _ : state) {
+		while (xtm_pipeline_push(pipeline, (void *)number) != 0) {
+			void *items[POP_BATCH];
+			fail_unless(xtm_flush_notifications() == 0);
+			unsigned count = xtm_pipeline_pop(pipeline, items,
+							  POP_BATCH);
+			if (count == 0) {
+				fail_unless(wait_for_fd(fd) > 0);
+				fail_unless(xtm_queue_consume(fd) == 0);
+			}
+			popped += count;
+		}
+		number++;
+	}
+	fail_unless(xtm_flush_notifications() == 0);
+	while (popped < number - 1) {
+		void *items[POP_BATCH];
+		unsigned count = xtm_pipeline_pop(pipeline, items, POP_BATCH);
+		if (count == 0) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+		popped += count;
+	}
+
+	state.SetItemsProcessed(popped);
+	for (unsigned i = 0; i < STAGE_COUNT; i++) {
+		struct xtm_pipeline_stage_stats stats;
+		fail_unless(xtm_pipeline_stage_stats(pipeline, i, &stats) == 0);
+		uint64_t total = stats.busy_nsec + stats.input_wait_nsec +
+				 stats.output_wait_nsec;
+		std::string name = "busy" + std::to_string(i);
+		state.counters[name] = total == 0 ? 0 :
+			(double)stats.busy_nsec / total;
+	}
+	fail_unless(xtm_pipeline_delete(pipeline) == 0);
+}
+BENCHMARK(xtm_pipeline_push_and_pop)
+	->ArgName("threads")
+	->Arg(1)
+	->Arg(2)
+	->Arg(4)
+	->Iterations(TEST_ITEM_COUNT)
+	->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,226 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_pool.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Size of ingress queue of each worker. */
+	XTM_TEST_QUEUE_SIZE = 1024,
+	/** Count of worker threads. */
+	WORKER_COUNT = 4,
+	/** Count of tasks submitted in each iteration. */
+	TASK_COUNT = 1024,
+	/** Count of tasks submitted between notifications. */
+	SUBMIT_BATCH = 16,
+	/** Duration of short task, in nanoseconds. */
+	SHORT_TASK_NSEC = 1000,
+	/** Duration of long task, in nanoseconds. */
+	LONG_TASK_NSEC = 100 * 1000,
+};
+
+/** Count of executed tasks. */
+static unsigned done_count;
+
+static uint64_t
+now_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Task, which spins for the duration passed as argument.
+ */
+static void
+spin_task(void *arg)
+{
+	uint64_t deadline = now_nsec() + (uintptr_t)arg;
+	while (now_nsec() < deadline)
+		;
+	__atomic_add_fetch(&done_count, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Duration of task with given number: every skew-th task is long,
+ * zero skew means that all tasks are short. With round-robin over
+ * workers all long tasks land on the same worker, if skew is a
+ * multiple of worker count.
+ */
+static uintptr_t
+task_duration(unsigned number, unsigned skew)
+{
+	if (skew != 0 && number % skew == 0)
+		return LONG_TASK_NSEC;
+	return SHORT_TASK_NSEC;
+}
+
+static void
+wait_for_tasks(void)
+{
+	while (__atomic_load_n(&done_count, __ATOMIC_ACQUIRE) < TASK_COUNT)
+		sched_yield();
+}
+
+/** Queues of static round-robin workers. */
+static struct xtm_queue *rr_queues[WORKER_COUNT];
+/** Flag, which stops static round-robin workers. */
+static bool rr_is_stopping;
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void *
+rr_worker_f(void *arg)
+{
+	struct xtm_queue *queue = (struct xtm_queue *)arg;
+	int fd = xtm_queue_consumer_fd(queue);
+	while (!__atomic_load_n(&rr_is_stopping, __ATOMIC_ACQUIRE)) {
+		fail_unless(wait_for_fd(fd) > 0);
+		fail_unless(xtm_queue_consume(fd) == 0);
+		xtm_queue_invoke_funs_all(queue);
+	}
+	return NULL;
+}
+
+/**
+ * Baseline: tasks are spread round-robin over separate queues, each
+ * consumed by its own worker thread, idle workers can't help busy ones.
+ */
+static void
+xtm_static_round_robin(benchmark::State& state)
+{
+	unsigned skew = state.range(0);
+	pthread_t threads[WORKER_COUNT];
+	rr_is_stopping = false;
+	for (unsigned i = 0; i < WORKER_COUNT; i++) {
+		rr_queues[i] = xtm_queue_new(XTM_TEST_QUEUE_SIZE);
+		fail_unless(rr_queues[i] != NULL);
+		fail_unless(pthread_create(&threads[i], NULL, rr_worker_f,
+					   rr_queues[i]) == 0);
+	}
+
+	for (auto _ : state) {
+		done_count = 0;
+		for (unsigned i = 0; i < TASK_COUNT; i++) {
+			struct xtm_queue *queue = rr_queues[i % WORKER_COUNT];
+			void *arg = (void *)task_duration(i, skew);
+			while (xtm_queue_push_fun(queue, spin_task,
+						  arg, 0) != 0) {
+				fail_unless(xtm_queue_notify_consumer(queue) == 0);
+				sched_yield();
+			}
+			if (i / WORKER_COUNT % SUBMIT_BATCH == SUBMIT_BATCH - 1)
+				fail_unless(xtm_queue_notify_consumer(queue) == 0);
+		}
+		for (unsigned i = 0; i < WORKER_COUNT; i++)
+			fail_unless(xtm_queue_notify_consumer(rr_queues[i]) == 0);
+		wait_for_tasks();
+	}
+
+	state.SetItemsProcessed(state.iterations() * TASK_COUNT);
+	__atomic_store_n(&rr_is_stopping, true, __ATOMIC_RELEASE);
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < WORKER_COUNT; i++) {
+		fail_unless(xtm_queue_notify_consumer(rr_queues[i]) == 0);
+		fail_unless(pthread_join(threads[i], NULL) == 0);
+		fail_unless(xtm_queue_delete(rr_queues[i], flags) == 0);
+	}
+}
+BENCHMARK(xtm_static_round_robin)
+	->ArgName("skew")
+	->Arg(0)
+	->Arg(WORKER_COUNT * 4)
+	->UseRealTime();
+
+/**
+ * Same tasks submitted to xtm_pool: idle workers steal tasks queued
+ * behind long ones.
+ */
+static void
+xtm_pool_work_stealing(benchmark::State& state)
+{
+	unsigned skew = state.range(0);
+	struct xtm_pool *pool = xtm_pool_new(WORKER_COUNT,
+					     XTM_TEST_QUEUE_SIZE);
+	fail_unless(pool != NULL);
+
+	for (auto _ : state) {
+		done_count = 0;
+		for (unsigned i = 0; i < TASK_COUNT; i++) {
+			void *arg = (void *)task_duration(i, skew);
+			while (xtm_pool_submit(pool, spin_task, arg) != 0) {
+				xtm_pool_flush(pool);
+				sched_yield();
+			}
+			if (i % SUBMIT_BATCH == SUBMIT_BATCH - 1)
+				xtm_pool_flush(pool);
+		}
+		xtm_pool_flush(pool);
+		wait_for_tasks();
+	}
+
+	state.SetItemsProcessed(state.iterations() * TASK_COUNT);
+	state.counters["stolen"] = xtm_pool_steal_count(pool);
+	fail_unless(xtm_pool_delete(pool) == 0);
+}
+BENCHMARK(xtm_pool_work_stealing)
+	->ArgName("skew")
+	->Arg(0)
+	->Arg(WORKER_COUNT * 4)
+	->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <xtm_scsp_queue.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <benchmark/benchmark.h>
+
+#define fail(expr, result) do {					\
+	fprintf(stderr, "Test failed: %s is %s at %s:%d, "	\
+			"in function '%s'\n", expr, result,	\
+			__FILE__, __LINE__, __func__);		\
+	exit(-1);						\
+} while (0)
+#define fail_unless(expr) if (!(expr)) fail(#expr, "false")
+
+enum {
+	/** Size of the queue ring buffer. */
+	QUEUE_SIZE = 1024,
+	/**
+	 * Maximum number of elements put to the queue at once.
+	 * Upper bound for the test parameter.
+	 */
+	BATCH_COUNT_MAX = 512,
+};
+
+typedef struct xtm_scsp_queue<void *> dynamic_queue;
+typedef struct xtm_scsp_queue_fixed<void *, QUEUE_SIZE> fixed_queue;
+
+static void
+create_test_arguments(benchmark::internal::Benchmark* b)
+{
+	for (unsigned batch = 1; batch <= BATCH_COUNT_MAX; batch *= 8)
+		b->Args({batch});
+	/* Batch, which doesn't divide queue size, wraps around its end. */
+	b->Args({100});
+}
+
+/**
+ * Put batch of elements to the queue and read them back with
+ * read iterator, in a single thread, so that only cost of
+ * queue operations is measured.
+ */
+template <class Q>
+static void
+put_and_read(benchmark::State& state, Q *queue)
+{
+	unsigned batch = state.range(0);
+	void *data[BATCH_COUNT_MAX];
+	uintptr_t sum = 0;
+	for (unsigned i = 0; i < batch; i++)
+		data[i] = &data[i];
+
+	for (auto _ : state) {
+		struct xtm_scsp_queue_read_iterator<void *, Q> iter;
+		void *const *elem;
+		fail_unless(queue->put(data, batch) == batch);
+		iter.begin(queue);
+		while ((elem = iter.read()) != nullptr)
+			sum += (uintptr_t)*elem;
+		iter.end();
+	}
+	benchmark::DoNotOptimize(sum);
+	state.SetItemsProcessed(state.iterations() * batch);
+}
+
+static void
+xtm_scsp_queue_put_and_read(benchmark::State& state)
+{
+	dynamic_queue *queue = (dynamic_queue *)
+		malloc(sizeof(dynamic_queue) + QUEUE_SIZE * sizeof(void *));
+	fail_unless(queue != NULL);
+	fail_unless(queue->create(QUEUE_SIZE) == 0);
+	put_and_read(state, queue);
+	free(queue);
+}
+BENCHMARK(xtm_scsp_queue_put_and_read)
+	->Apply(create_test_arguments);
+
+/**
+ * Same as xtm_scsp_queue_put_and_read, but queue capacity
+ * is known at compile time.
+ */
+static void
+xtm_scsp_queue_fixed_put_and_read(benchmark::State& state)
+{
+	fixed_queue *queue = (fixed_queue *)malloc(sizeof(fixed_queue));
+	fail_unless(queue != NULL);
+	queue->create();
+	put_and_read(state, queue);
+	free(queue);
+}
+BENCHMARK(xtm_scsp_queue_fixed_put_and_read)
+	->Apply(create_test_arguments);
+
+BENCHMARK_MAIN();
@@ -31,38 +31,182 @@
 #include "xtm_api.h"
 #include "xtm_scsp_queue.h"
 #include "xtm_config.h"
+#include "xtm_fd.h"
+#include "xtm_clock.h"
+#include "xtm_trace.h"
 
 #include <unistd.h>
+#include <sched.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <fcntl.h>
 #include <errno.h>
 #ifdef TARANTOOL_XTM_USE_EVENTFD
 #include <sys/eventfd.h>
 #endif /* defined(TARANTOOL_XTM_USE_EVENTFD) */
+#ifdef TARANTOOL_XTM_USE_EPOLL
+#include <sys/epoll.h>
+#endif /* defined(TARANTOOL_XTM_USE_EPOLL) */
+#ifdef TARANTOOL_XTM_HAVE_TIMERFD
+#include <sys/timerfd.h>
+#endif /* defined(TARANTOOL_XTM_HAVE_TIMERFD) */
+#ifdef TARANTOOL_XTM_HAVE_MADV_DONTNEED
+#include <sys/mman.h>
+#endif /* defined(TARANTOOL_XTM_HAVE_MADV_DONTNEED) */
+#include <time.h>
 
 #define XTM_PIPE_SIZE 4096
+/**
+ * Count of messages handled by xtm_queue_drain between
+ * publications of the read index.
+ */
+#define XTM_DRAIN_PUBLISH_STEP 128
 #define XTM_QUEUE_DELETE_VALID_FLAGS (XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD | \
 				      XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD)
-#define XTM_QUEUE_PUSH_VALID_FLAGS (XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS)
+#define XTM_QUEUE_PUSH_VALID_FLAGS (XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS | \
+				    XTM_QUEUE_DEFERRED_NOTIFY)
+#define XTM_QUEUE_NEW_VALID_FLAGS (XTM_QUEUE_EDGE_TRIGGERED | \
+				   XTM_QUEUE_AUTO_NOTIFY | \
+				   XTM_QUEUE_UNBOUNDED | \
+				   XTM_QUEUE_LAZY_FDS | \
+				   XTM_QUEUE_POLLED | \
+				   XTM_QUEUE_PTR_ONLY | \
+				   XTM_QUEUE_DEFERRED_PUBLISH)
+/** Flags, which require consumer to report that it is waiting. */
+#define XTM_QUEUE_CONSUMER_WAITING_FLAGS (XTM_QUEUE_EDGE_TRIGGERED | \
+					  XTM_QUEUE_AUTO_NOTIFY)
+/** Default auto notification policy, see xtm_queue_set_auto_notify. */
+#define XTM_AUTO_NOTIFY_BATCH 64
+#define XTM_AUTO_NOTIFY_LINGER_USEC 50
+/** Default publish batch, see xtm_queue_set_publish_batch. */
+#define XTM_PUBLISH_BATCH 16
+/**
+ * Size of the ring of drained segments, returned by consumer to producer
+ * for reuse in unbounded mode. Ring holds one element less.
+ */
+#define XTM_SEGMENT_CACHE_SIZE 8
+/** Maximum count of batch functions, see xtm_queue_set_batch_fun. */
+#define XTM_BATCH_FUN_MAX 8
+/** Maximum count of arguments passed to batch function at once. */
+#define XTM_BATCH_ARGS_MAX 64
+
+/** Log2 of size of table of profiled functions. */
+#define XTM_PROFILE_FUN_BITS 6
+/** Size of table of profiled functions. */
+#define XTM_PROFILE_FUN_MAX (1 << XTM_PROFILE_FUN_BITS)
+
+/**
+ * Sampling profiler of consumer, see xtm_queue_set_profiling.
+ * Statistics are kept in open-addressed table, keyed by function.
+ */
+struct xtm_profile {
+	/** Count of invocations left until the next timed one. */
+	unsigned countdown;
+	/** Sample period. */
+	unsigned period;
+	/** Statistics of functions, which didn't fit in the table. */
+	struct xtm_queue_fun_stats overflow;
+	/** Statistics of functions, entries with NULL fun are free. */
+	struct xtm_queue_fun_stats funs[XTM_PROFILE_FUN_MAX];
+};
+
+/** Batch function, registered for pushed function. */
+struct xtm_batch_fun {
+	xtm_queue_fun_t fun;
+	xtm_queue_batch_fun_t batch_fun;
+};
 
-union xtm_msg {
+/**
+ * Arguments of consecutive messages with the same function,
+ * collected by consumer to invoke batch function.
+ */
+struct xtm_batch {
+	/** Function of the last invoked message. */
+	xtm_queue_fun_t fun;
+	/** Batch function for fun or NULL, if it is not registered. */
+	xtm_queue_batch_fun_t batch_fun;
+	/** Count of collected arguments. */
+	unsigned count;
+	/** Profiler of the queue or NULL, if it is disabled. */
+	struct xtm_profile *profile;
+	/** Collected arguments. */
+	void *args[XTM_BATCH_ARGS_MAX];
+};
+
+/**
+ * Segment of the queue. Bounded queue consists of one segment, in
+ * unbounded mode producer links a new segment, when current is full.
+ */
+struct xtm_queue_segment {
 	/**
-	 * Anonymous structure for storing functions and their arguments,
-	 * when using the xtm API in dispatch/invoke pattern.
+	 * Next segment, set by producer, when it has stopped writing
+	 * to this one.
 	 */
-	struct {
-		xtm_queue_fun_t fun;
-		void *fun_arg;
-	};
+	struct xtm_queue_segment *next;
 	/**
-	 * Pointer to save message, when using xtm API
-	 * in send/recv pattern.
+	 * Message ring of the segment, it's size must be power of two.
+	 * Queue created with XTM_QUEUE_PTR_ONLY flag uses ring of pointers,
+	 * rings have common header, so ring functions which don't access
+	 * elements can be called for any of them.
 	 */
-	void *ptr;
+	union {
+		struct xtm_scsp_queue<struct xtm_queue_msg> queue;
+		struct xtm_scsp_queue<void *> ptr_queue;
+	};
+};
+
+/**
+ * Get message ring of the segment by element type.
+ */
+template <class T>
+static inline struct xtm_scsp_queue<T> *
+segment_ring(struct xtm_queue_segment *segment);
+
+template <>
+inline struct xtm_scsp_queue<struct xtm_queue_msg> *
+segment_ring(struct xtm_queue_segment *segment)
+{
+	return &segment->queue;
+}
+
+template <>
+inline struct xtm_scsp_queue<void *> *
+segment_ring(struct xtm_queue_segment *segment)
+{
+	return &segment->ptr_queue;
+}
+
+/**
+ * Size of the ring element of the queue, created with flags.
+ */
+static inline size_t
+queue_msg_size(unsigned flags)
+{
+	return (flags & XTM_QUEUE_PTR_ONLY) != 0 ?
+	       sizeof(void *) : sizeof(struct xtm_queue_msg);
+}
+
+/**
+ * State of notification file descriptors pair.
+ */
+enum {
+	/** File descriptors are not created yet. */
+	XTM_FDS_NONE,
+	/** File descriptors are being created by some thread. */
+	XTM_FDS_CREATING,
+	/** File descriptors are created. */
+	XTM_FDS_READY,
 };
 
 struct xtm_queue {
+	/**
+	 * State of consumer file descriptors, created on first
+	 * use with XTM_QUEUE_LAZY_FDS flag, see get_fds.
+	 */
+	int consumer_fds_state;
+	/** State of producer file descriptors. */
+	int producer_fds_state;
 	/**
 	 * File descriptor that the consumer thread must poll,
 	 * to know when new messages are added to the queue.
@@ -88,89 +232,613 @@ struct xtm_queue {
 	 * the queue, and is waiting for notification.
 	 */
 	bool is_producer_should_be_notified;
-	/** Message queue, it's size must be power of two */
-	struct xtm_scsp_queue<union xtm_msg> queue;
+	/**
+	 * Flag indicates, that consumer has read everything from the
+	 * queue and is going to wait for notification. Used only in
+	 * edge-triggered and auto notification modes: producer notifies
+	 * consumer immediately only if this flag is set, because busy
+	 * consumer checks the queue anyway before waiting.
+	 */
+	bool is_consumer_waiting;
+	/**
+	 * Flag indicates, that consumer has handed the queue off, and
+	 * no thread consumes it until another thread acquires it, see
+	 * xtm_queue_consumer_release.
+	 */
+	bool is_consumer_released;
+	/**
+	 * Flags indicate, that consumer or producer file descriptor
+	 * was written since the queue was created or reset by pool,
+	 * so it may have to be drained on release to pool.
+	 */
+	bool is_consumer_fd_notified;
+	bool is_producer_fd_notified;
+	/** Flags, passed to xtm_queue_new_ex. */
+	unsigned flags;
+	/**
+	 * Auto notification policy: count of messages, pushed without
+	 * notification while consumer is busy, after which consumer
+	 * is notified. Accessed only by producer.
+	 */
+	unsigned notify_batch;
+	/**
+	 * Auto notification policy: time after the first message, pushed
+	 * without notification, when flush file descriptor becomes
+	 * readable. Accessed only by producer.
+	 */
+	unsigned notify_linger_usec;
+	/**
+	 * Count of messages pushed since the last notification of consumer.
+	 * Accessed only by producer.
+	 */
+	unsigned pending_count;
+	/**
+	 * Count of messages, after which producer publishes them to
+	 * consumer, used only with XTM_QUEUE_DEFERRED_PUBLISH flag.
+	 * Accessed only by producer.
+	 */
+	unsigned publish_batch;
+	/**
+	 * Count of messages pushed, but not published yet.
+	 * Accessed only by producer.
+	 */
+	unsigned unpublished_count;
+	/**
+	 * Timer file descriptor, which becomes readable when there are
+	 * messages pushed without notification for longer than linger.
+	 * Created on demand by xtm_queue_flush_fd, -1 until then.
+	 */
+	int flush_fd;
+	/**
+	 * Flag indicates, that queue is in the list of dirty queues
+	 * of the producer thread, see xtm_flush_notifications.
+	 * Accessed only by producer.
+	 */
+	bool is_dirty;
+	/** Next queue in the list of dirty queues. */
+	struct xtm_queue *next_dirty;
+	/**
+	 * Batch functions, registered by consumer. Accessed only
+	 * by consumer.
+	 */
+	struct xtm_batch_fun batch_funs[XTM_BATCH_FUN_MAX];
+	/** Count of registered batch functions. */
+	unsigned batch_fun_count;
+	/**
+	 * Sampling profiler, NULL if it is disabled. Accessed only
+	 * by consumer.
+	 */
+	struct xtm_profile *profile;
+	/**
+	 * Idle trim policy: time after which idle queue is trimmed,
+	 * zero if trimming is disabled. Fields related to idle trim
+	 * are accessed only by producer.
+	 */
+	unsigned idle_trim_usec;
+	/**
+	 * Producer segment and its write position at the last call
+	 * of xtm_queue_trim, to detect pushes between calls.
+	 */
+	struct xtm_queue_segment *trim_segment;
+	unsigned trim_write_pos;
+	/** Time in microseconds, since which queue is idle. */
+	uint64_t idle_since_usec;
+	/** Flag indicates, that queue is trimmed in this idle period. */
+	bool is_trimmed;
+	/** Size of the message ring of each segment. */
+	unsigned segment_size;
+	/** Segment being written. Accessed only by producer. */
+	struct xtm_queue_segment *producer_segment;
+	/** Segment being read. Accessed only by consumer. */
+	struct xtm_queue_segment *consumer_segment;
+	/**
+	 * Drained segments, returned by consumer to producer for reuse.
+	 * Used only in unbounded mode.
+	 */
+	struct xtm_scsp_queue_fixed<struct xtm_queue_segment *,
+				    XTM_SEGMENT_CACHE_SIZE> segment_cache;
+	/** First segment, allocated with the queue. */
+	struct xtm_queue_segment segment;
+};
+
+/**
+ * Pool of queues, see xtm_queue_pool_new.
+ */
+struct xtm_queue_pool {
+	/** Size of pool queues. */
+	unsigned size;
+	/** Flags of pool queues. */
+	unsigned flags;
+	/** Maximum count of queues kept by pool. */
+	unsigned capacity;
+	/** Count of queues kept by pool. */
+	unsigned count;
+	/** Stack of queues kept by pool, the last released is on top. */
+	struct xtm_queue *queues[];
 };
 
+/**
+ * Bit of xtm_mailbox::middle, which is set, when middle buffer
+ * contains value, which is not read yet.
+ */
+#define XTM_MAILBOX_DIRTY 4u
+/** Mask of buffer index in xtm_mailbox::middle. */
+#define XTM_MAILBOX_INDEX_MASK 3u
+
+/**
+ * Mailbox, see xtm_mailbox_new. Buffers are rotated between
+ * producer (back), consumer (front) and the middle, which holds
+ * the latest written value.
+ */
+struct xtm_mailbox {
+	/**
+	 * Index of the middle buffer, with XTM_MAILBOX_DIRTY bit set,
+	 * if it contains value, which is not read yet. Exchanged by
+	 * producer and consumer.
+	 */
+	unsigned middle;
+	/** Index of buffer being written. Accessed only by producer. */
+	unsigned back;
+	/** Index of buffer being read. Accessed only by consumer. */
+	unsigned front;
+	/** Size of value. */
+	unsigned size;
+	/** Offset between buffers, multiple of cache line size. */
+	unsigned stride;
+	/** File descriptor that the consumer thread must poll. */
+	int consumer_read_fd;
+	/** File descriptor to which the producer thread writes. */
+	int consumer_write_fd;
+	/** Buffers of values. */
+	char *buffers;
+};
+
+struct xtm_dispatcher {
+	/**
+	 * Count of messages in queue, above which messages with key
+	 * hashed to it are dispatched to other queues.
+	 */
+	unsigned affinity_limit;
+	/** State of pseudo-random generator, used to sample queues. */
+	uint32_t rand_state;
+	/** Count of queues. */
+	unsigned count;
+	/** Queues to dispatch messages to. */
+	struct xtm_queue *queues[];
+};
+
+enum {
+	/**
+	 * Maximum count of stamps of unread messages, kept by monitor
+	 * for each queue. When stamps run out, new messages are merged
+	 * into the latest stamp and their age is overestimated.
+	 */
+	XTM_MONITOR_STAMP_MAX = 16,
+};
+
+/**
+ * Time, when monitor has first seen messages at positions before
+ * the end position, which weren't seen by the previous stamp.
+ */
+struct xtm_monitor_stamp {
+	/** Position next to the last message of the stamp. */
+	unsigned end;
+	/** Time of the poll, at which the messages were seen. */
+	uint64_t usec;
+};
+
+/** Queue, watched by monitor. */
+struct xtm_monitor_entry {
+	/** Watched queue. */
+	struct xtm_queue *queue;
+	/** Thresholds, 0 if disabled. */
+	unsigned depth_threshold;
+	uint64_t age_threshold_usec;
+	uint64_t stall_threshold_usec;
+	/** Queue positions at the last poll. */
+	unsigned write_pos;
+	unsigned read_pos;
+	/** Time of the last poll, at which read position has moved. */
+	uint64_t read_moved_usec;
+	/** Ring of stamps of unread messages, from the oldest one. */
+	struct xtm_monitor_stamp stamps[XTM_MONITOR_STAMP_MAX];
+	unsigned stamp_first;
+	unsigned stamp_count;
+	/** State of the queue at the last poll. */
+	struct xtm_monitor_stats stats;
+	/** True if queue was over thresholds at the last poll. */
+	bool is_over;
+};
+
+struct xtm_monitor {
+	/** Function called when thresholds are crossed and its context. */
+	xtm_monitor_cb_t cb;
+	void *ctx;
+	/** Count of watched queues and capacity of entries array. */
+	unsigned count;
+	unsigned capacity;
+	/** Watched queues. */
+	struct xtm_monitor_entry *entries;
+};
+
+/**
+ * List of queues, pushed with XTM_QUEUE_DEFERRED_NOTIFY flag
+ * by the current thread and not notified yet.
+ */
+static __thread struct xtm_queue *dirty_queues;
+
+/**
+ * Get notification file descriptors pair, creating it on first use.
+ * Pair is created by the first thread, which needs it, other threads
+ * wait until it is created.
+ * @param[in]  state    - state of the pair.
+ * @param[out] read_fd  - read file descriptor.
+ * @param[out] write_fd - write file descriptor.
+ * @retval 0 on success, otherwise -1 with errno set appropriately
+ *         (as in eventfd(2) or pipe(2)).
+ */
 static inline int
-notify_fd(int fd)
+get_fds(int *state, int *read_fd, int *write_fd)
 {
-	static uint64_t tmp = 1;
-	ssize_t cnt;
-	/*
-	 * We must write 8 byte value, because for linux we
-	 * used eventfd, which require to write >= 8 byte at once.
-	 * Also in case of EINTR we retry to write
-	 */
-	while ((cnt = write(fd, &tmp, sizeof(tmp))) < 0 && errno == EINTR)
-		;
-	return ((cnt >= 0 || errno == EAGAIN) ? 0 : -1);
+	int expected;
+	while ((expected = __atomic_load_n(state, __ATOMIC_ACQUIRE)) !=
+	       XTM_FDS_READY) {
+		if (expected == XTM_FDS_NONE &&
+		    __atomic_compare_exchange_n(state, &expected,
+						XTM_FDS_CREATING, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_ACQUIRE)) {
+			if (create_fds(read_fd, write_fd) < 0) {
+				__atomic_store_n(state, XTM_FDS_NONE,
+						 __ATOMIC_RELEASE);
+				return -1;
+			}
+			__atomic_store_n(state, XTM_FDS_READY,
+					 __ATOMIC_RELEASE);
+			return 0;
+		}
+		sched_yield();
+	}
+	return 0;
 }
 
+/**
+ * Write to consumer file descriptor, unless queue is polled.
+ */
 static inline int
-create_fds(int *read_fd, int *write_fd)
+notify_consumer_fd(struct xtm_queue *queue)
 {
-	int fds[2];
-	assert(read_fd != NULL);
-	assert(write_fd != NULL);
-
-#ifdef TARANTOOL_XTM_USE_EVENTFD
-	if ((fds[0] = eventfd(0, 0)) < 0)
-#else /* !defined(TARANTOOL_XTM_USE_EVENTFD) */
-	if (pipe(fds) < 0)
-#endif /* defined(TARANTOOL_XTM_USE_EVENTFD) */
+	if ((queue->flags & XTM_QUEUE_POLLED) != 0)
+		return 0;
+	if (get_fds(&queue->consumer_fds_state, &queue->consumer_read_fd,
+		    &queue->consumer_write_fd) < 0)
 		return -1;
+	__atomic_store_n(&queue->is_consumer_fd_notified, true,
+			 __ATOMIC_RELAXED);
+	XTM_PROBE1(notify, queue);
+	return notify_fd(queue->consumer_write_fd);
+}
 
-#ifdef TARANTOOL_XTM_USE_EVENTFD
-	*read_fd = *write_fd = fds[0];
-#else /* !defined(TARANTOOL_XTM_USE_EVENTFD) */
-	*read_fd = fds[0];
-	*write_fd = fds[1];
-#endif /* defined(TARANTOOL_XTM_USE_EVENTFD) */
+/**
+ * Prefetch message, which will be read after 2 * distance messages,
+ * and the function argument or pointer contained in message, which
+ * will be read after distance messages, so that producer-written
+ * cache lines are fetched while consumer handles preceding messages.
+ * @param[in] iter - consumer iterator.
+ */
+static inline void
+prefetch_msgs(struct xtm_scsp_queue_read_iterator<xtm_queue_msg> *iter)
+{
+#if TARANTOOL_XTM_PREFETCH_DISTANCE > 0
+	const struct xtm_queue_msg *xtm_msg;
+	iter->prefetch(2 * TARANTOOL_XTM_PREFETCH_DISTANCE);
+	if ((xtm_msg = iter->peek(TARANTOOL_XTM_PREFETCH_DISTANCE)) != nullptr)
+		__builtin_prefetch(xtm_msg->arg);
+#else /* TARANTOOL_XTM_PREFETCH_DISTANCE == 0 */
+	(void)iter;
+#endif /* TARANTOOL_XTM_PREFETCH_DISTANCE > 0 */
+}
+
+/**
+ * Same as prefetch_msgs, but for queue of pointers.
+ * @param[in] iter - consumer iterator.
+ */
+static inline void
+prefetch_ptrs(struct xtm_scsp_queue_read_iterator<void *> *iter)
+{
+#if TARANTOOL_XTM_PREFETCH_DISTANCE > 0
+	void *const *ptr;
+	iter->prefetch(2 * TARANTOOL_XTM_PREFETCH_DISTANCE);
+	if ((ptr = iter->peek(TARANTOOL_XTM_PREFETCH_DISTANCE)) != nullptr)
+		__builtin_prefetch(*ptr);
+#else /* TARANTOOL_XTM_PREFETCH_DISTANCE == 0 */
+	(void)iter;
+#endif /* TARANTOOL_XTM_PREFETCH_DISTANCE > 0 */
+}
+
+/**
+ * Check if producer has linked the next segment after the segment
+ * being read by consumer, so there can be messages in it.
+ */
+static inline bool
+consumer_has_next(struct xtm_queue *queue)
+{
+	return __atomic_load_n(&queue->consumer_segment->next,
+			       __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * Return drained segment to producer for reuse, or free it,
+ * if segment cache is full.
+ */
+static inline void
+recycle_segment(struct xtm_queue *queue, struct xtm_queue_segment *segment)
+{
+	segment->next = NULL;
+	segment->queue.create(queue->segment_size);
+	if (queue->segment_cache.put(&segment, 1) == 0 &&
+	    segment != &queue->segment)
+		free(segment);
+}
+
+/**
+ * Get segment to read by consumer. Segments before the last one are
+ * recycled as soon as they are drained: producer doesn't write to
+ * segment after it has linked the next one.
+ */
+static inline struct xtm_queue_segment *
+consumer_segment(struct xtm_queue *queue)
+{
+	struct xtm_queue_segment *segment = queue->consumer_segment;
+	struct xtm_queue_segment *next;
+	while ((next = __atomic_load_n(&segment->next,
+				       __ATOMIC_ACQUIRE)) != NULL &&
+	       segment->queue.count() == 0) {
+		recycle_segment(queue, segment);
+		segment = queue->consumer_segment = next;
+	}
+	return segment;
+}
+
+/**
+ * Called by producer, when its segment is full in unbounded mode.
+ * Puts message to a new segment, taken from segment cache or allocated,
+ * and links it after the full one.
+ */
+template <class T>
+static inline int
+producer_next_segment(struct xtm_queue *queue, T *xtm_msg)
+{
+	struct xtm_scsp_queue_read_iterator<struct xtm_queue_segment *,
+		decltype(queue->segment_cache)> iter;
+	struct xtm_queue_segment *const *cached;
+	struct xtm_queue_segment *segment;
+
+	iter.begin(&queue->segment_cache);
+	if ((cached = iter.read()) != nullptr) {
+		segment = *cached;
+		iter.end();
+	} else {
+		segment = (struct xtm_queue_segment *)
+			malloc(sizeof(struct xtm_queue_segment) +
+			       queue->segment_size *
+			       queue_msg_size(queue->flags));
+		if (segment == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		segment->next = NULL;
+		segment->queue.create(queue->segment_size);
+	}
+	/* Same as put, but keeps staged position valid. */
+	segment_ring<T>(segment)->stage(xtm_msg, 1);
+	segment_ring<T>(segment)->publish();
+	__atomic_store_n(&queue->producer_segment->next, segment,
+			 __ATOMIC_RELEASE);
+	queue->producer_segment = segment;
 	return 0;
 }
 
+/**
+ * Called by consumer, when it has read all messages seen by iterator.
+ * In edge-triggered mode marks consumer as waiting for notification.
+ * If producer managed to push something before consumer was marked,
+ * producer could skip notification, so consumer notifies itself.
+ */
+template <class T>
+static inline void
+consumer_wait(struct xtm_queue *queue,
+	      struct xtm_scsp_queue_read_iterator<T> *iter)
+{
+	if ((queue->flags & XTM_QUEUE_CONSUMER_WAITING_FLAGS) == 0)
+		return;
+	__atomic_store_n(&queue->is_consumer_waiting, true, __ATOMIC_SEQ_CST);
+	/* Order the flag store before the load of write index. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!iter->update() && !consumer_has_next(queue))
+		return;
+	/*
+	 * If the flag is already reset, producer has notified us
+	 * after the push, otherwise it has not seen the flag.
+	 */
+	if (__atomic_exchange_n(&queue->is_consumer_waiting, false,
+				__ATOMIC_SEQ_CST))
+		notify_consumer_fd(queue);
+}
+
+/**
+ * Make messages, pushed by producer, visible to consumer.
+ * Used only with XTM_QUEUE_DEFERRED_PUBLISH flag.
+ */
+static inline void
+queue_publish(struct xtm_queue *queue)
+{
+	if (queue->unpublished_count == 0)
+		return;
+	queue->producer_segment->queue.publish();
+	queue->unpublished_count = 0;
+}
+
+/**
+ * Put message to the producer segment, publishing it to consumer
+ * either at once, or with the rest of the batch.
+ * @retval true if message is put, false if segment is full.
+ */
+template <class T>
+static inline bool
+producer_put(struct xtm_queue *queue, T *xtm_msg)
+{
+	struct xtm_scsp_queue<T> *ring =
+		segment_ring<T>(queue->producer_segment);
+	if ((queue->flags & XTM_QUEUE_DEFERRED_PUBLISH) == 0)
+		return ring->put(xtm_msg, 1) != 0;
+	if (ring->stage(xtm_msg, 1) == 0)
+		return false;
+	if (++queue->unpublished_count >= queue->publish_batch)
+		queue_publish(queue);
+	return true;
+}
+
+/**
+ * Init state of the queue, which is changed by its producer and
+ * consumer, common part of xtm_queue_new_ex and xtm_queue_pool_release.
+ */
+static inline void
+queue_init(struct xtm_queue *queue)
+{
+	queue->is_producer_should_be_notified = false;
+	/* Consumer hasn't been notified yet, so it's waiting. */
+	queue->is_consumer_waiting = true;
+	queue->is_consumer_released = false;
+	queue->is_consumer_fd_notified = false;
+	queue->is_producer_fd_notified = false;
+	queue->notify_batch = XTM_AUTO_NOTIFY_BATCH;
+	queue->notify_linger_usec = XTM_AUTO_NOTIFY_LINGER_USEC;
+	queue->pending_count = 0;
+	queue->publish_batch = XTM_PUBLISH_BATCH;
+	queue->unpublished_count = 0;
+	queue->batch_fun_count = 0;
+	queue->profile = NULL;
+	queue->is_dirty = false;
+	queue->next_dirty = NULL;
+	queue->idle_trim_usec = 0;
+	queue->trim_segment = NULL;
+	queue->is_trimmed = false;
+	queue->producer_segment = &queue->segment;
+	queue->consumer_segment = &queue->segment;
+	queue->segment.next = NULL;
+}
+
+/**
+ * Remove queue from the list of dirty queues of the current thread.
+ */
+static inline void
+queue_unlink_dirty(struct xtm_queue *queue)
+{
+	if (!queue->is_dirty)
+		return;
+	struct xtm_queue **prev = &dirty_queues;
+	while (*prev != NULL && *prev != queue)
+		prev = &(*prev)->next_dirty;
+	if (*prev != NULL)
+		*prev = queue->next_dirty;
+}
+
+/**
+ * Reset segments of the queue, created in unbounded mode, so that
+ * the queue consists of the first segment only. Other segments are
+ * kept in the cache of drained segments as far as it has space.
+ */
+static void
+queue_reset_segments(struct xtm_queue *queue)
+{
+	struct xtm_queue_segment *segments[XTM_SEGMENT_CACHE_SIZE];
+	struct xtm_queue_segment *const *cached;
+	unsigned count = 0;
+	struct xtm_scsp_queue_read_iterator<struct xtm_queue_segment *,
+		decltype(queue->segment_cache)> iter;
+	iter.begin(&queue->segment_cache);
+	while ((cached = iter.read()) != nullptr) {
+		if (*cached != &queue->segment)
+			segments[count++] = *cached;
+	}
+	queue->segment_cache.create();
+	queue->segment_cache.put(segments, count);
+
+	struct xtm_queue_segment *segment = queue->consumer_segment;
+	while (segment != NULL) {
+		struct xtm_queue_segment *next = segment->next;
+		if (segment != &queue->segment)
+			recycle_segment(queue, segment);
+		segment = next;
+	}
+}
+
 struct xtm_queue *
 xtm_queue_new(unsigned size)
+{
+	return xtm_queue_new_ex(size, 0);
+}
+
+struct xtm_queue *
+xtm_queue_new_ex(unsigned size, unsigned flags)
 {
 	int save_errno = 0;
+	assert((flags & (~XTM_QUEUE_NEW_VALID_FLAGS)) == 0);
+#ifndef TARANTOOL_XTM_USE_EPOLL
+	if ((flags & XTM_QUEUE_EDGE_TRIGGERED) != 0) {
+		errno = ENOTSUP;
+		return NULL;
+	}
+#endif /* !defined(TARANTOOL_XTM_USE_EPOLL) */
+	if ((flags & XTM_QUEUE_POLLED) != 0 &&
+	    (flags & XTM_QUEUE_CONSUMER_WAITING_FLAGS) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if ((flags & XTM_QUEUE_DEFERRED_PUBLISH) != 0 &&
+	    (flags & XTM_QUEUE_AUTO_NOTIFY) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
 	struct xtm_queue *queue = (struct xtm_queue *)
 		malloc(sizeof(struct xtm_queue) +
-		       size * sizeof(union xtm_msg));
+		       size * queue_msg_size(flags));
 	if (queue == NULL)
 		return NULL;
 
-	queue->is_producer_should_be_notified = false;
+	queue_init(queue);
+	queue->flags = flags;
+	queue->flush_fd = -1;
+	queue->segment_size = size;
+	queue->segment_cache.create();
+
+	queue->consumer_fds_state = XTM_FDS_NONE;
+	queue->producer_fds_state = XTM_FDS_NONE;
+	queue->consumer_read_fd = queue->consumer_write_fd = -1;
+	queue->producer_read_fd = queue->producer_write_fd = -1;
+
+	if (queue->segment.queue.create(size) < 0) {
+		save_errno = EINVAL;
+		goto free_queue;
+	}
+	if ((flags & (XTM_QUEUE_LAZY_FDS | XTM_QUEUE_POLLED)) != 0)
+		return queue;
 
 	if (create_fds(&queue->consumer_read_fd,
 		       &queue->consumer_write_fd) < 0) {
 		save_errno = errno;
 		goto free_queue;
 	}
-
+	queue->consumer_fds_state = XTM_FDS_READY;
 	if (create_fds(&queue->producer_read_fd,
 		       &queue->producer_write_fd) < 0) {
 		save_errno = errno;
 		goto close_consumer_fds;
 	}
-
-	if (fcntl(queue->consumer_read_fd, F_SETFL, O_NONBLOCK) < 0 ||
-	    fcntl(queue->consumer_write_fd, F_SETFL, O_NONBLOCK) < 0 ||
-	    fcntl(queue->producer_read_fd, F_SETFL, O_NONBLOCK) < 0 ||
-	    fcntl(queue->producer_write_fd, F_SETFL, O_NONBLOCK) < 0) {
-		save_errno = errno;
-		goto close_producer_fds;
-	}
-	if (queue->queue.create(size) < 0) {
-		save_errno = EINVAL;
-		goto close_producer_fds;
-	}
+	queue->producer_fds_state = XTM_FDS_READY;
 	return queue;
 
-close_producer_fds:
-	close(queue->producer_read_fd);
-	if (queue->producer_read_fd != queue->producer_write_fd)
-		close(queue->producer_write_fd);
 close_consumer_fds:
 	close(queue->consumer_read_fd);
 	if (queue->consumer_read_fd != queue->consumer_write_fd)
@@ -186,38 +854,137 @@ xtm_queue_delete(struct xtm_queue *queue, unsigned flags)
 {
 	int rc = 0;
 	assert((flags & (~XTM_QUEUE_DELETE_VALID_FLAGS)) == 0);
-	if (((flags & XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD) != 0) &&
-	    close(queue->producer_read_fd) < 0)
-		rc = -1;
-	if (queue->producer_read_fd != queue->producer_write_fd &&
-	    close(queue->producer_write_fd) < 0)
-		rc = -1;
-	if (((flags & XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD) != 0) &&
-	    close(queue->consumer_read_fd) < 0)
-		rc = -1;
-	if (queue->consumer_read_fd != queue->consumer_write_fd &&
-	    close(queue->consumer_write_fd) < 0)
+	queue_unlink_dirty(queue);
+	if (queue->producer_fds_state == XTM_FDS_READY) {
+		if (((flags & XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD) != 0) &&
+		    close(queue->producer_read_fd) < 0)
+			rc = -1;
+		if (queue->producer_read_fd != queue->producer_write_fd &&
+		    close(queue->producer_write_fd) < 0)
+			rc = -1;
+	}
+	if (queue->consumer_fds_state == XTM_FDS_READY) {
+		if (((flags & XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD) != 0) &&
+		    close(queue->consumer_read_fd) < 0)
+			rc = -1;
+		if (queue->consumer_read_fd != queue->consumer_write_fd &&
+		    close(queue->consumer_write_fd) < 0)
+			rc = -1;
+	}
+	if (queue->flush_fd >= 0 && close(queue->flush_fd) < 0)
 		rc = -1;
+	struct xtm_queue_segment *segment = queue->consumer_segment;
+	while (segment != NULL) {
+		struct xtm_queue_segment *next = segment->next;
+		if (segment != &queue->segment)
+			free(segment);
+		segment = next;
+	}
+	struct xtm_scsp_queue_read_iterator<struct xtm_queue_segment *,
+		decltype(queue->segment_cache)> iter;
+	struct xtm_queue_segment *const *cached;
+	iter.begin(&queue->segment_cache);
+	while ((cached = iter.read()) != nullptr) {
+		if (*cached != &queue->segment)
+			free(*cached);
+	}
+	free(queue->profile);
 	free(queue);
 	return rc;
 }
 
+/**
+ * Arm linger timer of the queue, if producer watches it, or disarm
+ * it, if usec is 0, so that it doesn't fire after pending messages
+ * are notified.
+ */
+static inline int
+flush_timer_set(struct xtm_queue *queue, unsigned usec)
+{
+#ifdef TARANTOOL_XTM_HAVE_TIMERFD
+	if (queue->flush_fd < 0)
+		return 0;
+	struct itimerspec its;
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = (usec % 1000000) * 1000;
+	return timerfd_settime(queue->flush_fd, 0, &its, NULL);
+#else /* !defined(TARANTOOL_XTM_HAVE_TIMERFD) */
+	(void)queue;
+	(void)usec;
+	return 0;
+#endif /* defined(TARANTOOL_XTM_HAVE_TIMERFD) */
+}
+
+/**
+ * Forget messages, pushed without notification, since consumer is
+ * going to be notified about them, and disarm linger timer.
+ */
+static inline int
+pending_reset(struct xtm_queue *queue)
+{
+	if (queue->pending_count == 0)
+		return 0;
+	queue->pending_count = 0;
+	return flush_timer_set(queue, 0);
+}
+
 int
 xtm_queue_notify_consumer(struct xtm_queue *queue)
 {
-	return notify_fd(queue->consumer_write_fd);
+	queue_publish(queue);
+	if (pending_reset(queue) != 0)
+		return -1;
+	/*
+	 * In edge-triggered mode busy consumer will see new messages
+	 * before it waits, so notify it only if it is already waiting.
+	 * Exchange also orders our push before the flag check.
+	 */
+	if ((queue->flags & XTM_QUEUE_EDGE_TRIGGERED) != 0 &&
+	    !__atomic_exchange_n(&queue->is_consumer_waiting, false,
+				 __ATOMIC_SEQ_CST)) {
+		XTM_PROBE1(notify_elided, queue);
+		return 0;
+	}
+	return notify_consumer_fd(queue);
+}
+
+int
+xtm_flush_notifications(void)
+{
+	int rc = 0;
+	struct xtm_queue *queue;
+	while ((queue = dirty_queues) != NULL) {
+		dirty_queues = queue->next_dirty;
+		queue->is_dirty = false;
+		if (xtm_queue_notify_consumer(queue) != 0)
+			rc = -1;
+	}
+	return rc;
 }
 
 int
 xtm_queue_notify_producer(struct xtm_queue *queue)
 {
+	if ((queue->flags & XTM_QUEUE_POLLED) != 0)
+		return 0;
+	if (get_fds(&queue->producer_fds_state, &queue->producer_read_fd,
+		    &queue->producer_write_fd) < 0)
+		return -1;
+	__atomic_store_n(&queue->is_producer_fd_notified, true,
+			 __ATOMIC_RELAXED);
+	XTM_PROBE1(producer_wakeup, queue);
 	return notify_fd(queue->producer_write_fd);
 }
 
 int
 xtm_queue_probe(struct xtm_queue *queue)
 {
-	if (queue->queue.free_count() == 0) {
+	/* Free space is known only for published messages. */
+	queue_publish(queue);
+	if ((queue->flags & XTM_QUEUE_UNBOUNDED) == 0 &&
+	    queue->producer_segment->queue.free_count() == 0) {
 		errno = ENOBUFS;
 		return -1;
 	}
@@ -227,20 +994,68 @@ xtm_queue_probe(struct xtm_queue *queue)
 unsigned
 xtm_queue_count(struct xtm_queue *queue)
 {
-	return queue->queue.count();
+	unsigned cnt = 0;
+	struct xtm_queue_segment *segment = queue->consumer_segment;
+	for (; segment != NULL;
+	     segment = __atomic_load_n(&segment->next, __ATOMIC_ACQUIRE))
+		cnt += segment->queue.count();
+	return cnt;
 }
 
-int
-xtm_queue_push_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
-		   void *fun_arg, unsigned flags)
+/**
+ * Auto notification policy, called by producer after each push.
+ * Consumer is notified immediately, if it is waiting, otherwise
+ * notification is deferred until notify_batch messages are pushed
+ * or producer flushes the queue.
+ */
+static inline int
+auto_notify(struct xtm_queue *queue)
 {
-	union xtm_msg xtm_msg;
-	xtm_msg.fun = fun;
-	xtm_msg.fun_arg = fun_arg;
-	if (queue->queue.put(&xtm_msg, 1) != 0)
-		return 0;
+	/*
+	 * Order the push before the load of the flag. The flag is
+	 * written only when it is set, so busy consumer doesn't lose
+	 * its cache line on each push.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queue->is_consumer_waiting, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&queue->is_consumer_waiting, false,
+				__ATOMIC_RELAXED)) {
+		if (pending_reset(queue) != 0)
+			return -1;
+		return notify_consumer_fd(queue);
+	}
+	if (++queue->pending_count >= queue->notify_batch)
+		return xtm_queue_notify_consumer(queue);
+	XTM_PROBE1(notify_elided, queue);
+	if (queue->pending_count == 1)
+		return flush_timer_set(queue, queue->notify_linger_usec);
+	return 0;
+}
 
+/**
+ * Push message to the queue, common part of push_fun and push_ptr.
+ */
+template <class T>
+static inline int
+push_msg(struct xtm_queue *queue, T *xtm_msg, unsigned flags)
+{
 	assert((flags & (~XTM_QUEUE_PUSH_VALID_FLAGS)) == 0);
+	if (producer_put(queue, xtm_msg))
+		goto success;
+
+	/*
+	 * Consumer must see all messages in the full segment, before
+	 * producer waits for it or switches to the next segment.
+	 */
+	queue_publish(queue);
+	if ((queue->flags & XTM_QUEUE_UNBOUNDED) != 0) {
+		if (producer_next_segment(queue, xtm_msg) != 0) {
+			XTM_PROBE2(push_fail, queue, errno);
+			return -1;
+		}
+		goto success;
+	}
+
 	if ((flags & XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS) == 0)
 		goto error;
 
@@ -255,83 +1070,668 @@ xtm_queue_push_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
 	 * In this case we try to push again (consumer thread freed space in
 	 * queue in this case).
 	 */
-	if (queue->queue.put(&xtm_msg, 1) != 0)
-		return 0;
+	if (producer_put(queue, xtm_msg))
+		goto success;
 
 error:
+	XTM_PROBE2(push_fail, queue, ENOBUFS);
 	errno = ENOBUFS;
 	return -1;
+success:
+	XTM_PROBE1(push, queue);
+	/*
+	 * Message is already in the queue, so a failed notification
+	 * is not reported, consumer will see it on the next one.
+	 */
+	if ((queue->flags & XTM_QUEUE_AUTO_NOTIFY) != 0)
+		auto_notify(queue);
+	if ((flags & XTM_QUEUE_DEFERRED_NOTIFY) != 0 && !queue->is_dirty) {
+		queue->is_dirty = true;
+		queue->next_dirty = dirty_queues;
+		dirty_queues = queue;
+	}
+	return 0;
+}
+
+int
+xtm_queue_push_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
+		   void *fun_arg, unsigned flags)
+{
+	struct xtm_queue_msg xtm_msg;
+	assert((queue->flags & XTM_QUEUE_PTR_ONLY) == 0);
+	xtm_msg.fun = fun;
+	xtm_msg.arg = fun_arg;
+	return push_msg(queue, &xtm_msg, flags);
 }
 
 int
 xtm_queue_consumer_fd(struct xtm_queue *queue)
 {
+	if ((queue->flags & XTM_QUEUE_POLLED) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (get_fds(&queue->consumer_fds_state, &queue->consumer_read_fd,
+		    &queue->consumer_write_fd) < 0)
+		return -1;
 	return queue->consumer_read_fd;
 }
 
 int
 xtm_queue_producer_fd(struct xtm_queue *queue)
 {
+	if ((queue->flags & XTM_QUEUE_POLLED) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (get_fds(&queue->producer_fds_state, &queue->producer_read_fd,
+		    &queue->producer_write_fd) < 0)
+		return -1;
 	return queue->producer_read_fd;
 }
 
+int
+xtm_queue_set_auto_notify(struct xtm_queue *queue, unsigned batch,
+			  unsigned linger_usec)
+{
+	if ((queue->flags & XTM_QUEUE_AUTO_NOTIFY) == 0 || batch == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	queue->notify_batch = batch;
+	queue->notify_linger_usec = linger_usec;
+	return 0;
+}
+
+int
+xtm_queue_set_publish_batch(struct xtm_queue *queue, unsigned batch)
+{
+	if (batch == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	queue->publish_batch = batch;
+	return 0;
+}
+
+int
+xtm_queue_flush(struct xtm_queue *queue)
+{
+	queue_publish(queue);
+	if (queue->pending_count == 0)
+		return 0;
+	return xtm_queue_notify_consumer(queue);
+}
+
+int
+xtm_queue_flush_fd(struct xtm_queue *queue)
+{
+#ifdef TARANTOOL_XTM_HAVE_TIMERFD
+	if (queue->flush_fd < 0)
+		queue->flush_fd = timerfd_create(CLOCK_MONOTONIC,
+						 TFD_NONBLOCK | TFD_CLOEXEC);
+	return queue->flush_fd;
+#else /* !defined(TARANTOOL_XTM_HAVE_TIMERFD) */
+	(void)queue;
+	errno = ENOTSUP;
+	return -1;
+#endif /* defined(TARANTOOL_XTM_HAVE_TIMERFD) */
+}
+
+int
+xtm_queue_set_idle_trim(struct xtm_queue *queue, unsigned idle_usec)
+{
+#ifdef TARANTOOL_XTM_HAVE_MADV_DONTNEED
+	queue->idle_trim_usec = idle_usec;
+	queue->trim_segment = NULL;
+	queue->is_trimmed = false;
+	return 0;
+#else /* !defined(TARANTOOL_XTM_HAVE_MADV_DONTNEED) */
+	(void)queue;
+	(void)idle_usec;
+	errno = ENOTSUP;
+	return -1;
+#endif /* defined(TARANTOOL_XTM_HAVE_MADV_DONTNEED) */
+}
+
+#ifdef TARANTOOL_XTM_HAVE_MADV_DONTNEED
+/**
+ * Return whole pages of the message ring of the segment to the kernel.
+ */
+static int
+madvise_segment(struct xtm_queue *queue, struct xtm_queue_segment *segment)
+{
+	static uintptr_t page_size = 0;
+	if (page_size == 0)
+		page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t data = (uintptr_t)segment->queue.data();
+	uintptr_t begin = (data + page_size - 1) & ~(page_size - 1);
+	uintptr_t end = (data + segment->queue.size() *
+			 queue_msg_size(queue->flags)) & ~(page_size - 1);
+	if (begin >= end)
+		return 0;
+	return madvise((void *)begin, end - begin, MADV_DONTNEED);
+}
+
+int
+xtm_queue_trim(struct xtm_queue *queue)
+{
+	if (queue->idle_trim_usec == 0)
+		return 0;
+	queue_publish(queue);
+	uint64_t now = clock_now_nsec() / 1000;
+	struct xtm_queue_segment *segment = queue->producer_segment;
+	unsigned write_pos = segment->queue.write_pos();
+	if (segment != queue->trim_segment ||
+	    write_pos != queue->trim_write_pos ||
+	    segment->queue.count() != 0) {
+		queue->trim_segment = segment;
+		queue->trim_write_pos = write_pos;
+		queue->idle_since_usec = now;
+		queue->is_trimmed = false;
+		return 0;
+	}
+	if (queue->is_trimmed ||
+	    now - queue->idle_since_usec < queue->idle_trim_usec)
+		return 0;
+	/*
+	 * Queue is empty, so consumer has finished with all messages
+	 * before it published its read position, which we have loaded
+	 * with acquire semantics. Producer is the only writer, so the
+	 * ring can't be written, while it is being trimmed.
+	 */
+	int rc = 1;
+	queue->is_trimmed = true;
+	if (madvise_segment(queue, segment) != 0)
+		rc = -1;
+	/*
+	 * Drained segments, cached for reuse in unbounded mode, are
+	 * freed. The first segment can't be freed, so its ring is
+	 * trimmed, and it is not reused anymore.
+	 */
+	struct xtm_scsp_queue_read_iterator<struct xtm_queue_segment *,
+		decltype(queue->segment_cache)> iter;
+	struct xtm_queue_segment *const *cached;
+	iter.begin(&queue->segment_cache);
+	while ((cached = iter.read()) != nullptr) {
+		if (*cached != &queue->segment)
+			free(*cached);
+		else if (madvise_segment(queue, *cached) != 0)
+			rc = -1;
+	}
+	iter.end();
+	return rc;
+}
+#else /* !defined(TARANTOOL_XTM_HAVE_MADV_DONTNEED) */
+int
+xtm_queue_trim(struct xtm_queue *queue)
+{
+	(void)queue;
+	return 0;
+}
+#endif /* defined(TARANTOOL_XTM_HAVE_MADV_DONTNEED) */
+
+int
+xtm_queue_consumer_epoll_add(struct xtm_queue *queue, int epfd, void *data)
+{
+#ifdef TARANTOOL_XTM_USE_EPOLL
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	if ((queue->flags & XTM_QUEUE_EDGE_TRIGGERED) != 0)
+		ev.events |= EPOLLET;
+	ev.data.ptr = data;
+	int fd = xtm_queue_consumer_fd(queue);
+	if (fd < 0)
+		return -1;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+#else /* !defined(TARANTOOL_XTM_USE_EPOLL) */
+	(void)queue;
+	(void)epfd;
+	(void)data;
+	errno = ENOTSUP;
+	return -1;
+#endif /* defined(TARANTOOL_XTM_USE_EPOLL) */
+}
+
+int
+xtm_queue_consumer_epoll_del(struct xtm_queue *queue, int epfd)
+{
+#ifdef TARANTOOL_XTM_USE_EPOLL
+	int fd = xtm_queue_consumer_fd(queue);
+	if (fd < 0)
+		return -1;
+	/* Event argument is ignored, but old kernels require it. */
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+#else /* !defined(TARANTOOL_XTM_USE_EPOLL) */
+	(void)queue;
+	(void)epfd;
+	errno = ENOTSUP;
+	return -1;
+#endif /* defined(TARANTOOL_XTM_USE_EPOLL) */
+}
+
+int
+xtm_queue_consumer_release(struct xtm_queue *queue)
+{
+	if (__atomic_load_n(&queue->is_consumer_released, __ATOMIC_RELAXED)) {
+		errno = EINVAL;
+		return -1;
+	}
+	/*
+	 * Consumer state: read position, consumer segment and batch
+	 * functions, is published to the thread, which acquires the
+	 * queue. Producers don't look at this flag and keep pushing.
+	 */
+	__atomic_store_n(&queue->is_consumer_released, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+xtm_queue_consumer_acquire(struct xtm_queue *queue)
+{
+	bool released = true;
+	if (!__atomic_compare_exchange_n(&queue->is_consumer_released,
+					 &released, false, false,
+					 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		errno = EBUSY;
+		return -1;
+	}
+	/*
+	 * Producers may have skipped notification, while the queue had
+	 * no consumer: in edge-triggered mode old consumer may have been
+	 * busy, and notification, which was written to consumer fd, may
+	 * have been consumed by old consumer. So new consumer notifies
+	 * itself and checks the queue in its next loop iteration.
+	 */
+	if ((queue->flags & XTM_QUEUE_EDGE_TRIGGERED) != 0)
+		__atomic_store_n(&queue->is_consumer_waiting, false,
+				 __ATOMIC_SEQ_CST);
+	return notify_consumer_fd(queue);
+}
+
+int
+xtm_queue_set_batch_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
+			xtm_queue_batch_fun_t batch_fun)
+{
+	unsigned i;
+	for (i = 0; i < queue->batch_fun_count; i++) {
+		if (queue->batch_funs[i].fun == fun)
+			break;
+	}
+	if (batch_fun == NULL) {
+		if (i < queue->batch_fun_count)
+			queue->batch_funs[i] =
+				queue->batch_funs[--queue->batch_fun_count];
+		return 0;
+	}
+	if (i == XTM_BATCH_FUN_MAX) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (i == queue->batch_fun_count)
+		queue->batch_fun_count++;
+	queue->batch_funs[i].fun = fun;
+	queue->batch_funs[i].batch_fun = batch_fun;
+	return 0;
+}
+
+/**
+ * Find or add entry of the function in profiler table. If table
+ * is full, returns entry, which sums up the rest of functions.
+ */
+static struct xtm_queue_fun_stats *
+profile_fun_stats(struct xtm_profile *profile, xtm_queue_fun_t fun)
+{
+	/* Fibonacci hashing of function address. */
+	unsigned i = (unsigned)(((uint64_t)(uintptr_t)fun *
+				 11400714819323198485ull) >>
+				(64 - XTM_PROFILE_FUN_BITS));
+	for (unsigned n = 0; n < XTM_PROFILE_FUN_MAX; n++) {
+		struct xtm_queue_fun_stats *stats = &profile->funs[i];
+		if (stats->fun == fun)
+			return stats;
+		if (stats->fun == NULL) {
+			stats->fun = fun;
+			return stats;
+		}
+		i = (i + 1) & (XTM_PROFILE_FUN_MAX - 1);
+	}
+	return &profile->overflow;
+}
+
+/**
+ * Account sampled invocation of the function, which handled count
+ * messages, to the function statistics.
+ */
+static void
+profile_account(struct xtm_profile *profile, xtm_queue_fun_t fun,
+		unsigned count, uint64_t nsec)
+{
+	struct xtm_queue_fun_stats *stats = profile_fun_stats(profile, fun);
+	stats->calls += count;
+	stats->total_nsec += nsec;
+	if (nsec > stats->max_nsec)
+		stats->max_nsec = nsec;
+}
+
+/**
+ * Check whether the next invocation must be timed.
+ */
+static inline bool
+profile_sample(struct xtm_profile *profile)
+{
+	if (--profile->countdown != 0)
+		return false;
+	profile->countdown = profile->period;
+	return true;
+}
+
+static inline void
+batch_begin(struct xtm_queue *queue, struct xtm_batch *batch)
+{
+	batch->fun = NULL;
+	batch->batch_fun = NULL;
+	batch->count = 0;
+	batch->profile = queue->profile;
+}
+
+/**
+ * Call batch function for collected arguments, if any.
+ */
+static inline void
+batch_flush(struct xtm_batch *batch)
+{
+	if (batch->count == 0)
+		return;
+	if (batch->profile != NULL && profile_sample(batch->profile)) {
+		uint64_t start = clock_now_nsec();
+		batch->batch_fun(batch->args, batch->count);
+		profile_account(batch->profile, batch->fun, batch->count,
+				clock_now_nsec() - start);
+	} else {
+		batch->batch_fun(batch->args, batch->count);
+	}
+	batch->count = 0;
+}
+
+/**
+ * Invoke function of the message, or collect its argument, if batch
+ * function is registered for it. Collected arguments are passed to
+ * batch function, when message with another function is met, when
+ * the batch is full or by batch_flush.
+ */
+static inline void
+batch_invoke(struct xtm_queue *queue, struct xtm_batch *batch,
+	     const struct xtm_queue_msg *xtm_msg)
+{
+	if (xtm_msg->fun != batch->fun) {
+		batch_flush(batch);
+		batch->fun = xtm_msg->fun;
+		batch->batch_fun = NULL;
+		for (unsigned i = 0; i < queue->batch_fun_count; i++) {
+			if (queue->batch_funs[i].fun == xtm_msg->fun) {
+				batch->batch_fun = queue->batch_funs[i].batch_fun;
+				break;
+			}
+		}
+	}
+	if (batch->batch_fun == NULL) {
+		if (batch->profile != NULL && profile_sample(batch->profile)) {
+			uint64_t start = clock_now_nsec();
+			xtm_msg->fun(xtm_msg->arg);
+			profile_account(batch->profile, xtm_msg->fun, 1,
+					clock_now_nsec() - start);
+		} else {
+			xtm_msg->fun(xtm_msg->arg);
+		}
+		return;
+	}
+	batch->args[batch->count++] = xtm_msg->arg;
+	if (batch->count == XTM_BATCH_ARGS_MAX)
+		batch_flush(batch);
+}
+
 unsigned
 xtm_queue_invoke_funs_all(struct xtm_queue *queue)
 {
-	struct xtm_scsp_queue_read_iterator<xtm_msg> iter;
-	const union xtm_msg *xtm_msg;
+	struct xtm_scsp_queue_read_iterator<xtm_queue_msg> iter;
+	const struct xtm_queue_msg *xtm_msg;
+	struct xtm_batch batch;
 	unsigned cnt = 0;
 
-	iter.begin(&queue->queue);
-	while((xtm_msg = iter.read()) != nullptr) {
-		xtm_msg->fun(xtm_msg->fun_arg);
-		cnt++;
-	}
-	iter.end();
+	assert((queue->flags & XTM_QUEUE_PTR_ONLY) == 0);
+	XTM_PROBE1(drain_start, queue);
+	batch_begin(queue, &batch);
+	do {
+		iter.begin(&consumer_segment(queue)->queue);
+		while((xtm_msg = iter.read()) != nullptr) {
+			prefetch_msgs(&iter);
+			batch_invoke(queue, &batch, xtm_msg);
+			cnt++;
+		}
+		iter.end();
+	} while (consumer_has_next(queue));
+	batch_flush(&batch);
+	consumer_wait(queue, &iter);
+	XTM_PROBE2(drain_end, queue, cnt);
 	return cnt;
 }
 
 int
-xtm_queue_push_ptr(struct xtm_queue *queue, void *ptr, unsigned flags)
+xtm_queue_set_profiling(struct xtm_queue *queue, unsigned sample_period)
 {
-	union xtm_msg xtm_msg;
-	xtm_msg.ptr = ptr;
-	if (queue->queue.put(&xtm_msg, 1) != 0)
+	if (sample_period == 0) {
+		free(queue->profile);
+		queue->profile = NULL;
 		return 0;
+	}
+	if (queue->profile == NULL) {
+		queue->profile = (struct xtm_profile *)
+			malloc(sizeof(struct xtm_profile));
+		if (queue->profile == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	memset(queue->profile, 0, sizeof(struct xtm_profile));
+	queue->profile->period = sample_period;
+	queue->profile->countdown = sample_period;
+	return 0;
+}
 
-	assert((flags & (~XTM_QUEUE_PUSH_VALID_FLAGS)) == 0);
-	if ((flags & XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS) == 0)
-		goto error;
+unsigned
+xtm_queue_get_fun_stats(struct xtm_queue *queue,
+			struct xtm_queue_fun_stats *stats, unsigned count)
+{
+	struct xtm_profile *profile = queue->profile;
+	unsigned filled = 0;
+	if (profile == NULL)
+		return 0;
+	for (unsigned i = 0; i < XTM_PROFILE_FUN_MAX && filled < count; i++) {
+		if (profile->funs[i].fun != NULL)
+			stats[filled++] = profile->funs[i];
+	}
+	if (profile->overflow.calls != 0 && filled < count)
+		stats[filled++] = profile->overflow;
+	return filled;
+}
 
-	__atomic_store_n(&queue->is_producer_should_be_notified, true,
-			 __ATOMIC_SEQ_CST);
+int
+xtm_queue_push_ptr(struct xtm_queue *queue, void *ptr, unsigned flags)
+{
+	struct xtm_queue_msg xtm_msg;
+	if ((queue->flags & XTM_QUEUE_PTR_ONLY) != 0)
+		return push_msg(queue, &ptr, flags);
+	xtm_msg.fun = NULL;
+	xtm_msg.arg = ptr;
+	return push_msg(queue, &xtm_msg, flags);
+}
 
-	/** See comment about this in xtm_queue_push_fun. */
-	if (queue->queue.put(&xtm_msg, 1) != 0)
-		return 0;
+/**
+ * Pop pointers from queue of pointers, see XTM_QUEUE_PTR_ONLY.
+ * Pointers are copied from contiguous spans of the ring at once.
+ */
+static unsigned
+pop_ptrs_only(struct xtm_queue *queue, void **ptr_array,
+	      unsigned ptr_array_count)
+{
+	struct xtm_scsp_queue<void *> *ring;
+	void **first, **second;
+	unsigned first_count, second_count;
+	unsigned cnt = 0;
 
-error:
-	errno = ENOBUFS;
-	return -1;
+	do {
+		ring = &consumer_segment(queue)->ptr_queue;
+		ring->peek(&first, &first_count, &second, &second_count);
+		if (first_count > ptr_array_count - cnt)
+			first_count = ptr_array_count - cnt;
+		memcpy(ptr_array + cnt, first, first_count * sizeof(void *));
+		cnt += first_count;
+		if (second_count > ptr_array_count - cnt)
+			second_count = ptr_array_count - cnt;
+		memcpy(ptr_array + cnt, second, second_count * sizeof(void *));
+		cnt += second_count;
+		ring->release(first_count + second_count);
+	} while (cnt < ptr_array_count && consumer_has_next(queue));
+	if (cnt < ptr_array_count &&
+	    (queue->flags & XTM_QUEUE_CONSUMER_WAITING_FLAGS) != 0) {
+		struct xtm_scsp_queue_read_iterator<void *> iter;
+		iter.begin(ring);
+		if (iter.is_end())
+			consumer_wait(queue, &iter);
+	}
+	return cnt;
 }
 
 unsigned
 xtm_queue_pop_ptrs(struct xtm_queue *queue, void **ptr_array,
 		   unsigned ptr_array_count)
 {
-	struct xtm_scsp_queue_read_iterator<xtm_msg> iter;
-	const union xtm_msg *xtm_msg;
+	struct xtm_scsp_queue_read_iterator<xtm_queue_msg> iter;
+	const struct xtm_queue_msg *xtm_msg;
 	void **ptr_array_begin = ptr_array;
 	void **ptr_array_end = ptr_array + ptr_array_count;
+	unsigned cnt;
 
-	iter.begin(&queue->queue);
-	while(ptr_array < ptr_array_end &&
-	      (xtm_msg = iter.read()) != nullptr) {
-		*ptr_array = xtm_msg->ptr;
-		++ptr_array;
+	XTM_PROBE1(drain_start, queue);
+	if ((queue->flags & XTM_QUEUE_PTR_ONLY) != 0) {
+		cnt = pop_ptrs_only(queue, ptr_array, ptr_array_count);
+		XTM_PROBE2(drain_end, queue, cnt);
+		return cnt;
 	}
-	iter.end();
-	return ptr_array - ptr_array_begin;
+
+	do {
+		iter.begin(&consumer_segment(queue)->queue);
+		while(ptr_array < ptr_array_end &&
+		      (xtm_msg = iter.read()) != nullptr) {
+			prefetch_msgs(&iter);
+			*ptr_array = xtm_msg->arg;
+			++ptr_array;
+		}
+		iter.end();
+	} while (ptr_array < ptr_array_end && consumer_has_next(queue));
+	if (iter.is_end())
+		consumer_wait(queue, &iter);
+	cnt = ptr_array - ptr_array_begin;
+	XTM_PROBE2(drain_end, queue, cnt);
+	return cnt;
+}
+
+unsigned
+xtm_queue_peek(struct xtm_queue *queue, struct xtm_queue_span spans[2])
+{
+	assert((queue->flags & XTM_QUEUE_PTR_ONLY) == 0);
+	return consumer_segment(queue)->queue.peek(&spans[0].msgs,
+						   &spans[0].count,
+						   &spans[1].msgs,
+						   &spans[1].count);
+}
+
+void
+xtm_queue_release(struct xtm_queue *queue, unsigned count)
+{
+	struct xtm_scsp_queue_read_iterator<xtm_queue_msg> iter;
+	assert((queue->flags & XTM_QUEUE_PTR_ONLY) == 0);
+	queue->consumer_segment->queue.release(count);
+	if ((queue->flags & XTM_QUEUE_CONSUMER_WAITING_FLAGS) == 0)
+		return;
+	iter.begin(&queue->consumer_segment->queue);
+	if (iter.is_end())
+		consumer_wait(queue, &iter);
+}
+
+/**
+ * Handle messages of queue of pointers, see XTM_QUEUE_PTR_ONLY,
+ * consumer part of xtm_queue_drain.
+ */
+static int
+drain_ptrs(struct xtm_queue *queue, xtm_queue_ptr_fun_t fun, void *ctx)
+{
+	struct xtm_scsp_queue_read_iterator<void *> iter;
+	void *const *ptr;
+	int cnt = 0;
+
+	assert(fun != NULL);
+	do {
+		iter.begin(&consumer_segment(queue)->ptr_queue);
+		while ((ptr = iter.read()) != nullptr) {
+			prefetch_ptrs(&iter);
+			fun(*ptr, ctx);
+			if (++cnt % XTM_DRAIN_PUBLISH_STEP == 0)
+				iter.end();
+		}
+		iter.end();
+	} while (consumer_has_next(queue));
+	consumer_wait(queue, &iter);
+	return cnt;
+}
+
+int
+xtm_queue_drain(struct xtm_queue *queue, xtm_queue_ptr_fun_t fun, void *ctx)
+{
+	struct xtm_scsp_queue_read_iterator<xtm_queue_msg> iter;
+	const struct xtm_queue_msg *xtm_msg;
+	struct xtm_batch batch;
+	int cnt = 0;
+
+	/* Consumer fd is consumed only if it is created. */
+	if ((queue->flags & XTM_QUEUE_EDGE_TRIGGERED) == 0 &&
+	    __atomic_load_n(&queue->consumer_fds_state,
+			    __ATOMIC_ACQUIRE) == XTM_FDS_READY &&
+	    xtm_queue_consume(queue->consumer_read_fd) != 0)
+		return -1;
+
+	XTM_PROBE1(drain_start, queue);
+	if ((queue->flags & XTM_QUEUE_PTR_ONLY) != 0) {
+		cnt = drain_ptrs(queue, fun, ctx);
+		goto notify_producer;
+	}
+	batch_begin(queue, &batch);
+	do {
+		iter.begin(&consumer_segment(queue)->queue);
+		while ((xtm_msg = iter.read()) != nullptr) {
+			prefetch_msgs(&iter);
+			if (fun != NULL)
+				fun(xtm_msg->arg, ctx);
+			else
+				batch_invoke(queue, &batch, xtm_msg);
+			if (++cnt % XTM_DRAIN_PUBLISH_STEP == 0)
+				iter.end();
+		}
+		iter.end();
+	} while (consumer_has_next(queue));
+	batch_flush(&batch);
+	consumer_wait(queue, &iter);
+
+notify_producer:
+	XTM_PROBE2(drain_end, queue, cnt);
+	/* Try to notify producer again, if queue was full */
+	if (xtm_queue_get_reset_was_full(queue) &&
+	    xtm_queue_notify_producer(queue) != 0)
+		return -1;
+	return cnt;
 }
 
 int
@@ -340,6 +1740,7 @@ xtm_queue_consume(int fd)
 	unsigned char tmp[XTM_PIPE_SIZE];
 	ssize_t read_bytes;
 
+	XTM_PROBE1(consume, fd);
 	while ((read_bytes = read(fd, tmp, sizeof(tmp))) < 0 && errno == EINTR)
 		;
 	if (read_bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
@@ -359,3 +1760,467 @@ xtm_queue_get_reset_was_full(struct xtm_queue *queue)
 	return __atomic_exchange_n(&queue->is_producer_should_be_notified,
 				   false, __ATOMIC_ACQUIRE);
 }
+
+struct xtm_queue_pool *
+xtm_queue_pool_new(unsigned size, unsigned flags, unsigned capacity)
+{
+	struct xtm_queue_pool *pool = (struct xtm_queue_pool *)
+		malloc(sizeof(struct xtm_queue_pool) +
+		       capacity * sizeof(struct xtm_queue *));
+	if (pool == NULL)
+		return NULL;
+	pool->size = size;
+	pool->flags = flags;
+	pool->capacity = capacity;
+	for (pool->count = 0; pool->count < capacity; pool->count++) {
+		struct xtm_queue *queue = xtm_queue_new_ex(size, flags);
+		if (queue == NULL) {
+			int save_errno = errno;
+			xtm_queue_pool_delete(pool);
+			errno = save_errno;
+			return NULL;
+		}
+		pool->queues[pool->count] = queue;
+	}
+	return pool;
+}
+
+int
+xtm_queue_pool_delete(struct xtm_queue_pool *pool)
+{
+	int rc = 0;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < pool->count; i++) {
+		if (xtm_queue_delete(pool->queues[i], flags) != 0)
+			rc = -1;
+	}
+	free(pool);
+	return rc;
+}
+
+struct xtm_queue *
+xtm_queue_pool_acquire(struct xtm_queue_pool *pool)
+{
+	if (pool->count == 0)
+		return xtm_queue_new_ex(pool->size, pool->flags);
+	return pool->queues[--pool->count];
+}
+
+int
+xtm_queue_pool_release(struct xtm_queue_pool *pool, struct xtm_queue *queue)
+{
+	int rc = 0;
+	assert(queue->flags == pool->flags);
+	assert(queue->segment_size == pool->size);
+	if (pool->count == pool->capacity) {
+		unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+				 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+		return xtm_queue_delete(queue, flags);
+	}
+	/*
+	 * Both threads have stopped using the queue, so its fds are
+	 * drained only if they were written, and drained without
+	 * races. A pending flush timer is not disarmed: it may make
+	 * flush fd readable once, which is harmless.
+	 */
+	if (queue->is_consumer_fd_notified &&
+	    xtm_queue_consume(queue->consumer_read_fd) != 0)
+		rc = -1;
+	if (queue->is_producer_fd_notified &&
+	    xtm_queue_consume(queue->producer_read_fd) != 0)
+		rc = -1;
+	queue_unlink_dirty(queue);
+	if ((queue->flags & XTM_QUEUE_UNBOUNDED) != 0)
+		queue_reset_segments(queue);
+	free(queue->profile);
+	queue_init(queue);
+	queue->segment.queue.create(queue->segment_size);
+	pool->queues[pool->count++] = queue;
+	return rc;
+}
+
+struct xtm_mailbox *
+xtm_mailbox_new(unsigned size)
+{
+	struct xtm_mailbox *mailbox = (struct xtm_mailbox *)
+		malloc(sizeof(struct xtm_mailbox));
+	if (mailbox == NULL)
+		return NULL;
+	/* Buffers don't share cache lines, so writes don't disturb reads. */
+	mailbox->stride = (size + 63) & ~63u;
+	if (mailbox->stride == 0)
+		mailbox->stride = 64;
+	void *buffers;
+	if (posix_memalign(&buffers, 64, 3 * mailbox->stride) != 0) {
+		free(mailbox);
+		errno = ENOMEM;
+		return NULL;
+	}
+	mailbox->buffers = (char *)buffers;
+	if (create_fds(&mailbox->consumer_read_fd,
+		       &mailbox->consumer_write_fd) < 0) {
+		int save_errno = errno;
+		free(mailbox->buffers);
+		free(mailbox);
+		errno = save_errno;
+		return NULL;
+	}
+	mailbox->front = 0;
+	mailbox->middle = 1;
+	mailbox->back = 2;
+	mailbox->size = size;
+	return mailbox;
+}
+
+int
+xtm_mailbox_delete(struct xtm_mailbox *mailbox, unsigned flags)
+{
+	int rc = 0;
+	assert((flags & (~XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD)) == 0);
+	if (((flags & XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD) != 0) &&
+	    close(mailbox->consumer_read_fd) < 0)
+		rc = -1;
+	if (mailbox->consumer_read_fd != mailbox->consumer_write_fd &&
+	    close(mailbox->consumer_write_fd) < 0)
+		rc = -1;
+	free(mailbox->buffers);
+	free(mailbox);
+	return rc;
+}
+
+int
+xtm_mailbox_write(struct xtm_mailbox *mailbox, const void *value)
+{
+	memcpy(mailbox->buffers + mailbox->back * mailbox->stride, value,
+	       mailbox->size);
+	unsigned old = __atomic_exchange_n(&mailbox->middle,
+					   mailbox->back | XTM_MAILBOX_DIRTY,
+					   __ATOMIC_ACQ_REL);
+	mailbox->back = old & XTM_MAILBOX_INDEX_MASK;
+	/*
+	 * If the previous value is not read yet, consumer is already
+	 * notified and will read the new one instead.
+	 */
+	if ((old & XTM_MAILBOX_DIRTY) != 0)
+		return 0;
+	return notify_fd(mailbox->consumer_write_fd);
+}
+
+const void *
+xtm_mailbox_read(struct xtm_mailbox *mailbox)
+{
+	if ((__atomic_load_n(&mailbox->middle, __ATOMIC_RELAXED) &
+	     XTM_MAILBOX_DIRTY) == 0)
+		return NULL;
+	unsigned old = __atomic_exchange_n(&mailbox->middle, mailbox->front,
+					   __ATOMIC_ACQ_REL);
+	mailbox->front = old & XTM_MAILBOX_INDEX_MASK;
+	return mailbox->buffers + mailbox->front * mailbox->stride;
+}
+
+int
+xtm_mailbox_consumer_fd(struct xtm_mailbox *mailbox)
+{
+	return mailbox->consumer_read_fd;
+}
+
+struct xtm_dispatcher *
+xtm_dispatcher_new(struct xtm_queue **queues, unsigned count,
+		   unsigned affinity_limit)
+{
+	if (count == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct xtm_dispatcher *dispatcher = (struct xtm_dispatcher *)
+		malloc(sizeof(struct xtm_dispatcher) +
+		       count * sizeof(struct xtm_queue *));
+	if (dispatcher == NULL)
+		return NULL;
+	dispatcher->affinity_limit = affinity_limit;
+	dispatcher->rand_state = 2463534242u;
+	dispatcher->count = count;
+	memcpy(dispatcher->queues, queues, count * sizeof(struct xtm_queue *));
+	return dispatcher;
+}
+
+void
+xtm_dispatcher_delete(struct xtm_dispatcher *dispatcher)
+{
+	free(dispatcher);
+}
+
+/**
+ * Count of messages in the queue, as seen by producer, including
+ * messages, which are not published yet. Unbounded queue counts only
+ * its producer segment, since earlier segments belong to consumer.
+ */
+static inline unsigned
+queue_backlog(struct xtm_queue *queue)
+{
+	return queue->producer_segment->queue.count() +
+	       queue->unpublished_count;
+}
+
+static inline bool
+queue_has_space(struct xtm_queue *queue)
+{
+	if ((queue->flags & XTM_QUEUE_UNBOUNDED) != 0)
+		return true;
+	return queue->producer_segment->queue.free_count() >
+	       queue->unpublished_count;
+}
+
+/**
+ * Random number in range [0, range).
+ */
+static inline unsigned
+dispatcher_rand(struct xtm_dispatcher *dispatcher, unsigned range)
+{
+	uint32_t x = dispatcher->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	dispatcher->rand_state = x;
+	return ((uint64_t)x * range) >> 32;
+}
+
+/**
+ * Checks whether queue a is a better choice than queue b: it is less
+ * loaded, or as loaded, but is already dirty, so a message pushed to
+ * it doesn't cost an extra notification.
+ */
+static inline bool
+dispatcher_is_better(struct xtm_queue *a, unsigned a_backlog,
+		     struct xtm_queue *b, unsigned b_backlog)
+{
+	if (a_backlog != b_backlog)
+		return a_backlog < b_backlog;
+	return a->is_dirty && !b->is_dirty;
+}
+
+struct xtm_queue *
+xtm_dispatcher_select(struct xtm_dispatcher *dispatcher)
+{
+	unsigned count = dispatcher->count;
+	if (count > 1) {
+		unsigned i = dispatcher_rand(dispatcher, count);
+		unsigned j = dispatcher_rand(dispatcher, count - 1);
+		if (j >= i)
+			j++;
+		struct xtm_queue *a = dispatcher->queues[i];
+		struct xtm_queue *b = dispatcher->queues[j];
+		if (dispatcher_is_better(b, queue_backlog(b),
+					 a, queue_backlog(a))) {
+			struct xtm_queue *tmp = a;
+			a = b;
+			b = tmp;
+		}
+		if (queue_has_space(a))
+			return a;
+		if (queue_has_space(b))
+			return b;
+	}
+	/* Both choices are full, fall back to the full scan. */
+	struct xtm_queue *best = NULL;
+	unsigned best_backlog = 0;
+	for (unsigned i = 0; i < count; i++) {
+		struct xtm_queue *queue = dispatcher->queues[i];
+		unsigned backlog = queue_backlog(queue);
+		if (queue_has_space(queue) &&
+		    (best == NULL ||
+		     dispatcher_is_better(queue, backlog, best, best_backlog))) {
+			best = queue;
+			best_backlog = backlog;
+		}
+	}
+	if (best == NULL)
+		errno = ENOBUFS;
+	return best;
+}
+
+struct xtm_queue *
+xtm_dispatcher_select_key(struct xtm_dispatcher *dispatcher, uint64_t key)
+{
+	/* Fibonacci hashing, then reduction to the count of queues. */
+	uint32_t hash = (key * 0x9e3779b97f4a7c15ull) >> 32;
+	unsigned i = ((uint64_t)hash * dispatcher->count) >> 32;
+	struct xtm_queue *queue = dispatcher->queues[i];
+	if (queue_backlog(queue) <= dispatcher->affinity_limit &&
+	    queue_has_space(queue))
+		return queue;
+	return xtm_dispatcher_select(dispatcher);
+}
+
+struct xtm_monitor *
+xtm_monitor_new(xtm_monitor_cb_t cb, void *ctx)
+{
+	struct xtm_monitor *monitor = (struct xtm_monitor *)
+		calloc(1, sizeof(struct xtm_monitor));
+	if (monitor == NULL)
+		return NULL;
+	monitor->cb = cb;
+	monitor->ctx = ctx;
+	return monitor;
+}
+
+void
+xtm_monitor_delete(struct xtm_monitor *monitor)
+{
+	free(monitor->entries);
+	free(monitor);
+}
+
+static struct xtm_monitor_entry *
+monitor_find(struct xtm_monitor *monitor, struct xtm_queue *queue)
+{
+	for (unsigned i = 0; i < monitor->count; i++) {
+		if (monitor->entries[i].queue == queue)
+			return &monitor->entries[i];
+	}
+	return NULL;
+}
+
+/**
+ * Sample positions of the queue and update its stamps and stats.
+ * Messages, written since the previous sample, are stamped with
+ * current time, stamps of messages, which are read, are dropped.
+ */
+static void
+monitor_sample(struct xtm_monitor_entry *entry, uint64_t now)
+{
+	struct xtm_scsp_queue<struct xtm_queue_msg> *ring =
+		&entry->queue->segment.queue;
+	unsigned mask = ring->size() - 1;
+	unsigned write_pos, read_pos;
+	ring->positions(&write_pos, &read_pos);
+	unsigned depth = (write_pos - read_pos) & mask;
+	if (write_pos != entry->write_pos) {
+		if (entry->stamp_count < XTM_MONITOR_STAMP_MAX) {
+			unsigned i = (entry->stamp_first + entry->stamp_count) %
+				     XTM_MONITOR_STAMP_MAX;
+			entry->stamps[i].usec = now;
+			entry->stamp_count++;
+		}
+		unsigned last = (entry->stamp_first + entry->stamp_count - 1) %
+				XTM_MONITOR_STAMP_MAX;
+		entry->stamps[last].end = write_pos;
+	}
+	if (read_pos != entry->read_pos || depth == 0)
+		entry->read_moved_usec = now;
+	/* Stamp is read, if its last message is out of unread range. */
+	while (entry->stamp_count > 0) {
+		struct xtm_monitor_stamp *stamp =
+			&entry->stamps[entry->stamp_first];
+		if (((stamp->end - 1 - read_pos) & mask) < depth)
+			break;
+		entry->stamp_first = (entry->stamp_first + 1) %
+				     XTM_MONITOR_STAMP_MAX;
+		entry->stamp_count--;
+	}
+	entry->write_pos = write_pos;
+	entry->read_pos = read_pos;
+	entry->stats.depth = depth;
+	entry->stats.oldest_age_usec = entry->stamp_count == 0 ? 0 :
+		now - entry->stamps[entry->stamp_first].usec;
+	entry->stats.stall_usec = depth == 0 ? 0 :
+		now - entry->read_moved_usec;
+}
+
+int
+xtm_monitor_add(struct xtm_monitor *monitor, struct xtm_queue *queue,
+		unsigned depth_threshold, uint64_t age_threshold_usec,
+		uint64_t stall_threshold_usec)
+{
+	/* Segments of unbounded queue may be freed under monitor. */
+	if ((queue->flags & XTM_QUEUE_UNBOUNDED) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (monitor_find(monitor, queue) != NULL) {
+		errno = EEXIST;
+		return -1;
+	}
+	if (monitor->count == monitor->capacity) {
+		unsigned capacity = monitor->capacity == 0 ?
+				    4 : monitor->capacity * 2;
+		struct xtm_monitor_entry *entries = (struct xtm_monitor_entry *)
+			realloc(monitor->entries,
+				capacity * sizeof(struct xtm_monitor_entry));
+		if (entries == NULL)
+			return -1;
+		monitor->entries = entries;
+		monitor->capacity = capacity;
+	}
+	struct xtm_monitor_entry *entry = &monitor->entries[monitor->count++];
+	memset(entry, 0, sizeof(*entry));
+	entry->queue = queue;
+	entry->depth_threshold = depth_threshold;
+	entry->age_threshold_usec = age_threshold_usec;
+	entry->stall_threshold_usec = stall_threshold_usec;
+	/*
+	 * Messages, which are already in queue, are stamped with
+	 * current time, as if they were written just now.
+	 */
+	uint64_t now = clock_now_nsec() / 1000;
+	entry->queue->segment.queue.positions(&entry->write_pos,
+					      &entry->read_pos);
+	entry->write_pos = entry->read_pos;
+	entry->read_moved_usec = now;
+	monitor_sample(entry, now);
+	return 0;
+}
+
+int
+xtm_monitor_remove(struct xtm_monitor *monitor, struct xtm_queue *queue)
+{
+	struct xtm_monitor_entry *entry = monitor_find(monitor, queue);
+	if (entry == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	*entry = monitor->entries[--monitor->count];
+	return 0;
+}
+
+unsigned
+xtm_monitor_poll(struct xtm_monitor *monitor)
+{
+	unsigned over_count = 0;
+	uint64_t now = clock_now_nsec() / 1000;
+	for (unsigned i = 0; i < monitor->count; i++) {
+		struct xtm_monitor_entry *entry = &monitor->entries[i];
+		monitor_sample(entry, now);
+		const struct xtm_monitor_stats *stats = &entry->stats;
+		bool is_over =
+			(entry->depth_threshold != 0 &&
+			 stats->depth > entry->depth_threshold) ||
+			(entry->age_threshold_usec != 0 &&
+			 stats->oldest_age_usec > entry->age_threshold_usec) ||
+			(entry->stall_threshold_usec != 0 &&
+			 stats->stall_usec > entry->stall_threshold_usec);
+		if (is_over)
+			over_count++;
+		if (is_over != entry->is_over) {
+			entry->is_over = is_over;
+			if (monitor->cb != NULL)
+				monitor->cb(entry->queue, stats, is_over,
+					    monitor->ctx);
+		}
+	}
+	return over_count;
+}
+
+int
+xtm_monitor_get_stats(struct xtm_monitor *monitor, struct xtm_queue *queue,
+		      struct xtm_monitor_stats *stats)
+{
+	struct xtm_monitor_entry *entry = monitor_find(monitor, queue);
+	if (entry == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	*stats = entry->stats;
+	return 0;
+}
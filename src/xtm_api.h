@@ -31,6 +31,7 @@
  */
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -57,6 +58,77 @@ enum {
 	 * notifications when queue is not full.
 	 */
 	XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS = 1 << 2,
+	/**
+	 * Flag indicates, that consumer file descriptor is watched by
+	 * edge-triggered epoll (see xtm_queue_consumer_epoll_add). In this
+	 * mode consumer doesn't need to read notifications from its file
+	 * descriptor: consumer functions mark the consumer as waiting,
+	 * when they leave the queue empty, and producer writes to the file
+	 * descriptor only if the consumer is waiting. Consumer must read
+	 * the queue until it is empty (xtm_queue_pop_ptrs returns less than
+	 * requested) before waiting for the next event. Available only on
+	 * platforms with eventfd and epoll.
+	 */
+	XTM_QUEUE_EDGE_TRIGGERED = 1 << 3,
+	/**
+	 * Flag indicates, that push functions notify consumer on their
+	 * own: immediately, if consumer has read everything from the
+	 * queue and is waiting, otherwise after a batch of messages or
+	 * when producer flushes the queue (see xtm_queue_set_auto_notify).
+	 * Consumer is considered waiting after consumer functions leave
+	 * the queue empty.
+	 */
+	XTM_QUEUE_AUTO_NOTIFY = 1 << 4,
+	/**
+	 * Flag indicates, that push function marks the queue as dirty
+	 * in the list of the calling thread, instead of notifying the
+	 * consumer. All dirty queues of the thread are notified at once
+	 * by xtm_flush_notifications, which producer should call at the
+	 * end of its event loop iteration.
+	 */
+	XTM_QUEUE_DEFERRED_NOTIFY = 1 << 5,
+	/**
+	 * Flag indicates, that queue is unbounded: when its ring is full,
+	 * push functions link a new ring segment of the same size, instead
+	 * of failing with ENOBUFS. Consumer follows the chain and returns
+	 * drained segments to producer for reuse. In this mode
+	 * xtm_queue_count must be called from consumer thread.
+	 */
+	XTM_QUEUE_UNBOUNDED = 1 << 6,
+	/**
+	 * Flag indicates, that notification file descriptors of the queue
+	 * are created on first use: consumer file descriptor, when it is
+	 * requested or consumer is notified for the first time, producer
+	 * file descriptor likewise. Queues, which are never waited for,
+	 * consume no file descriptors.
+	 */
+	XTM_QUEUE_LAZY_FDS = 1 << 7,
+	/**
+	 * Flag indicates, that queue is busy-polled by consumer and
+	 * producer and has no notification file descriptors at all:
+	 * notify functions do nothing, xtm_queue_consumer_fd and
+	 * xtm_queue_producer_fd fail. Incompatible with
+	 * XTM_QUEUE_EDGE_TRIGGERED and XTM_QUEUE_AUTO_NOTIFY.
+	 */
+	XTM_QUEUE_POLLED = 1 << 8,
+	/**
+	 * Flag indicates, that queue carries only pointers: its slots
+	 * are 8 bytes instead of 16, so twice as many messages fit in
+	 * a cache line. Such queue can be used only with pointer
+	 * functions: xtm_queue_push_ptr, xtm_queue_pop_ptrs and
+	 * xtm_queue_drain with non-NULL function.
+	 */
+	XTM_QUEUE_PTR_ONLY = 1 << 9,
+	/**
+	 * Flag indicates, that producer publishes pushed messages to
+	 * consumer in batches: messages are written to the queue, but
+	 * become visible to consumer only when batch is complete (see
+	 * xtm_queue_set_publish_batch), when consumer is notified, or
+	 * on xtm_queue_flush. So with single-message pushes cache line
+	 * of the write index is passed to consumer once per batch, at
+	 * the cost of latency. Incompatible with XTM_QUEUE_AUTO_NOTIFY.
+	 */
+	XTM_QUEUE_DEFERRED_PUBLISH = 1 << 10,
 };
 
 /**
@@ -71,6 +143,41 @@ struct xtm_queue;
  */
 typedef void (*xtm_queue_fun_t)(void*);
 
+/**
+ * Typedef for function, which handles a batch of arguments of consecutive
+ * messages, pushed with the same function (see xtm_queue_set_batch_fun).
+ */
+typedef void (*xtm_queue_batch_fun_t)(void **args, unsigned count);
+
+/**
+ * Typedef for function, which handles pointers in xtm_queue_drain.
+ */
+typedef void (*xtm_queue_ptr_fun_t)(void *ptr, void *ctx);
+
+/**
+ * Message of the queue, as it is stored in the queue ring buffer.
+ */
+struct xtm_queue_msg {
+	/**
+	 * Function pushed by xtm_queue_push_fun, or NULL for
+	 * pointer pushed by xtm_queue_push_ptr.
+	 */
+	xtm_queue_fun_t fun;
+	/** Function argument or pointer. */
+	void *arg;
+};
+
+/**
+ * Contiguous array of messages in the queue ring buffer,
+ * returned by xtm_queue_peek.
+ */
+struct xtm_queue_span {
+	/** First message of the span. */
+	struct xtm_queue_msg *msgs;
+	/** Count of messages in the span. */
+	unsigned count;
+};
+
 /**
  * Create instance of struct xtm_queue.
  * @param[in] size  - queue size, must be power of two and greater then one.
@@ -79,6 +186,19 @@ typedef void (*xtm_queue_fun_t)(void*);
 struct xtm_queue *
 xtm_queue_new(unsigned size);
 
+/**
+ * Create instance of struct xtm_queue with non-default behavior.
+ * @param[in] size  - queue size, must be power of two and greater then one.
+ * @param[in] flags - flags defining queue behavior. acceptable values:
+ *                    XTM_QUEUE_EDGE_TRIGGERED, XTM_QUEUE_AUTO_NOTIFY,
+ *                    XTM_QUEUE_UNBOUNDED, XTM_QUEUE_LAZY_FDS,
+ *                    XTM_QUEUE_POLLED, XTM_QUEUE_PTR_ONLY,
+ *                    XTM_QUEUE_DEFERRED_PUBLISH (see enum above).
+ * @retval    pointer to new xtm_queue or NULL in case of error.
+ */
+struct xtm_queue *
+xtm_queue_new_ex(unsigned size, unsigned flags);
+
 /**
  * Free queue and close its internal fds. Which of the file descriptors will be
  * closed is determined by flags value.
@@ -101,6 +221,104 @@ xtm_queue_delete(struct xtm_queue *queue, unsigned flags);
 int
 xtm_queue_notify_consumer(struct xtm_queue *queue);
 
+/**
+ * Set auto notification policy of the queue, created with
+ * XTM_QUEUE_AUTO_NOTIFY flag. While consumer is busy, it is notified
+ * once per batch of pushed messages. Messages of incomplete batch are
+ * notified by xtm_queue_flush, which producer should call either at
+ * the end of its event loop iteration, or when file descriptor returned
+ * by xtm_queue_flush_fd becomes readable (linger_usec after the first
+ * message of the batch).
+ * Must be called from producer thread.
+ * @param[in] queue       - xtm_queue to set policy.
+ * @param[in] batch       - maximum count of messages pushed without
+ *                          notification, must be greater then zero.
+ * @param[in] linger_usec - maximum time in microseconds the first message
+ *                          of the batch waits for notification, if
+ *                          producer watches xtm_queue_flush_fd.
+ * @retval    0 on success. Otherwise -1 with errno set to EINVAL.
+ */
+int
+xtm_queue_set_auto_notify(struct xtm_queue *queue, unsigned batch,
+			  unsigned linger_usec);
+
+/**
+ * Notify queue consumer, if there are messages pushed since the last
+ * notification. Messages of queue, created with XTM_QUEUE_DEFERRED_PUBLISH
+ * flag, are published to consumer. Must be called from producer thread.
+ * @param[in] queue - xtm_queue to flush.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately.
+ *            (as in write(2), since it implies write to internal fd).
+ */
+int
+xtm_queue_flush(struct xtm_queue *queue);
+
+/**
+ * Set count of messages, after which producer of the queue, created
+ * with XTM_QUEUE_DEFERRED_PUBLISH flag, publishes them to consumer.
+ * Must be called from producer thread.
+ * @param[in] queue - xtm_queue to set publish batch.
+ * @param[in] batch - count of messages, must be greater then zero.
+ * @retval    0 on success. Otherwise -1 with errno set to EINVAL.
+ */
+int
+xtm_queue_set_publish_batch(struct xtm_queue *queue, unsigned batch);
+
+/**
+ * Return timer file descriptor, that should be watched by producer
+ * thread to become readable. It becomes readable, when the first
+ * message pushed without notification waits for linger time (see
+ * xtm_queue_set_auto_notify). Then producer should consume it and call
+ * xtm_queue_flush. Timer is created on the first call, must be called
+ * from producer thread.
+ * @param[in] queue - xtm_queue to get file descriptor.
+ * @retval    file descriptor on success. Otherwise -1 with errno set
+ *            appropriately (as in timerfd_create(2)).
+ */
+int
+xtm_queue_flush_fd(struct xtm_queue *queue);
+
+/**
+ * Set idle trim policy of the queue: once the queue has been empty
+ * and no messages have been pushed for idle_usec, xtm_queue_trim
+ * returns memory of the queue ring to the kernel. Pages are faulted
+ * back in transparently, when producer writes to them again.
+ * Must be called from producer thread.
+ * @param[in] queue     - xtm_queue to set policy.
+ * @param[in] idle_usec - time in microseconds, after which idle queue
+ *                        is trimmed, zero disables trimming (default).
+ * @retval    0 on success. Otherwise -1 with errno set to ENOTSUP, if
+ *            platform has no madvise(2).
+ */
+int
+xtm_queue_set_idle_trim(struct xtm_queue *queue, unsigned idle_usec);
+
+/**
+ * Trim queue according to idle trim policy (see xtm_queue_set_idle_trim).
+ * Producer should call it periodically, e.g. from a timer of its event
+ * loop: queue is trimmed once per idle period. In unbounded mode cached
+ * segments are freed as well.
+ * Must be called from producer thread.
+ * @param[in] queue - xtm_queue to trim.
+ * @retval    1 if queue is trimmed, 0 if not. Otherwise -1 with errno
+ *            set appropriately (as in madvise(2)).
+ */
+int
+xtm_queue_trim(struct xtm_queue *queue);
+
+/**
+ * Notify consumers of all queues, marked as dirty by push functions with
+ * XTM_QUEUE_DEFERRED_NOTIFY flag in the calling thread since the last call,
+ * once per queue (see xtm_queue_notify_consumer), and clear the list of
+ * dirty queues. Dirty queue must be deleted only by the thread which
+ * pushed to it, or after this call.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in write(2), since it implies write to internal fd),
+ *            all dirty queues are notified anyway.
+ */
+int
+xtm_flush_notifications(void);
+
 /**
  * Notify queue producer, when queue is not full.
  * @param[in] queue - xtm_queue to notify.
@@ -113,6 +331,7 @@ xtm_queue_notify_producer(struct xtm_queue *queue);
 /**
  * Check is there are free space in queue.
  * @param[in] queue - xtm_queue to ckeck free space.
+ * Unbounded queue (see XTM_QUEUE_UNBOUNDED) always has space.
  * @retval    0 if queue has space. Otherwise -1 with errno set to ENOBUFS.
  */
 int
@@ -131,12 +350,16 @@ xtm_queue_count(struct xtm_queue *queue);
  * This function does not notify the consumer thread, but only pushes to the queue.
  * To notify the consumer thread you must call xtm_queue_notify_consumer. The less
  * often you notify, the greater the performance, but the greater the latency.
+ * If queue was created with XTM_QUEUE_AUTO_NOTIFY flag, consumer is notified
+ * according to the auto notification policy (see xtm_queue_set_auto_notify).
  * @param[in] queue   - xtm_queue to push.
  * @param[in] fun     - function to push.
  * @param[in] fun_arg - function argument to push.
  * @param[in] flags   - flags defining function behavior. acceptable values:
- *                      XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS (see enum above).
- * @retval    0 if queue has space. Otherwise -1 with errno set to ENOBUFS.
+ *                      XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS,
+ *                      XTM_QUEUE_DEFERRED_NOTIFY (see enum above).
+ * @retval    0 if queue has space. Otherwise -1 with errno set to ENOBUFS,
+ *            or to ENOMEM, if unbounded queue failed to allocate segment.
  */
 int
 xtm_queue_push_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
@@ -146,8 +369,11 @@ xtm_queue_push_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
  * Return file descriptor, that should be watched by consumer thread to
  * become readable. When it became readable, consumer should call one
  * of the consumer functions: xtm_queue_pop_ptrs or xtm_queue_invoke_funs_all.
+ * With XTM_QUEUE_LAZY_FDS flag file descriptor is created on the first call.
  * @param[in] queue - xtm_queue to get file descriptor.
- * @retval    xtm queue file descriptor for consumer thread.
+ * @retval    xtm queue file descriptor for consumer thread. Otherwise -1
+ *            with errno set to EINVAL for polled queue, or appropriately
+ *            (as in eventfd(2)), if file descriptor creation failed.
  */
 int
 xtm_queue_consumer_fd(struct xtm_queue *queue);
@@ -159,12 +385,87 @@ xtm_queue_consumer_fd(struct xtm_queue *queue);
  * consumer and producer thread, so there is a little chance, that this
  * descriptor become readable, but there is no free space in the queue. In
  * this case producer thread must poll this descriptor again.
+ * With XTM_QUEUE_LAZY_FDS flag file descriptor is created on the first call.
  * @param[in] queue - xtm_queue to get file descriptor.
- * @retval    xtm queue file descriptor for producer thread.
+ * @retval    xtm queue file descriptor for producer thread. Otherwise -1
+ *            with errno set to EINVAL for polled queue, or appropriately
+ *            (as in eventfd(2)), if file descriptor creation failed.
  */
 int
 xtm_queue_producer_fd(struct xtm_queue *queue);
 
+/**
+ * Add consumer file descriptor to epoll instance. If queue was created
+ * with XTM_QUEUE_EDGE_TRIGGERED flag, file descriptor is registered as
+ * edge-triggered, and consumer needs not call xtm_queue_consume for it.
+ * @param[in] queue - xtm_queue to watch.
+ * @param[in] epfd  - epoll file descriptor.
+ * @param[in] data  - user data, returned by epoll_wait in data.ptr.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in epoll_ctl(2)).
+ */
+int
+xtm_queue_consumer_epoll_add(struct xtm_queue *queue, int epfd, void *data);
+
+/**
+ * Remove consumer file descriptor from epoll instance, e.g. before
+ * the queue is handed off to consumer thread with its own epoll.
+ * @param[in] queue - xtm_queue to stop watching.
+ * @param[in] epfd  - epoll file descriptor.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in epoll_ctl(2)).
+ */
+int
+xtm_queue_consumer_epoll_del(struct xtm_queue *queue, int epfd);
+
+/**
+ * Hand the consumer role off: the calling consumer thread stops
+ * consuming the queue, and its read position, along with batch
+ * functions and ownership of consumer file descriptor, passes to
+ * the thread, which calls xtm_queue_consumer_acquire next. Producers
+ * keep pushing and notifying meanwhile, messages are delivered to
+ * the new consumer in push order. Consumer should remove its file
+ * descriptor from its event loop before release, and must not touch
+ * the queue after it. Must be called from consumer thread.
+ * @param[in] queue - xtm_queue to release.
+ * @retval    0 on success. Otherwise -1 with errno set to EINVAL, if
+ *            the queue is already released.
+ */
+int
+xtm_queue_consumer_release(struct xtm_queue *queue);
+
+/**
+ * Become consumer of the queue, released by its previous consumer
+ * with xtm_queue_consumer_release. Consumer file descriptor is
+ * notified, so that the new consumer checks the queue for messages,
+ * pushed during the handoff, once it watches the descriptor.
+ * @param[in] queue - xtm_queue to acquire.
+ * @retval    0 on success. Otherwise -1 with errno set to EBUSY, if
+ *            the queue isn't released yet (caller may retry), or
+ *            appropriately (as in write(2)), if notification failed,
+ *            the queue is acquired anyway in this case.
+ */
+int
+xtm_queue_consumer_acquire(struct xtm_queue *queue);
+
+/**
+ * Register batch function for messages pushed with function fun. Consumer
+ * functions, which invoke pushed functions (xtm_queue_invoke_funs_all and
+ * xtm_queue_drain), group consecutive messages with function fun and call
+ * batch_fun once for their arguments instead of calling fun for each of
+ * them. Up to 8 batch functions can be registered for the queue.
+ * Must be called from consumer thread.
+ * @param[in] queue     - xtm_queue.
+ * @param[in] fun       - function, pushed by xtm_queue_push_fun.
+ * @param[in] batch_fun - batch function to call instead of fun, or NULL
+ *                        to unregister batch function for fun.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOBUFS,
+ *            if too many batch functions are registered.
+ */
+int
+xtm_queue_set_batch_fun(struct xtm_queue *queue, xtm_queue_fun_t fun,
+			xtm_queue_batch_fun_t batch_fun);
+
 /**
  * Calls all functions contained in the queue.
  * If producer thread pushes functions with XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS
@@ -172,22 +473,79 @@ xtm_queue_producer_fd(struct xtm_queue *queue);
  * queue and expects notification" flag, using `xtm_queue_get_reset_was_full`.
  * If this flag was true, user should notify producer thread (see examples in
  * README.md).
+ * Consecutive functions with registered batch function (see
+ * xtm_queue_set_batch_fun) are invoked by one call of batch function.
+ * In edge-triggered mode (see XTM_QUEUE_EDGE_TRIGGERED) marks consumer as
+ * waiting for notification.
  * @param[in] queue - xtm_queue.
  * @retval    count of invoked functions if success.
  */
 unsigned
 xtm_queue_invoke_funs_all(struct xtm_queue *queue);
 
+/**
+ * Statistics of a function pushed with xtm_queue_push_fun, collected
+ * by sampling profiler of consumer (see xtm_queue_set_profiling).
+ * Only sampled invocations are counted, multiply counters by sample
+ * period to estimate totals. Invocation of batch function is counted
+ * as invocations of the pushed function for each of its arguments.
+ */
+struct xtm_queue_fun_stats {
+	/**
+	 * Pushed function, or NULL for the entry, which sums up
+	 * functions, which didn't fit in the profiler table.
+	 */
+	xtm_queue_fun_t fun;
+	/** Count of sampled invocations. */
+	uint64_t calls;
+	/** Total time of sampled invocations, in nanoseconds. */
+	uint64_t total_nsec;
+	/** Maximum time of a sampled invocation, in nanoseconds. */
+	uint64_t max_nsec;
+};
+
+/**
+ * Enable sampling profiler of functions, which consumer invokes with
+ * xtm_queue_invoke_funs_all and xtm_queue_drain: one of each
+ * sample_period invocations is timed, and its time is accounted to
+ * the pushed function. Other invocations cost a counter decrement.
+ * Collected statistics are reset. Up to 64 functions are profiled
+ * separately. Must be called from consumer thread.
+ * @param[in] queue         - xtm_queue.
+ * @param[in] sample_period - one of how many invocations is timed,
+ *                            1 to time all of them, 0 to disable
+ *                            profiler.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOMEM.
+ */
+int
+xtm_queue_set_profiling(struct xtm_queue *queue, unsigned sample_period);
+
+/**
+ * Get statistics of profiled functions, in no particular order.
+ * Must be called from consumer thread.
+ * @param[in]  queue - xtm_queue.
+ * @param[out] stats - array to fill with statistics.
+ * @param[in]  count - size of stats array.
+ * @retval     count of filled entries.
+ */
+unsigned
+xtm_queue_get_fun_stats(struct xtm_queue *queue,
+			struct xtm_queue_fun_stats *stats, unsigned count);
+
 /**
  * Puts message, which contains pointer to the queue. This function does not
  * notify the consumer thread, but only pushes to the queue. To notify the consumer
  * thread you must call xtm_queue_notify_consumer. The less often you notify, the
  * greater the performance, but the greater the latency.
+ * If queue was created with XTM_QUEUE_AUTO_NOTIFY flag, consumer is notified
+ * according to the auto notification policy (see xtm_queue_set_auto_notify).
  * @param[in] queue - xtm_queue to push.
  * @param[in] ptr   - pointer to push.
  * @param[in] flags - flags defining function behavior. acceptable values:
- *                    XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS (see enum above).
- * @retval    0 if queue has space. Otherwise -1 with errno set to ENOBUFS.
+ *                    XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS,
+ *                    XTM_QUEUE_DEFERRED_NOTIFY (see enum above).
+ * @retval    0 if queue has space. Otherwise -1 with errno set to ENOBUFS,
+ *            or to ENOMEM, if unbounded queue failed to allocate segment.
  */
 int
 xtm_queue_push_ptr(struct xtm_queue *queue, void *ptr, unsigned flags);
@@ -199,6 +557,9 @@ xtm_queue_push_ptr(struct xtm_queue *queue, void *ptr, unsigned flags);
  * queue and expects notification" flag, using `xtm_queue_get_reset_was_full`.
  * If this flag was true, user should notify producer thread (see examples in
  * README.md).
+ * In edge-triggered mode (see XTM_QUEUE_EDGE_TRIGGERED) marks consumer as
+ * waiting for notification if the queue is left empty. If it returns
+ * ptr_array_count, consumer must call it again before waiting.
  * @param[in]  queue           - xtm_queue containing pointers.
  * @param[out] ptr_array       - pointer array to save pointers.
  * @param[in]  ptr_array_count - maximum count of pointers, that can
@@ -209,6 +570,57 @@ unsigned
 xtm_queue_pop_ptrs(struct xtm_queue *queue, void **ptr_array,
                    unsigned ptr_array_count);
 
+/**
+ * Gets messages contained in the queue without copying and removing them.
+ * Messages are returned in place, as up to two contiguous spans of the
+ * queue ring buffer: the second span is not empty only if messages wrap
+ * around the end of the buffer. Consumer may handle messages in spans
+ * directly (and modify them), and then must remove handled messages with
+ * xtm_queue_release. Messages stay valid until they are released.
+ * Unbounded queue returns messages of one segment, so consumer should
+ * call it again after release.
+ * @param[in]  queue - xtm_queue containing messages.
+ * @param[out] spans - array of two spans to fill.
+ * @retval     total count of messages in both spans.
+ */
+unsigned
+xtm_queue_peek(struct xtm_queue *queue, struct xtm_queue_span spans[2]);
+
+/**
+ * Removes first count messages, returned by xtm_queue_peek, from the queue,
+ * so that producer can reuse their space.
+ * If producer thread pushes messages with XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS
+ * flag, user should retrieve and reset "producer failed to put an item in the
+ * queue and expects notification" flag, using `xtm_queue_get_reset_was_full`.
+ * In edge-triggered mode (see XTM_QUEUE_EDGE_TRIGGERED) marks consumer as
+ * waiting for notification if the queue is left empty.
+ * @param[in] queue - xtm_queue containing messages.
+ * @param[in] count - count of messages to remove, must not be greater
+ *                    than count returned by the last xtm_queue_peek.
+ */
+void
+xtm_queue_release(struct xtm_queue *queue, unsigned count);
+
+/**
+ * Fused consumer loop: consumes consumer file descriptor (unless queue
+ * is edge-triggered), handles all messages contained in the queue, and
+ * notifies producer, if it failed to push and expects notification.
+ * Write index of the queue is loaded once, read index is published
+ * periodically, so that producer can reuse space while the rest of
+ * messages is handled.
+ * @param[in] queue - xtm_queue.
+ * @param[in] fun   - function to call for each pointer, pushed with
+ *                    xtm_queue_push_ptr. If it is NULL, messages are
+ *                    expected to be pushed with xtm_queue_push_fun,
+ *                    and their functions are invoked.
+ * @param[in] ctx   - context passed to fun.
+ * @retval    count of handled messages on success. Otherwise -1 with
+ *            errno set appropriately (as in read(2) or write(2), since
+ *            it implies read from and write to internal fds).
+ */
+int
+xtm_queue_drain(struct xtm_queue *queue, xtm_queue_ptr_fun_t fun, void *ctx);
+
 /**
  * Reads from internal queue pipe, according to file descriptor passed
  * to this function.
@@ -226,6 +638,291 @@ xtm_queue_consume(int fd);
 bool
 xtm_queue_get_reset_was_full(struct xtm_queue *queue);
 
+/**
+ * Opaque struct, that represents pool of queues of the same size and
+ * flags. Pool keeps released queues fully initialized, with their file
+ * descriptors, so that they can be acquired again without syscalls.
+ * Pool is not thread-safe, it must be used by one thread at a time.
+ */
+struct xtm_queue_pool;
+
+/**
+ * Allocate and initialize new pool of queues and fill it with
+ * capacity queues.
+ * @param[in] size     - size of pool queues, same as in xtm_queue_new_ex.
+ * @param[in] flags    - flags of pool queues, same as in xtm_queue_new_ex.
+ * @param[in] capacity - maximum count of queues kept by pool.
+ * @retval    pointer to new xtm_queue_pool or NULL in case of error.
+ */
+struct xtm_queue_pool *
+xtm_queue_pool_new(unsigned size, unsigned flags, unsigned capacity);
+
+/**
+ * Delete pool and all queues kept by it, closing all their file
+ * descriptors. Queues acquired from pool and not released are not
+ * affected and must be deleted with xtm_queue_delete.
+ * @param[in] pool - xtm_queue_pool to delete.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately.
+ *            (as in close(2), since it implies close of fds).
+ */
+int
+xtm_queue_pool_delete(struct xtm_queue_pool *pool);
+
+/**
+ * Take queue from pool. Queue is in the same state, as just created
+ * one. If pool is empty, new queue is created.
+ * @param[in] pool - xtm_queue_pool to acquire queue.
+ * @retval    pointer to xtm_queue or NULL in case of error.
+ */
+struct xtm_queue *
+xtm_queue_pool_acquire(struct xtm_queue_pool *pool);
+
+/**
+ * Reset queue to its initial state and return it to pool. Must be
+ * called when neither producer nor consumer use the queue, messages
+ * left in the queue are discarded. File descriptors of the queue must
+ * not be closed. Pending notifications are read from file descriptors,
+ * which were notified since the queue was acquired, so this is the only
+ * syscall made in the common case. If pool is full, queue is deleted.
+ * @param[in] pool  - xtm_queue_pool, from which queue was acquired.
+ * @param[in] queue - xtm_queue to release.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in read(2) or close(2)).
+ */
+int
+xtm_queue_pool_release(struct xtm_queue_pool *pool, struct xtm_queue *queue);
+
+/**
+ * Opaque struct, that represents single-writer-single-reader mailbox,
+ * which holds only the latest written value of fixed size. Writer never
+ * blocks and mailbox never fills up: unread value is replaced by the
+ * next one. Mailbox is based on triple buffer, so both write and read
+ * take O(1) time. Consumer is notified through file descriptor, as in
+ * xtm_queue, once per value, written after the previous read.
+ */
+struct xtm_mailbox;
+
+/**
+ * Allocate and initialize new mailbox.
+ * @param[in] size - size of mailbox value in bytes.
+ * @retval    pointer to new xtm_mailbox or NULL in case of error.
+ */
+struct xtm_mailbox *
+xtm_mailbox_new(unsigned size);
+
+/**
+ * Free mailbox and close its internal fds.
+ * @param[in] mailbox - xtm_mailbox to delete.
+ * @param[in] flags   - XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD or zero.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately.
+ *            (as in close(2), since it implies close of fds).
+ */
+int
+xtm_mailbox_delete(struct xtm_mailbox *mailbox, unsigned flags);
+
+/**
+ * Write new value to mailbox, replacing the previous one, and notify
+ * consumer, if it has read the previous value. Must be called from
+ * producer thread.
+ * @param[in] mailbox - xtm_mailbox to write.
+ * @param[in] value   - value to copy to mailbox.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately.
+ *            (as in write(2), since it implies write to internal fd).
+ */
+int
+xtm_mailbox_write(struct xtm_mailbox *mailbox, const void *value);
+
+/**
+ * Read the latest value from mailbox. Consumer should consume its
+ * file descriptor before reading, otherwise notification about value,
+ * written after the read, may be lost. Must be called from consumer
+ * thread.
+ * @param[in] mailbox - xtm_mailbox to read.
+ * @retval    pointer to the latest value, valid until the next read,
+ *            or NULL if no value has been written since the last read.
+ */
+const void *
+xtm_mailbox_read(struct xtm_mailbox *mailbox);
+
+/**
+ * Returns file descriptor, that should be watched by consumer thread
+ * to become readable, when new value is written to mailbox.
+ * @param[in] mailbox - xtm_mailbox to get file descriptor.
+ * @retval    mailbox file descriptor for consumer thread.
+ */
+int
+xtm_mailbox_consumer_fd(struct xtm_mailbox *mailbox);
+
+/**
+ * Dispatcher, which spreads messages of one producer thread over a set
+ * of queues, consumed by different threads. Dispatcher chooses the less
+ * loaded of two randomly sampled queues (power of two choices), or the
+ * queue, which the message key is hashed to, unless that queue is
+ * overloaded. Producer should push messages to the chosen queues with
+ * XTM_QUEUE_DEFERRED_NOTIFY flag and call xtm_flush_notifications once
+ * per batch, so each queue, which got messages, is notified once.
+ * Dispatcher doesn't own its queues, all its functions must be called
+ * from producer thread.
+ */
+struct xtm_dispatcher;
+
+/**
+ * Create dispatcher over the set of queues.
+ * @param[in] queues         - array of queues to dispatch messages to,
+ *                             it's copied by the dispatcher.
+ * @param[in] count          - count of queues, must be positive.
+ * @param[in] affinity_limit - count of messages in queue, above which
+ *                             the queue is overloaded and messages with
+ *                             key hashed to it are dispatched to other
+ *                             queues.
+ * @retval    pointer to new xtm_dispatcher or NULL in case of error.
+ */
+struct xtm_dispatcher *
+xtm_dispatcher_new(struct xtm_queue **queues, unsigned count,
+		   unsigned affinity_limit);
+
+/**
+ * Free dispatcher, its queues aren't deleted.
+ * @param[in] dispatcher - xtm_dispatcher to delete.
+ */
+void
+xtm_dispatcher_delete(struct xtm_dispatcher *dispatcher);
+
+/**
+ * Choose queue for the next message: the less loaded of two randomly
+ * sampled queues, preferring dirty queue (see XTM_QUEUE_DEFERRED_NOTIFY),
+ * which is going to be notified anyway, when loads are equal. If both
+ * are full, the least loaded queue with free space is chosen. Caller
+ * should push message to the returned queue without notification.
+ * Load of unbounded queue is estimated by its last segment.
+ * @param[in] dispatcher - xtm_dispatcher to choose queue.
+ * @retval    queue with free space or NULL with errno set to ENOBUFS,
+ *            if all queues are full.
+ */
+struct xtm_queue *
+xtm_dispatcher_select(struct xtm_dispatcher *dispatcher);
+
+/**
+ * Choose queue for the next message with given key: messages with the
+ * same key go to the same queue, while it is not overloaded (see
+ * affinity_limit of xtm_dispatcher_new) and has free space, otherwise
+ * queue is chosen as in xtm_dispatcher_select.
+ * @param[in] dispatcher - xtm_dispatcher to choose queue.
+ * @param[in] key        - key of the message.
+ * @retval    queue with free space or NULL with errno set to ENOBUFS,
+ *            if all queues are full.
+ */
+struct xtm_queue *
+xtm_dispatcher_select_key(struct xtm_dispatcher *dispatcher, uint64_t key);
+
+/**
+ * Monitor, which watches a set of queues for stalled consumers.
+ * On each poll it samples queue positions and reports queue depth,
+ * age of the oldest unread message and time since consumer has last
+ * read from the queue. Messages are stamped with the time of the poll,
+ * at which they were first seen, so ages are precise up to the poll
+ * interval and producer doesn't pay for stamping. Monitor should be
+ * polled more often than the whole queue is turned over. Monitor
+ * isn't synchronized, it may be used from any thread, but from one
+ * thread at a time. Queue must be removed from monitor before it is
+ * deleted or released to a pool.
+ */
+struct xtm_monitor;
+
+/** State of queue, watched by monitor, at the last poll. */
+struct xtm_monitor_stats {
+	/** Count of messages in queue. */
+	unsigned depth;
+	/** Age of the oldest unread message in microseconds. */
+	uint64_t oldest_age_usec;
+	/**
+	 * Time in microseconds since consumer has last read from queue,
+	 * 0 if queue is empty.
+	 */
+	uint64_t stall_usec;
+};
+
+/**
+ * Function, called by monitor, when any threshold of the queue is
+ * crossed, or when all values of the queue return below thresholds.
+ * Function must not add queues to monitor or remove them.
+ * @param[in] queue   - watched queue.
+ * @param[in] stats   - state of the queue.
+ * @param[in] is_over - true if some threshold is crossed.
+ * @param[in] ctx     - context, passed to xtm_monitor_new.
+ */
+typedef void (*xtm_monitor_cb_t)(struct xtm_queue *queue,
+				 const struct xtm_monitor_stats *stats,
+				 bool is_over, void *ctx);
+
+/**
+ * Create monitor.
+ * @param[in] cb  - function, called when thresholds are crossed.
+ * @param[in] ctx - context passed to cb.
+ * @retval    pointer to new xtm_monitor or NULL in case of error.
+ */
+struct xtm_monitor *
+xtm_monitor_new(xtm_monitor_cb_t cb, void *ctx);
+
+/**
+ * Free monitor, its queues aren't deleted.
+ * @param[in] monitor - xtm_monitor to delete.
+ */
+void
+xtm_monitor_delete(struct xtm_monitor *monitor);
+
+/**
+ * Start watching the queue. Zero threshold is disabled.
+ * @param[in] monitor              - xtm_monitor to add queue to.
+ * @param[in] queue                - bounded queue to watch.
+ * @param[in] depth_threshold      - count of messages, above which
+ *                                   queue is over threshold.
+ * @param[in] age_threshold_usec   - age of the oldest unread message,
+ *                                   above which queue is over threshold.
+ * @param[in] stall_threshold_usec - time since consumer has last read,
+ *                                   above which non-empty queue is over
+ *                                   threshold.
+ * @retval    0 on success, -1 on failure with errno set to EINVAL for
+ *            unbounded queue, EEXIST if queue is already watched or
+ *            ENOMEM.
+ */
+int
+xtm_monitor_add(struct xtm_monitor *monitor, struct xtm_queue *queue,
+		unsigned depth_threshold, uint64_t age_threshold_usec,
+		uint64_t stall_threshold_usec);
+
+/**
+ * Stop watching the queue.
+ * @param[in] monitor - xtm_monitor to remove queue from.
+ * @param[in] queue   - watched queue.
+ * @retval    0 on success, -1 with errno set to ENOENT, if queue
+ *            isn't watched.
+ */
+int
+xtm_monitor_remove(struct xtm_monitor *monitor, struct xtm_queue *queue);
+
+/**
+ * Sample all watched queues and call monitor function for each queue,
+ * which has crossed thresholds or returned below them since the last
+ * poll.
+ * @param[in] monitor - xtm_monitor to poll.
+ * @retval    count of queues over thresholds.
+ */
+unsigned
+xtm_monitor_poll(struct xtm_monitor *monitor);
+
+/**
+ * Get state of the queue at the last poll.
+ * @param[in]  monitor - xtm_monitor, which watches the queue.
+ * @param[in]  queue   - watched queue.
+ * @param[out] stats   - state of the queue.
+ * @retval     0 on success, -1 with errno set to ENOENT, if queue
+ *             isn't watched.
+ */
+int
+xtm_monitor_get_stats(struct xtm_monitor *monitor, struct xtm_queue *queue,
+		      struct xtm_monitor_stats *stats);
+
 #if defined(__cplusplus)
 } /* extern "C" */
 #endif /* defined(__cplusplus) */
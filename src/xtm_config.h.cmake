@@ -5,9 +5,60 @@
  * Defined if this platform has eventfd.
  */
 #cmakedefine TARANTOOL_XTM_HAVE_EVENTFD 1
+/*
+ * Defined if this platform has epoll.
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_EPOLL 1
+/*
+ * Defined if this platform has timerfd.
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_TIMERFD 1
+/*
+ * Defined if this platform has pipe2.
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_PIPE2 1
+/*
+ * Defined if this platform has madvise with MADV_DONTNEED.
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_MADV_DONTNEED 1
+/*
+ * Defined if this platform has futex syscall.
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_FUTEX 1
+/*
+ * Defined if libc registers restartable sequences (glibc 2.35+).
+ */
+#cmakedefine TARANTOOL_XTM_HAVE_RSEQ 1
+/*
+ * Defined if USDT probes are enabled with ENABLE_USDT option.
+ */
+#cmakedefine TARANTOOL_XTM_ENABLE_USDT 1
 
 #if defined(TARANTOOL_XTM_HAVE_EVENTFD)
 # define TARANTOOL_XTM_USE_EVENTFD 1
 #endif
 
+/*
+ * Edge-triggered mode relies on eventfd, which never fills up,
+ * even if nobody reads it.
+ */
+#if defined(TARANTOOL_XTM_USE_EVENTFD) && defined(TARANTOOL_XTM_HAVE_EPOLL)
+# define TARANTOOL_XTM_USE_EPOLL 1
+#endif
+
+/*
+ * Restartable sequences critical sections are written in assembly,
+ * which is provided only for x86-64.
+ */
+#if defined(TARANTOOL_XTM_HAVE_RSEQ) && defined(__x86_64__)
+# define TARANTOOL_XTM_USE_RSEQ 1
+#endif
+
+/*
+ * Count of messages, which consumer functions look ahead to prefetch
+ * message argument, messages themselves are prefetched twice as far.
+ * Zero disables prefetching.
+ */
+#define TARANTOOL_XTM_PREFETCH_DISTANCE @XTM_PREFETCH_DISTANCE@
+
 #endif /* TARANTOOL_XTM_CONFIG_H_INCLUDED */
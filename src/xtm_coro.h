@@ -0,0 +1,527 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_api.h"
+
+#if !defined(__cplusplus) || !defined(__cpp_impl_coroutine)
+#error "xtm_coro.h requires C++20 coroutines support"
+#endif
+
+#include <coroutine>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/**
+ * Header-only C++20 coroutine integration for xtm queue.
+ * Coroutines await on queue readiness through a pluggable reactor,
+ * which watches queue file descriptors and calls the queue back when
+ * they become readable. Awaiters try the ring first and suspend only
+ * when the operation can't be completed, so the fast path never
+ * issues a syscall. Suspended coroutines are resumed only after the
+ * operation they wait for has been completed on their behalf.
+ */
+
+/**
+ * Object, which reactor calls back.
+ */
+struct xtm_coro_handler {
+	/**
+	 * Called by reactor, when watched file descriptor
+	 * becomes readable.
+	 */
+	virtual void
+	on_readable(void) = 0;
+	/**
+	 * Called by reactor at the end of current loop iteration,
+	 * if handler was passed to xtm_coro_reactor::defer.
+	 */
+	virtual void
+	on_flush(void) {}
+	/** Next handler in reactor deferred list. */
+	struct xtm_coro_handler *next_deferred = nullptr;
+	/** True if handler is in reactor deferred list. */
+	bool is_deferred = false;
+};
+
+/**
+ * Reactor interface. Implement it to integrate xtm coroutines
+ * into the event loop of your choice, see xtm_coro_epoll_reactor
+ * for the reference implementation.
+ */
+struct xtm_coro_reactor {
+	virtual
+	~xtm_coro_reactor() = default;
+	/**
+	 * Start watching fd for readability.
+	 * @param[in] fd      - file descriptor to watch.
+	 * @param[in] handler - handler to call, when fd becomes readable.
+	 * @retval    0 on success. Otherwise -1 with errno set appropriately.
+	 */
+	virtual int
+	watch(int fd, struct xtm_coro_handler *handler) = 0;
+	/**
+	 * Stop watching fd.
+	 * @param[in] fd - file descriptor passed to watch.
+	 * @retval    0 on success. Otherwise -1 with errno set appropriately.
+	 */
+	virtual int
+	unwatch(int fd) = 0;
+	/**
+	 * Call handler->on_flush() at the end of current loop iteration.
+	 * Handler is called once per iteration, no matter how many times
+	 * it was deferred.
+	 * @param[in] handler - handler to call.
+	 */
+	virtual void
+	defer(struct xtm_coro_handler *handler) = 0;
+};
+
+/**
+ * Reference reactor implementation, based on epoll(7).
+ */
+struct xtm_coro_epoll_reactor : public xtm_coro_reactor {
+	enum {
+		/** Maximum count of events, handled per iteration. */
+		XTM_CORO_EPOLL_EVENTS_MAX = 64,
+	};
+	/**
+	 * Create epoll instance.
+	 * @retval 0 on success. Otherwise -1 with errno set appropriately.
+	 */
+	int
+	create(void)
+	{
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		return epfd < 0 ? -1 : 0;
+	}
+	/**
+	 * Close epoll instance.
+	 */
+	void
+	destroy(void)
+	{
+		if (epfd >= 0)
+			close(epfd);
+		epfd = -1;
+	}
+	int
+	watch(int fd, struct xtm_coro_handler *handler) override
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = handler;
+		return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+	int
+	unwatch(int fd) override
+	{
+		/* Event argument is ignored, but old kernels require it. */
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		return epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+	}
+	void
+	defer(struct xtm_coro_handler *handler) override
+	{
+		if (handler->is_deferred)
+			return;
+		handler->is_deferred = true;
+		handler->next_deferred = deferred;
+		deferred = handler;
+	}
+	/**
+	 * Run deferred handlers, wait for events no longer than
+	 * timeout and dispatch them, then run handlers deferred
+	 * while dispatching.
+	 * @param[in] timeout - timeout in milliseconds, as in epoll_wait(2).
+	 * @retval    count of dispatched events on success. Otherwise -1
+	 *            with errno set appropriately.
+	 */
+	int
+	run_once(int timeout)
+	{
+		struct epoll_event events[XTM_CORO_EPOLL_EVENTS_MAX];
+		int rc;
+		/*
+		 * Deferred handlers may notify other threads, which
+		 * we are going to wait for, so flush them before sleep.
+		 */
+		flush();
+		while ((rc = epoll_wait(epfd, events, XTM_CORO_EPOLL_EVENTS_MAX,
+					timeout)) < 0 && errno == EINTR)
+			;
+		for (int i = 0; i < rc; i++) {
+			struct xtm_coro_handler *handler =
+				(struct xtm_coro_handler *)events[i].data.ptr;
+			handler->on_readable();
+		}
+		flush();
+		return rc;
+	}
+	/**
+	 * Run all deferred handlers.
+	 */
+	void
+	flush(void)
+	{
+		while (deferred != nullptr) {
+			struct xtm_coro_handler *handler = deferred;
+			deferred = handler->next_deferred;
+			handler->next_deferred = nullptr;
+			handler->is_deferred = false;
+			handler->on_flush();
+		}
+	}
+private:
+	/** Epoll file descriptor. */
+	int epfd = -1;
+	/** List of handlers to be called at the end of iteration. */
+	struct xtm_coro_handler *deferred = nullptr;
+};
+
+/**
+ * Coroutine, suspended on one side of xtm queue.
+ */
+struct xtm_coro_waiter {
+	/**
+	 * Try to complete the operation on behalf of the suspended
+	 * coroutine, without blocking.
+	 * @retval true if the operation is completed and coroutine
+	 *         may be resumed, false if it should keep waiting.
+	 */
+	virtual bool
+	try_complete(void) = 0;
+	/** Suspended coroutine. */
+	std::coroutine_handle<> handle;
+	/** Next waiter in the list. */
+	struct xtm_coro_waiter *next = nullptr;
+};
+
+/**
+ * FIFO list of coroutines, suspended on one side of xtm queue.
+ */
+struct xtm_coro_waitlist {
+	bool
+	empty(void) const
+	{
+		return first == nullptr;
+	}
+	void
+	push(struct xtm_coro_waiter *waiter)
+	{
+		waiter->next = nullptr;
+		if (last != nullptr)
+			last->next = waiter;
+		else
+			first = waiter;
+		last = waiter;
+	}
+	/**
+	 * Complete and resume waiters in order of their arrival,
+	 * until the first one, which operation can't be completed.
+	 * All waiters, satisfied by one wakeup, are resumed at once.
+	 * @retval count of resumed waiters.
+	 */
+	unsigned
+	resume(void)
+	{
+		unsigned cnt = 0;
+		while (first != nullptr && first->try_complete()) {
+			struct xtm_coro_waiter *waiter = first;
+			first = waiter->next;
+			if (first == nullptr)
+				last = nullptr;
+			/*
+			 * Waiter can be pushed back to this list
+			 * during resume, so unlink it before.
+			 */
+			waiter->handle.resume();
+			cnt++;
+		}
+		return cnt;
+	}
+private:
+	/** Oldest waiter. */
+	struct xtm_coro_waiter *first = nullptr;
+	/** Newest waiter. */
+	struct xtm_coro_waiter *last = nullptr;
+};
+
+struct xtm_coro_queue;
+
+/**
+ * Awaiter, returned by xtm_coro_queue::pop_batch.
+ * co_await returns count of popped pointers, which is never zero
+ * unless the queue fd can't be watched by the reactor (errno is
+ * set appropriately in this case).
+ */
+struct xtm_coro_pop_awaiter : public xtm_coro_waiter {
+	xtm_coro_pop_awaiter(struct xtm_coro_queue *q, void **ptrs,
+			     unsigned max)
+		: queue(q), ptr_array(ptrs), ptr_array_count(max), count(0) {}
+	bool
+	await_ready(void);
+	bool
+	await_suspend(std::coroutine_handle<> h);
+	unsigned
+	await_resume(void) const
+	{
+		return count;
+	}
+	bool
+	try_complete(void) override;
+private:
+	struct xtm_coro_queue *queue;
+	void **ptr_array;
+	unsigned ptr_array_count;
+	unsigned count;
+};
+
+/**
+ * Awaiter, returned by xtm_coro_queue::push.
+ * co_await returns 0, when the pointer is in the queue, or -1 if
+ * the queue fd can't be watched by the reactor (errno is set
+ * appropriately in this case).
+ */
+struct xtm_coro_push_awaiter : public xtm_coro_waiter {
+	xtm_coro_push_awaiter(struct xtm_coro_queue *q, void *p)
+		: queue(q), ptr(p), rc(0) {}
+	bool
+	await_ready(void);
+	bool
+	await_suspend(std::coroutine_handle<> h);
+	int
+	await_resume(void) const
+	{
+		return rc;
+	}
+	bool
+	try_complete(void) override;
+private:
+	struct xtm_coro_queue *queue;
+	void *ptr;
+	int rc;
+};
+
+/**
+ * Coroutine wrapper of xtm queue, used in send/recv pattern.
+ * Instance must be used only from the thread, which runs the
+ * reactor. Producer and consumer threads must use their own
+ * instances, even if they wrap the same xtm queue.
+ * Consumer notifications are batched: pushes made during one
+ * reactor iteration result in a single notification at its end.
+ */
+struct xtm_coro_queue {
+	friend struct xtm_coro_pop_awaiter;
+	friend struct xtm_coro_push_awaiter;
+	/**
+	 * @param[in] q - xtm queue to wrap, must outlive the wrapper.
+	 * @param[in] r - reactor of the current thread.
+	 */
+	xtm_coro_queue(struct xtm_queue *q, struct xtm_coro_reactor *r)
+		: queue(q), reactor(r),
+		  consumer(this, xtm_queue_consumer_fd(q)),
+		  producer(this, xtm_queue_producer_fd(q)) {}
+	~xtm_coro_queue()
+	{
+		consumer.unwatch();
+		producer.unwatch();
+	}
+	xtm_coro_queue(const xtm_coro_queue &) = delete;
+	xtm_coro_queue &operator=(const xtm_coro_queue &) = delete;
+	/**
+	 * Pop up to max pointers from the queue, waiting until at
+	 * least one is available.
+	 * @param[out] ptrs - pointer array to save pointers, must be
+	 *                    valid until co_await returns.
+	 * @param[in]  max  - maximum count of pointers to pop.
+	 */
+	struct xtm_coro_pop_awaiter
+	pop_batch(void **ptrs, unsigned max)
+	{
+		return xtm_coro_pop_awaiter(this, ptrs, max);
+	}
+	/**
+	 * Push pointer to the queue, waiting until there is
+	 * free space in it.
+	 * @param[in] ptr - pointer to push.
+	 */
+	struct xtm_coro_push_awaiter
+	push(void *ptr)
+	{
+		return xtm_coro_push_awaiter(this, ptr);
+	}
+	/**
+	 * Notify consumer immediately, if something was pushed
+	 * since the last notification.
+	 * @retval 0 on success. Otherwise -1 with errno set appropriately.
+	 */
+	int
+	flush(void)
+	{
+		if (!has_unnotified)
+			return 0;
+		has_unnotified = false;
+		return xtm_queue_notify_consumer(queue);
+	}
+private:
+	/**
+	 * One side of the queue: file descriptor, watched by
+	 * the reactor, and coroutines waiting for it.
+	 */
+	struct side : public xtm_coro_handler {
+		side(struct xtm_coro_queue *q, int f) : owner(q), fd(f) {}
+		void
+		on_readable(void) override
+		{
+			/*
+			 * Consume once per wakeup, no matter how many
+			 * waiters it satisfies.
+			 */
+			xtm_queue_consume(fd);
+			waiters.resume();
+		}
+		void
+		on_flush(void) override
+		{
+			owner->flush();
+		}
+		/**
+		 * Put waiter to the list, start watching fd if it
+		 * isn't watched yet.
+		 * @retval 0 on success. Otherwise -1 with errno set
+		 *         appropriately.
+		 */
+		int
+		wait(struct xtm_coro_waiter *waiter)
+		{
+			if (!is_watched) {
+				if (owner->reactor->watch(fd, this) != 0)
+					return -1;
+				is_watched = true;
+			}
+			waiters.push(waiter);
+			return 0;
+		}
+		void
+		unwatch(void)
+		{
+			if (is_watched)
+				owner->reactor->unwatch(fd);
+			is_watched = false;
+		}
+		struct xtm_coro_queue *owner;
+		struct xtm_coro_waitlist waiters;
+		int fd;
+		bool is_watched = false;
+	};
+	unsigned
+	try_pop(void **ptrs, unsigned max)
+	{
+		unsigned cnt = xtm_queue_pop_ptrs(queue, ptrs, max);
+		/* Try to notify producer again, if queue was full */
+		if (cnt != 0 && xtm_queue_get_reset_was_full(queue))
+			xtm_queue_notify_producer(queue);
+		return cnt;
+	}
+	bool
+	try_push(void *ptr)
+	{
+		unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+		if (xtm_queue_push_ptr(queue, ptr, flags) != 0)
+			return false;
+		if (!has_unnotified) {
+			has_unnotified = true;
+			reactor->defer(&producer);
+		}
+		return true;
+	}
+	/** Wrapped xtm queue. */
+	struct xtm_queue *queue;
+	/** Reactor of the current thread. */
+	struct xtm_coro_reactor *reactor;
+	/** Consumer side, pop_batch waits for it. */
+	struct side consumer;
+	/** Producer side, push waits for it. */
+	struct side producer;
+	/** True if something was pushed since the last notification. */
+	bool has_unnotified = false;
+};
+
+inline bool
+xtm_coro_pop_awaiter::await_ready(void)
+{
+	/* Don't overtake coroutines, which are already waiting. */
+	if (!queue->consumer.waiters.empty())
+		return false;
+	return try_complete();
+}
+
+inline bool
+xtm_coro_pop_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle = h;
+	return queue->consumer.wait(this) == 0;
+}
+
+inline bool
+xtm_coro_pop_awaiter::try_complete(void)
+{
+	count = queue->try_pop(ptr_array, ptr_array_count);
+	return count != 0;
+}
+
+inline bool
+xtm_coro_push_awaiter::await_ready(void)
+{
+	/* Don't overtake coroutines, which are already waiting. */
+	if (!queue->producer.waiters.empty())
+		return false;
+	return try_complete();
+}
+
+inline bool
+xtm_coro_push_awaiter::await_suspend(std::coroutine_handle<> h)
+{
+	handle = h;
+	if (queue->producer.wait(this) == 0)
+		return true;
+	rc = -1;
+	return false;
+}
+
+inline bool
+xtm_coro_push_awaiter::try_complete(void)
+{
+	return queue->try_push(ptr);
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_ingress.h"
+#include "xtm_config.h"
+#include "xtm_fd.h"
+
+#include <sched.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef TARANTOOL_XTM_USE_RSEQ
+#include <sys/rseq.h>
+#endif /* defined(TARANTOOL_XTM_USE_RSEQ) */
+
+/**
+ * Ring of one CPU. Indexes grow monotonically, ring is full, when
+ * write - read == size. Producer and consumer indexes, as well as
+ * slots, are kept on separate cache lines.
+ */
+struct xtm_ingress_ring {
+	/** Index of the next slot to write, advanced by producers. */
+	alignas(64) uint64_t write;
+	/** Spin lock of producers, used only without rseq. */
+	int lock;
+	/** Index of the next slot to read, advanced by consumer. */
+	alignas(64) uint64_t read;
+	/** Slots of the ring. */
+	alignas(64) void *slots[];
+};
+
+struct xtm_ingress {
+	/** Rings, one for each configured CPU. */
+	struct xtm_ingress_ring **rings;
+	/** Count of rings. */
+	uint64_t ring_count;
+	/** Size of each ring, power of two. */
+	uint64_t size;
+	/** Flag, which is set, if rings are written with rseq. */
+	bool uses_rseq;
+	/** Ring, which consumer starts the next pop from. */
+	unsigned next_ring;
+	/** File descriptor that the consumer thread must poll. */
+	int consumer_read_fd;
+	/** File descriptor to which producer threads write. */
+	int consumer_write_fd;
+	/**
+	 * Flag, which consumer sets, when it leaves rings empty, and
+	 * the producer, which pushes next, clears and notifies it.
+	 */
+	alignas(64) int consumer_waiting;
+};
+
+#ifdef TARANTOOL_XTM_USE_RSEQ
+enum {
+	/** Pointer is pushed. */
+	XTM_INGRESS_RSEQ_DONE,
+	/** Ring of the current CPU is full. */
+	XTM_INGRESS_RSEQ_FULL,
+	/** Thread has no rseq registered, or CPU has no ring. */
+	XTM_INGRESS_RSEQ_NO_CPU,
+	/** Critical section was aborted by the kernel, retry. */
+	XTM_INGRESS_RSEQ_ABORTED,
+};
+
+static inline struct rseq *
+ingress_rseq_area(void)
+{
+	return (struct rseq *)((char *)__builtin_thread_pointer() +
+			       __rseq_offset);
+}
+
+/**
+ * Push pointer to the ring of the current CPU in a restartable
+ * sequence. The current CPU is read inside the critical section,
+ * which ends with a single store of the new write index, so if the
+ * thread is preempted, migrated or signalled before that store, the
+ * kernel moves it to the abort handler, and nothing is committed.
+ * Consumer reads write index with acquire semantics, which, with
+ * x86 stores being ordered, makes the slot visible before the index.
+ */
+static inline int
+ingress_rseq_push(struct xtm_ingress *ingress, struct rseq *rs, void *ptr)
+{
+	__asm__ __volatile__ goto(
+		/* Critical section descriptor. */
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		/* Arm the critical section. */
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs_off](%[rs])\n\t"
+		"1:\n\t"
+		"movl %c[cpu_off](%[rs]), %%eax\n\t"
+		"cmpq %[ring_count], %%rax\n\t"
+		"jae %l[no_cpu]\n\t"
+		"movq (%[rings], %%rax, 8), %%rcx\n\t"
+		"movq %c[write_off](%%rcx), %%rdx\n\t"
+		"movq %%rdx, %%rax\n\t"
+		"subq %c[read_off](%%rcx), %%rax\n\t"
+		"cmpq %[size], %%rax\n\t"
+		"jae %l[full]\n\t"
+		"movq %%rdx, %%rax\n\t"
+		"andq %[mask], %%rax\n\t"
+		"movq %[ptr], %c[slots_off](%%rcx, %%rax, 8)\n\t"
+		"addq $1, %%rdx\n\t"
+		/* Commit. */
+		"movq %%rdx, %c[write_off](%%rcx)\n\t"
+		"2:\n\t"
+		/* Abort handler, preceded by the signature. */
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".long %c[sig]\n\t"
+		"4:\n\t"
+		"jmp %l[aborted]\n\t"
+		".popsection\n\t"
+		:
+		: [rs] "r" (rs),
+		  [rings] "r" (ingress->rings),
+		  [ring_count] "r" (ingress->ring_count),
+		  [size] "r" (ingress->size),
+		  [mask] "r" (ingress->size - 1),
+		  [ptr] "r" (ptr),
+		  [cs_off] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu_off] "i" (offsetof(struct rseq, cpu_id)),
+		  [write_off] "i" (offsetof(struct xtm_ingress_ring, write)),
+		  [read_off] "i" (offsetof(struct xtm_ingress_ring, read)),
+		  [slots_off] "i" (offsetof(struct xtm_ingress_ring, slots)),
+		  [sig] "i" (RSEQ_SIG)
+		: "memory", "cc", "rax", "rcx", "rdx"
+		: full, no_cpu, aborted);
+	return XTM_INGRESS_RSEQ_DONE;
+full:
+	return XTM_INGRESS_RSEQ_FULL;
+no_cpu:
+	return XTM_INGRESS_RSEQ_NO_CPU;
+aborted:
+	return XTM_INGRESS_RSEQ_ABORTED;
+}
+
+/**
+ * Push pointer with rseq, restarting the critical section, until it
+ * is committed or fails.
+ */
+static int
+ingress_rseq_push_retry(struct xtm_ingress *ingress, void *ptr)
+{
+	struct rseq *rs = ingress_rseq_area();
+	int rc;
+	while ((rc = ingress_rseq_push(ingress, rs, ptr)) ==
+	       XTM_INGRESS_RSEQ_ABORTED)
+		;
+	if (rc == XTM_INGRESS_RSEQ_DONE)
+		return 0;
+	/* Thread without rseq can't share rings with other writers. */
+	errno = (rc == XTM_INGRESS_RSEQ_FULL ? ENOBUFS : ENOTSUP);
+	return -1;
+}
+#endif /* defined(TARANTOOL_XTM_USE_RSEQ) */
+
+/**
+ * Push pointer to the ring of the current CPU under its spin lock.
+ * Thread may be migrated after it has chosen the ring, which costs
+ * only some contention, since the ring is locked anyway.
+ */
+static int
+ingress_locked_push(struct xtm_ingress *ingress, void *ptr)
+{
+	int cpu = sched_getcpu();
+	if (cpu < 0)
+		cpu = 0;
+	struct xtm_ingress_ring *ring =
+		ingress->rings[(unsigned)cpu % ingress->ring_count];
+	while (__atomic_exchange_n(&ring->lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&ring->lock, __ATOMIC_RELAXED) != 0)
+			sched_yield();
+	}
+	uint64_t write = ring->write;
+	uint64_t read = __atomic_load_n(&ring->read, __ATOMIC_ACQUIRE);
+	int rc = 0;
+	if (write - read >= ingress->size) {
+		errno = ENOBUFS;
+		rc = -1;
+	} else {
+		ring->slots[write & (ingress->size - 1)] = ptr;
+		__atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&ring->lock, 0, __ATOMIC_RELEASE);
+	return rc;
+}
+
+struct xtm_ingress *
+xtm_ingress_new(unsigned size)
+{
+	if (size <= 1 || (size & (size - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	void *mem;
+	if (posix_memalign(&mem, alignof(struct xtm_ingress),
+			   sizeof(struct xtm_ingress)) != 0) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	struct xtm_ingress *ingress = (struct xtm_ingress *)mem;
+	memset(ingress, 0, sizeof(*ingress));
+	long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+	ingress->ring_count = (cpu_count > 0 ? cpu_count : 1);
+	ingress->size = size;
+	/* The first push notifies consumer. */
+	ingress->consumer_waiting = 1;
+	ingress->consumer_read_fd = ingress->consumer_write_fd = -1;
+#ifdef TARANTOOL_XTM_USE_RSEQ
+	/* Libc registers rseq for all threads or for none of them. */
+	ingress->uses_rseq = __rseq_size > 0 &&
+			     (int32_t)ingress_rseq_area()->cpu_id >= 0;
+#endif /* defined(TARANTOOL_XTM_USE_RSEQ) */
+	ingress->rings = (struct xtm_ingress_ring **)
+		calloc(ingress->ring_count, sizeof(struct xtm_ingress_ring *));
+	if (ingress->rings == NULL)
+		goto fail;
+	for (unsigned i = 0; i < ingress->ring_count; i++) {
+		if (posix_memalign(&mem, alignof(struct xtm_ingress_ring),
+				   sizeof(struct xtm_ingress_ring) +
+				   size * sizeof(void *)) != 0) {
+			errno = ENOMEM;
+			goto fail;
+		}
+		ingress->rings[i] = (struct xtm_ingress_ring *)mem;
+		memset(ingress->rings[i], 0, sizeof(struct xtm_ingress_ring));
+	}
+	if (create_fds(&ingress->consumer_read_fd,
+		       &ingress->consumer_write_fd) != 0)
+		goto fail;
+	return ingress;
+fail:
+	int save_errno = errno;
+	xtm_ingress_delete(ingress);
+	errno = save_errno;
+	return NULL;
+}
+
+int
+xtm_ingress_delete(struct xtm_ingress *ingress)
+{
+	int rc = 0;
+	if (ingress->consumer_read_fd >= 0 &&
+	    close(ingress->consumer_read_fd) < 0)
+		rc = -1;
+	if (ingress->consumer_write_fd != ingress->consumer_read_fd &&
+	    close(ingress->consumer_write_fd) < 0)
+		rc = -1;
+	for (unsigned i = 0; ingress->rings != NULL &&
+	     i < ingress->ring_count; i++)
+		free(ingress->rings[i]);
+	free(ingress->rings);
+	free(ingress);
+	return rc;
+}
+
+int
+xtm_ingress_push(struct xtm_ingress *ingress, void *ptr)
+{
+	int rc;
+#ifdef TARANTOOL_XTM_USE_RSEQ
+	if (ingress->uses_rseq)
+		rc = ingress_rseq_push_retry(ingress, ptr);
+	else
+#endif /* defined(TARANTOOL_XTM_USE_RSEQ) */
+		rc = ingress_locked_push(ingress, ptr);
+	if (rc != 0)
+		return -1;
+	/* Order the write index store before the load of the flag. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ingress->consumer_waiting, __ATOMIC_RELAXED) == 0 ||
+	    __atomic_exchange_n(&ingress->consumer_waiting, 0,
+				__ATOMIC_RELAXED) == 0)
+		return 0;
+	return notify_fd(ingress->consumer_write_fd);
+}
+
+/**
+ * Pop pointers from all rings, starting from the next one after the
+ * ring, which the previous pop started from, so that busy CPUs don't
+ * starve the others.
+ */
+static unsigned
+ingress_drain(struct xtm_ingress *ingress, void **ptrs, unsigned count)
+{
+	unsigned popped = 0;
+	uint64_t mask = ingress->size - 1;
+	for (unsigned i = 0; i < ingress->ring_count && popped < count; i++) {
+		struct xtm_ingress_ring *ring =
+			ingress->rings[(ingress->next_ring + i) %
+				       ingress->ring_count];
+		uint64_t read = ring->read;
+		uint64_t write = __atomic_load_n(&ring->write,
+						 __ATOMIC_ACQUIRE);
+		uint64_t n = write - read;
+		if (n == 0)
+			continue;
+		if (n > count - popped)
+			n = count - popped;
+		for (uint64_t j = 0; j < n; j++)
+			ptrs[popped++] = ring->slots[(read + j) & mask];
+		__atomic_store_n(&ring->read, read + n, __ATOMIC_RELEASE);
+	}
+	if (++ingress->next_ring == ingress->ring_count)
+		ingress->next_ring = 0;
+	return popped;
+}
+
+static bool
+ingress_is_empty(struct xtm_ingress *ingress)
+{
+	for (unsigned i = 0; i < ingress->ring_count; i++) {
+		struct xtm_ingress_ring *ring = ingress->rings[i];
+		if (__atomic_load_n(&ring->write, __ATOMIC_ACQUIRE) !=
+		    ring->read)
+			return false;
+	}
+	return true;
+}
+
+unsigned
+xtm_ingress_pop(struct xtm_ingress *ingress, void **ptrs, unsigned count)
+{
+	unsigned popped = 0;
+	for (;;) {
+		popped += ingress_drain(ingress, ptrs + popped,
+					count - popped);
+		if (popped == count)
+			return popped;
+		__atomic_store_n(&ingress->consumer_waiting, 1,
+				 __ATOMIC_RELAXED);
+		/* Order the flag store before loads of write indexes. */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (ingress_is_empty(ingress))
+			return popped;
+		__atomic_store_n(&ingress->consumer_waiting, 0,
+				 __ATOMIC_RELAXED);
+	}
+}
+
+int
+xtm_ingress_consumer_fd(struct xtm_ingress *ingress)
+{
+	return ingress->consumer_read_fd;
+}
+
+bool
+xtm_ingress_uses_rseq(struct xtm_ingress *ingress)
+{
+	return ingress->uses_rseq;
+}
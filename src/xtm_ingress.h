@@ -0,0 +1,118 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdbool.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Multi-producer single-consumer ingress, sharded per CPU: each CPU
+ * has its own ring, written by threads running on that CPU, so that
+ * producers don't contend on a shared tail index, and the count of
+ * rings doesn't grow with the count of producer threads. On x86-64
+ * Linux with restartable sequences (rseq) registered by libc, ring
+ * is written in a restartable critical section, which the kernel
+ * aborts, if the thread is preempted or migrated, so push takes no
+ * locks and no atomic read-modify-write instructions. Otherwise
+ * ring of each CPU is protected by a spin lock. Consumer drains all
+ * rings and is woken through a single file descriptor. Pointers
+ * pushed on the same CPU are popped in push order, there is no order
+ * between pointers pushed on different CPUs.
+ */
+struct xtm_ingress;
+
+/**
+ * Create ingress with a ring for each configured CPU.
+ * @param[in] size - size of ring of each CPU, must be power of two
+ *                   and greater than one.
+ * @retval    pointer to new xtm_ingress or NULL in case of error.
+ */
+struct xtm_ingress *
+xtm_ingress_new(unsigned size);
+
+/**
+ * Free ingress and close its file descriptor.
+ * @param[in] ingress - xtm_ingress to delete.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in close(2)).
+ */
+int
+xtm_ingress_delete(struct xtm_ingress *ingress);
+
+/**
+ * Push pointer to the ring of the current CPU, may be called from any
+ * thread. Consumer is notified, only if it is waiting for pointers.
+ * @param[in] ingress - xtm_ingress to push to.
+ * @param[in] ptr     - pointer to push.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOBUFS, if
+ *            ring of the current CPU is full, to ENOTSUP, if ingress
+ *            uses rseq, but the calling thread has none registered,
+ *            or appropriately (as in write(2)), if notification failed.
+ */
+int
+xtm_ingress_push(struct xtm_ingress *ingress, void *ptr);
+
+/**
+ * Pop pointers from rings of all CPUs. If rings are left empty,
+ * consumer is marked as waiting, so that the next push notifies it.
+ * Consumer should consume its file descriptor before popping, and
+ * wait for it only after pop returned less than count pointers.
+ * Must be called from consumer thread.
+ * @param[in]  ingress - xtm_ingress to pop from.
+ * @param[out] ptrs    - array to fill with pointers.
+ * @param[in]  count   - maximum count of pointers to pop.
+ * @retval     count of popped pointers.
+ */
+unsigned
+xtm_ingress_pop(struct xtm_ingress *ingress, void **ptrs, unsigned count);
+
+/**
+ * Returns file descriptor, that should be watched by consumer thread
+ * to become readable, when pointers are pushed to ingress.
+ * @param[in] ingress - xtm_ingress to get file descriptor.
+ * @retval    consumer file descriptor.
+ */
+int
+xtm_ingress_consumer_fd(struct xtm_ingress *ingress);
+
+/**
+ * Check whether ingress is written with restartable sequences.
+ * @param[in] ingress - xtm_ingress to check.
+ * @retval    true if push uses rseq, false if it uses spin locks.
+ */
+bool
+xtm_ingress_uses_rseq(struct xtm_ingress *ingress);
+
+#if defined(__cplusplus)
+}
+#endif /* defined(__cplusplus) */
@@ -0,0 +1,356 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_mesh.h"
+#include "xtm_config.h"
+#include "xtm_fd.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * Alignment of memory, allocated by receiver in xtm_mesh_attach, so
+ * that memory of different receivers doesn't share pages, and first
+ * touch places each page on the node of its receiver.
+ */
+#define XTM_MESH_PAGE_SIZE 4096
+
+/**
+ * Single-producer single-consumer ring. Indexes grow monotonically,
+ * ring is full, when write - read == size. Producer and consumer
+ * fields, as well as slots, are kept on separate cache lines.
+ */
+struct xtm_mesh_ring {
+	/** Index of the next slot to write, advanced by producer. */
+	alignas(64) uint64_t write;
+	/**
+	 * Read index, as producer saw it last time, so that producer
+	 * reads consumer cache line only when ring looks full.
+	 */
+	uint64_t cached_read;
+	/** Index of the next slot to read, advanced by consumer. */
+	alignas(64) uint64_t read;
+	/** Slots of the ring. */
+	alignas(64) void *slots[];
+};
+
+/**
+ * State of a mesh thread. Fields written by the thread itself and
+ * fields written by its peers are kept on separate cache lines.
+ */
+struct xtm_mesh_thread {
+	/**
+	 * Incoming rings, one from each sender, in a single block
+	 * allocated by this thread, NULL until it attaches.
+	 */
+	char *rings;
+	/** Ids of receivers, which this thread pushed to since flush. */
+	unsigned *dirty;
+	/** Count of ids in dirty. */
+	unsigned dirty_count;
+	/** Flags of receivers, which are in dirty. */
+	bool *is_dirty;
+	/** File descriptor that the thread must poll. */
+	int read_fd;
+	/** File descriptor to which senders write. */
+	int write_fd;
+	/**
+	 * Bitmap of senders, which flushed pointers to this thread,
+	 * set by senders and cleared by this thread. Allocated with
+	 * incoming rings.
+	 */
+	uint64_t *ready;
+	/**
+	 * Flag, which thread sets, when it has found nothing to poll,
+	 * and the sender, which flushes next, clears and notifies it.
+	 */
+	alignas(64) int waiting;
+};
+
+struct xtm_mesh {
+	/** Threads of the mesh. */
+	struct xtm_mesh_thread *threads;
+	/** Count of threads. */
+	unsigned thread_count;
+	/** Count of 64-bit words in bitmap of each thread. */
+	unsigned ready_words;
+	/** Size of each ring, power of two. */
+	uint64_t size;
+	/** Size of ring with its slots, in bytes, multiple of 64. */
+	size_t ring_stride;
+};
+
+static inline struct xtm_mesh_ring *
+mesh_ring(struct xtm_mesh *mesh, char *rings, unsigned from)
+{
+	return (struct xtm_mesh_ring *)(rings + from * mesh->ring_stride);
+}
+
+struct xtm_mesh *
+xtm_mesh_new(unsigned thread_count, unsigned ring_size)
+{
+	if (thread_count == 0 || ring_size <= 1 ||
+	    (ring_size & (ring_size - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct xtm_mesh *mesh = (struct xtm_mesh *)
+		calloc(1, sizeof(struct xtm_mesh));
+	if (mesh == NULL)
+		return NULL;
+	mesh->thread_count = thread_count;
+	mesh->ready_words = (thread_count + 63) / 64;
+	mesh->size = ring_size;
+	mesh->ring_stride = (sizeof(struct xtm_mesh_ring) +
+			     ring_size * sizeof(void *) + 63) & ~(size_t)63;
+	void *mem;
+	if (posix_memalign(&mem, alignof(struct xtm_mesh_thread),
+			   thread_count * sizeof(struct xtm_mesh_thread)) != 0) {
+		free(mesh);
+		errno = ENOMEM;
+		return NULL;
+	}
+	mesh->threads = (struct xtm_mesh_thread *)mem;
+	memset(mesh->threads, 0,
+	       thread_count * sizeof(struct xtm_mesh_thread));
+	for (unsigned i = 0; i < thread_count; i++) {
+		struct xtm_mesh_thread *thread = &mesh->threads[i];
+		thread->read_fd = thread->write_fd = -1;
+		/* The first flush notifies the thread. */
+		thread->waiting = 1;
+	}
+	for (unsigned i = 0; i < thread_count; i++) {
+		struct xtm_mesh_thread *thread = &mesh->threads[i];
+		if (create_fds(&thread->read_fd, &thread->write_fd) != 0) {
+			int save_errno = errno;
+			xtm_mesh_delete(mesh);
+			errno = save_errno;
+			return NULL;
+		}
+	}
+	return mesh;
+}
+
+int
+xtm_mesh_delete(struct xtm_mesh *mesh)
+{
+	int rc = 0;
+	for (unsigned i = 0; i < mesh->thread_count; i++) {
+		struct xtm_mesh_thread *thread = &mesh->threads[i];
+		if (thread->read_fd >= 0 && close(thread->read_fd) < 0)
+			rc = -1;
+		if (thread->write_fd != thread->read_fd &&
+		    close(thread->write_fd) < 0)
+			rc = -1;
+		free(thread->rings);
+		free(thread->dirty);
+		free(thread->is_dirty);
+	}
+	free(mesh->threads);
+	free(mesh);
+	return rc;
+}
+
+int
+xtm_mesh_attach(struct xtm_mesh *mesh, unsigned id)
+{
+	assert(id < mesh->thread_count);
+	struct xtm_mesh_thread *thread = &mesh->threads[id];
+	assert(thread->rings == NULL);
+	size_t rings_size = mesh->thread_count * mesh->ring_stride;
+	size_t ready_size = mesh->ready_words * sizeof(uint64_t);
+	void *mem;
+	if (posix_memalign(&mem, XTM_MESH_PAGE_SIZE,
+			   rings_size + ready_size) != 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	thread->dirty = (unsigned *)
+		malloc(mesh->thread_count * sizeof(unsigned));
+	thread->is_dirty = (bool *)calloc(mesh->thread_count, sizeof(bool));
+	if (thread->dirty == NULL || thread->is_dirty == NULL) {
+		free(mem);
+		free(thread->dirty);
+		free(thread->is_dirty);
+		thread->dirty = NULL;
+		thread->is_dirty = NULL;
+		errno = ENOMEM;
+		return -1;
+	}
+	/* Touch all memory, so that it is placed on the local node. */
+	memset(mem, 0, rings_size + ready_size);
+	thread->ready = (uint64_t *)((char *)mem + rings_size);
+	/* Ring memory must be visible to senders, which see the pointer. */
+	__atomic_store_n(&thread->rings, (char *)mem, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int
+xtm_mesh_push(struct xtm_mesh *mesh, unsigned from, unsigned to,
+	      void *ptr)
+{
+	assert(from < mesh->thread_count && to < mesh->thread_count);
+	struct xtm_mesh_thread *sender = &mesh->threads[from];
+	char *rings = __atomic_load_n(&mesh->threads[to].rings,
+				      __ATOMIC_ACQUIRE);
+	/* Dirty list of sender is allocated, when sender attaches. */
+	if (rings == NULL || sender->is_dirty == NULL) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	struct xtm_mesh_ring *ring = mesh_ring(mesh, rings, from);
+	uint64_t write = ring->write;
+	if (write - ring->cached_read >= mesh->size) {
+		ring->cached_read = __atomic_load_n(&ring->read,
+						    __ATOMIC_ACQUIRE);
+		if (write - ring->cached_read >= mesh->size) {
+			errno = ENOBUFS;
+			return -1;
+		}
+	}
+	ring->slots[write & (mesh->size - 1)] = ptr;
+	__atomic_store_n(&ring->write, write + 1, __ATOMIC_RELEASE);
+	if (!sender->is_dirty[to]) {
+		sender->is_dirty[to] = true;
+		sender->dirty[sender->dirty_count++] = to;
+	}
+	return 0;
+}
+
+int
+xtm_mesh_flush(struct xtm_mesh *mesh, unsigned from)
+{
+	assert(from < mesh->thread_count);
+	struct xtm_mesh_thread *sender = &mesh->threads[from];
+	uint64_t bit = 1ull << (from % 64);
+	int notified = 0;
+	int rc = 0;
+	for (unsigned i = 0; i < sender->dirty_count; i++) {
+		unsigned to = sender->dirty[i];
+		struct xtm_mesh_thread *receiver = &mesh->threads[to];
+		sender->is_dirty[to] = false;
+		/*
+		 * Receiver, which clears the bit after this operation,
+		 * sees the pushed pointers. Sequentially consistent
+		 * operations on bitmap and waiting flag ensure, that
+		 * either receiver sees the bit before it waits, or this
+		 * thread sees, that receiver is waiting.
+		 */
+		__atomic_fetch_or(&receiver->ready[from / 64], bit,
+				  __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&receiver->waiting,
+				    __ATOMIC_SEQ_CST) == 0 ||
+		    __atomic_exchange_n(&receiver->waiting, 0,
+					__ATOMIC_RELAXED) == 0)
+			continue;
+		if (notify_fd(receiver->write_fd) != 0)
+			rc = -1;
+		else
+			notified++;
+	}
+	sender->dirty_count = 0;
+	return rc != 0 ? -1 : notified;
+}
+
+/**
+ * Drain rings of senders, whose bits are set in bitmap of the thread,
+ * clearing those bits.
+ */
+static unsigned
+mesh_drain(struct xtm_mesh *mesh, struct xtm_mesh_thread *thread,
+	   xtm_mesh_fun_t fun, void *ctx)
+{
+	unsigned count = 0;
+	uint64_t mask = mesh->size - 1;
+	for (unsigned w = 0; w < mesh->ready_words; w++) {
+		if (__atomic_load_n(&thread->ready[w], __ATOMIC_RELAXED) == 0)
+			continue;
+		uint64_t bits = __atomic_exchange_n(&thread->ready[w], 0,
+						    __ATOMIC_SEQ_CST);
+		while (bits != 0) {
+			unsigned from = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			struct xtm_mesh_ring *ring =
+				mesh_ring(mesh, thread->rings, from);
+			uint64_t read = ring->read;
+			uint64_t write = __atomic_load_n(&ring->write,
+							 __ATOMIC_ACQUIRE);
+			for (uint64_t i = read; i != write; i++)
+				fun(ctx, from, ring->slots[i & mask]);
+			count += write - read;
+			__atomic_store_n(&ring->read, write, __ATOMIC_RELEASE);
+		}
+	}
+	return count;
+}
+
+static bool
+mesh_is_ready(struct xtm_mesh *mesh, struct xtm_mesh_thread *thread)
+{
+	for (unsigned w = 0; w < mesh->ready_words; w++) {
+		if (__atomic_load_n(&thread->ready[w], __ATOMIC_SEQ_CST) != 0)
+			return true;
+	}
+	return false;
+}
+
+unsigned
+xtm_mesh_poll_all(struct xtm_mesh *mesh, unsigned id, xtm_mesh_fun_t fun,
+		  void *ctx)
+{
+	assert(id < mesh->thread_count);
+	struct xtm_mesh_thread *thread = &mesh->threads[id];
+	assert(thread->rings != NULL);
+	for (;;) {
+		unsigned count = mesh_drain(mesh, thread, fun, ctx);
+		if (count > 0)
+			return count;
+		__atomic_store_n(&thread->waiting, 1, __ATOMIC_SEQ_CST);
+		if (!mesh_is_ready(mesh, thread))
+			return 0;
+		/*
+		 * Sender has flushed after the drain, it may have seen
+		 * the flag or not, anyway drain again.
+		 */
+		__atomic_store_n(&thread->waiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+int
+xtm_mesh_fd(struct xtm_mesh *mesh, unsigned id)
+{
+	assert(id < mesh->thread_count);
+	return mesh->threads[id].read_fd;
+}
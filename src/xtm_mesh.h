@@ -0,0 +1,152 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <stdbool.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * All-to-all mesh of single-producer single-consumer rings for N
+ * threads, which message each other (e.g. shards of shared-nothing
+ * runtime). Each thread has one ring from every thread, including
+ * itself, a bitmap of senders, whose rings it should drain, and a
+ * single file descriptor to wait on, so a thread polls one fd
+ * instead of N, and mesh has N file descriptors instead of 2N^2.
+ * Incoming rings and bitmap of each thread are allocated and touched
+ * by that thread in xtm_mesh_attach, so with first-touch memory
+ * policy they are local to NUMA node of the receiver.
+ */
+struct xtm_mesh;
+
+/**
+ * Callback, which xtm_mesh_poll_all calls for each received pointer.
+ * @param[in] ctx  - context passed to xtm_mesh_poll_all.
+ * @param[in] from - id of sender thread.
+ * @param[in] ptr  - received pointer.
+ */
+typedef void (*xtm_mesh_fun_t)(void *ctx, unsigned from, void *ptr);
+
+/**
+ * Create mesh for thread_count threads, with ids from 0 to
+ * thread_count - 1. Rings are allocated by xtm_mesh_attach.
+ * @param[in] thread_count - count of threads, must be positive.
+ * @param[in] ring_size    - size of each ring, must be power of two
+ *                           and greater than one.
+ * @retval    pointer to new xtm_mesh or NULL in case of error.
+ */
+struct xtm_mesh *
+xtm_mesh_new(unsigned thread_count, unsigned ring_size);
+
+/**
+ * Free mesh and close its file descriptors. Pointers, which weren't
+ * polled, are discarded. Must be called, when threads stopped using
+ * the mesh.
+ * @param[in] mesh - xtm_mesh to delete.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately
+ *            (as in close(2)).
+ */
+int
+xtm_mesh_delete(struct xtm_mesh *mesh);
+
+/**
+ * Allocate incoming rings of the thread, must be called by this
+ * thread once before it pushes or polls. Until thread is attached,
+ * pushes to it fail with ENOTCONN.
+ * @param[in] mesh - xtm_mesh to attach to.
+ * @param[in] id   - id of the calling thread.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOMEM.
+ */
+int
+xtm_mesh_attach(struct xtm_mesh *mesh, unsigned id);
+
+/**
+ * Push pointer to ring from thread `from` to thread `to`. Receiver
+ * is neither marked as ready nor notified until sender calls
+ * xtm_mesh_flush, so that sender can push a batch of pointers to
+ * several threads and pay for synchronization once per receiver.
+ * Must be called by thread `from`.
+ * @param[in] mesh - xtm_mesh to push to.
+ * @param[in] from - id of the calling thread.
+ * @param[in] to   - id of receiver thread.
+ * @param[in] ptr  - pointer to push.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOBUFS, if
+ *            the ring is full, or to ENOTCONN, if sender or receiver
+ *            hasn't attached yet.
+ */
+int
+xtm_mesh_push(struct xtm_mesh *mesh, unsigned from, unsigned to,
+	      void *ptr);
+
+/**
+ * Mark sender as ready in bitmaps of threads, which it pushed to
+ * since the previous flush, and notify those of them, which wait
+ * for messages. Must be called by thread `from`.
+ * @param[in] mesh - xtm_mesh to flush.
+ * @param[in] from - id of the calling thread.
+ * @retval    count of notified threads on success. Otherwise -1 with
+ *            errno set appropriately (as in write(2)).
+ */
+int
+xtm_mesh_flush(struct xtm_mesh *mesh, unsigned from);
+
+/**
+ * Drain incoming rings of the thread, which are marked as ready in
+ * its bitmap, calling fun for each pointer. Rings of senders, which
+ * haven't flushed since the previous poll, aren't touched. If there
+ * was nothing to drain, thread is marked as waiting, and the next
+ * flush to it notifies its file descriptor. Thread should wait for
+ * its file descriptor only after poll returned 0.
+ * Must be called by thread `id`.
+ * @param[in] mesh - xtm_mesh to poll.
+ * @param[in] id   - id of the calling thread.
+ * @param[in] fun  - function to call for each pointer.
+ * @param[in] ctx  - context passed to fun.
+ * @retval    count of received pointers.
+ */
+unsigned
+xtm_mesh_poll_all(struct xtm_mesh *mesh, unsigned id, xtm_mesh_fun_t fun,
+		  void *ctx);
+
+/**
+ * Returns file descriptor, that should be watched by thread to
+ * become readable, when other threads flush pointers to it.
+ * @param[in] mesh - xtm_mesh to get file descriptor.
+ * @param[in] id   - id of the thread.
+ * @retval    file descriptor of the thread.
+ */
+int
+xtm_mesh_fd(struct xtm_mesh *mesh, unsigned id);
+
+#if defined(__cplusplus)
+}
+#endif /* defined(__cplusplus) */
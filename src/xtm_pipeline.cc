@@ -0,0 +1,544 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_pipeline.h"
+#include "xtm_config.h"
+#include "xtm_fd.h"
+#include "xtm_clock.h"
+
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+
+/** Maximum count of items, which stage thread handles at once. */
+#define XTM_PIPELINE_BATCH 64
+/** Count of items pushed to the pipeline, until it is closed. */
+#define XTM_PIPELINE_OPEN UINT64_MAX
+
+/**
+ * Set of queues from threads of one stage to threads of the next one,
+ * queue from producer thread i to consumer thread j has index
+ * i * consumer_count + j. Item with sequence number k goes from
+ * thread k % producer_count to thread k % consumer_count.
+ */
+struct xtm_pipeline_link {
+	/** Count of producer threads. */
+	unsigned producer_count;
+	/** Count of consumer threads. */
+	unsigned consumer_count;
+	/** Queues of the link. */
+	struct xtm_queue **queues;
+};
+
+struct xtm_pipeline_thread {
+	/** Stage of the thread. */
+	struct xtm_pipeline_stage *stage;
+	/** Index of the thread in the stage. */
+	unsigned index;
+	/** Thread id. */
+	pthread_t thread;
+	/** Throughput counters, updated by the thread. */
+	struct xtm_pipeline_stage_stats stats;
+};
+
+struct xtm_pipeline_stage {
+	/** Pipeline of the stage. */
+	struct xtm_pipeline *pipeline;
+	/** Stage function. */
+	xtm_pipeline_fun_t fun;
+	/** Stage function context. */
+	void *ctx;
+	/** Count of stage threads. */
+	unsigned thread_count;
+	/** Stage threads. */
+	struct xtm_pipeline_thread *threads;
+	/** Queues from the previous stage or from the owner. */
+	struct xtm_pipeline_link *input;
+	/** Queues to the next stage or to the owner. */
+	struct xtm_pipeline_link *output;
+	/** Flag, which is set for the last stage. */
+	bool is_last;
+};
+
+struct xtm_pipeline {
+	/** Size of queues between stages. */
+	unsigned queue_size;
+	/** Count of stages. */
+	unsigned stage_count;
+	/** Array of stages. */
+	struct xtm_pipeline_stage *stages;
+	/**
+	 * Array of stage_count + 1 links: link i is the input of
+	 * stage i, the last one goes to the owner.
+	 */
+	struct xtm_pipeline_link *links;
+	/** Count of stage threads, which were started. */
+	unsigned started_count;
+	/** Sequence number of the next pushed item. */
+	uint64_t push_seq;
+	/** Sequence number of the next popped item. */
+	uint64_t pop_seq;
+	/**
+	 * Count of items pushed to the pipeline, set on delete, so
+	 * that stage threads know, when to exit.
+	 */
+	uint64_t input_count;
+	/**
+	 * File descriptors, which become readable, when the pipeline
+	 * is closed. Never consumed, so that all threads see it.
+	 */
+	int close_read_fd;
+	int close_write_fd;
+	/** File descriptors, which last stage notifies owner with. */
+	int output_read_fd;
+	int output_write_fd;
+};
+
+static int
+pipeline_close_fds(int read_fd, int write_fd)
+{
+	int rc = 0;
+	if (read_fd >= 0 && close(read_fd) < 0)
+		rc = -1;
+	if (write_fd != read_fd && write_fd >= 0 && close(write_fd) < 0)
+		rc = -1;
+	return rc;
+}
+
+/**
+ * Wait until one of file descriptors becomes readable.
+ * @retval mask of readable file descriptors.
+ */
+static unsigned
+pipeline_wait_fds(int fd1, int fd2)
+{
+	struct pollfd pfds[2];
+	pfds[0].fd = fd1;
+	pfds[1].fd = fd2;
+	pfds[0].events = pfds[1].events = POLLIN;
+	pfds[0].revents = pfds[1].revents = 0;
+	nfds_t count = (fd2 >= 0 ? 2 : 1);
+	while (poll(pfds, count, -1) < 0 && errno == EINTR)
+		;
+	return ((pfds[0].revents != 0 ? 1 : 0) |
+		(pfds[1].revents != 0 ? 2 : 0));
+}
+
+static inline void
+pipeline_stat_add(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Queue of the link, which carries item with given sequence number.
+ */
+static inline struct xtm_queue *
+pipeline_link_queue(struct xtm_pipeline_link *link, uint64_t seq)
+{
+	return link->queues[(seq % link->producer_count) *
+			    link->consumer_count +
+			    seq % link->consumer_count];
+}
+
+/**
+ * Pop item with given sequence number from the link.
+ * @retval true if item was popped.
+ */
+static inline bool
+pipeline_link_pop(struct xtm_pipeline_link *link, uint64_t seq, void **item)
+{
+	struct xtm_queue *queue = pipeline_link_queue(link, seq);
+	if (xtm_queue_pop_ptrs(queue, item, 1) == 0)
+		return false;
+	if (xtm_queue_get_reset_was_full(queue))
+		xtm_queue_notify_producer(queue);
+	return true;
+}
+
+/**
+ * Flush notifications of the batch, pushed by stage thread.
+ */
+static inline void
+pipeline_thread_flush(struct xtm_pipeline_thread *thread)
+{
+	struct xtm_pipeline_stage *stage = thread->stage;
+	if (stage->is_last)
+		notify_fd(stage->pipeline->output_write_fd);
+	else
+		xtm_flush_notifications();
+}
+
+/**
+ * Push item with given sequence number to the output link of the
+ * stage, waiting for free space, if the queue is full.
+ */
+static void
+pipeline_thread_push(struct xtm_pipeline_thread *thread, uint64_t seq,
+		     void *item)
+{
+	struct xtm_pipeline_stage *stage = thread->stage;
+	struct xtm_queue *queue = pipeline_link_queue(stage->output, seq);
+	unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+	if (!stage->is_last)
+		flags |= XTM_QUEUE_DEFERRED_NOTIFY;
+	while (xtm_queue_push_ptr(queue, item, flags) != 0) {
+		/* Consumer must see the batch to make space for us. */
+		pipeline_thread_flush(thread);
+		uint64_t start = clock_now_nsec();
+		int fd = xtm_queue_producer_fd(queue);
+		pipeline_wait_fds(fd, -1);
+		xtm_queue_consume(fd);
+		pipeline_stat_add(&thread->stats.output_wait_nsec,
+				  clock_now_nsec() - start);
+	}
+}
+
+static void *
+pipeline_thread_f(void *arg)
+{
+	struct xtm_pipeline_thread *thread = (struct xtm_pipeline_thread *)arg;
+	struct xtm_pipeline_stage *stage = thread->stage;
+	struct xtm_pipeline *pipeline = stage->pipeline;
+	uint64_t step = stage->thread_count;
+	uint64_t seq = thread->index;
+	void *items[XTM_PIPELINE_BATCH];
+	for (;;) {
+		uint64_t input_count = __atomic_load_n(&pipeline->input_count,
+						       __ATOMIC_ACQUIRE);
+		unsigned count = 0;
+		while (count < XTM_PIPELINE_BATCH &&
+		       seq + count * step < input_count &&
+		       pipeline_link_pop(stage->input, seq + count * step,
+					 &items[count]))
+			count++;
+		if (count == 0) {
+			if (seq >= input_count)
+				break;
+			uint64_t start = clock_now_nsec();
+			int fd = xtm_queue_consumer_fd(
+				pipeline_link_queue(stage->input, seq));
+			int close_fd = (input_count == XTM_PIPELINE_OPEN ?
+					pipeline->close_read_fd : -1);
+			if ((pipeline_wait_fds(fd, close_fd) & 1) != 0)
+				xtm_queue_consume(fd);
+			pipeline_stat_add(&thread->stats.input_wait_nsec,
+					  clock_now_nsec() - start);
+			continue;
+		}
+		uint64_t start = clock_now_nsec();
+		unsigned handled = 0;
+		for (unsigned i = 0; i < count; i++) {
+			if (items[i] == NULL)
+				continue;
+			items[i] = stage->fun(stage->ctx, items[i]);
+			handled++;
+		}
+		pipeline_stat_add(&thread->stats.busy_nsec,
+				  clock_now_nsec() - start);
+		pipeline_stat_add(&thread->stats.items, handled);
+		for (unsigned i = 0; i < count; i++, seq += step)
+			pipeline_thread_push(thread, seq, items[i]);
+		pipeline_thread_flush(thread);
+	}
+	return NULL;
+}
+
+struct xtm_pipeline *
+xtm_pipeline_new(unsigned queue_size)
+{
+	if (queue_size <= 1 || (queue_size & (queue_size - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct xtm_pipeline *pipeline = (struct xtm_pipeline *)
+		calloc(1, sizeof(struct xtm_pipeline));
+	if (pipeline == NULL)
+		return NULL;
+	pipeline->queue_size = queue_size;
+	pipeline->input_count = XTM_PIPELINE_OPEN;
+	pipeline->close_read_fd = pipeline->close_write_fd = -1;
+	pipeline->output_read_fd = pipeline->output_write_fd = -1;
+	return pipeline;
+}
+
+int
+xtm_pipeline_add_stage(struct xtm_pipeline *pipeline, xtm_pipeline_fun_t fun,
+		       void *ctx, unsigned thread_count)
+{
+	if (thread_count == 0 || pipeline->links != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct xtm_pipeline_thread *threads = (struct xtm_pipeline_thread *)
+		calloc(thread_count, sizeof(struct xtm_pipeline_thread));
+	if (threads == NULL)
+		return -1;
+	struct xtm_pipeline_stage *stages = (struct xtm_pipeline_stage *)
+		realloc(pipeline->stages, (pipeline->stage_count + 1) *
+			sizeof(struct xtm_pipeline_stage));
+	if (stages == NULL) {
+		free(threads);
+		return -1;
+	}
+	pipeline->stages = stages;
+	struct xtm_pipeline_stage *stage = &stages[pipeline->stage_count];
+	memset(stage, 0, sizeof(*stage));
+	stage->fun = fun;
+	stage->ctx = ctx;
+	stage->thread_count = thread_count;
+	stage->threads = threads;
+	return pipeline->stage_count++;
+}
+
+/**
+ * Create queues of all links, owner is the producer of the first
+ * link and the consumer of the last one.
+ */
+static int
+pipeline_create_links(struct xtm_pipeline *pipeline)
+{
+	unsigned link_count = pipeline->stage_count + 1;
+	pipeline->links = (struct xtm_pipeline_link *)
+		calloc(link_count, sizeof(struct xtm_pipeline_link));
+	if (pipeline->links == NULL)
+		return -1;
+	for (unsigned i = 0; i < link_count; i++) {
+		struct xtm_pipeline_link *link = &pipeline->links[i];
+		link->producer_count = (i == 0 ? 1 :
+					pipeline->stages[i - 1].thread_count);
+		link->consumer_count = (i == pipeline->stage_count ? 1 :
+					pipeline->stages[i].thread_count);
+		unsigned count = link->producer_count * link->consumer_count;
+		link->queues = (struct xtm_queue **)
+			calloc(count, sizeof(struct xtm_queue *));
+		if (link->queues == NULL)
+			return -1;
+		for (unsigned j = 0; j < count; j++) {
+			/* Only fds, which are waited on, are created. */
+			link->queues[j] = xtm_queue_new_ex(pipeline->queue_size,
+							   XTM_QUEUE_LAZY_FDS);
+			if (link->queues[j] == NULL)
+				return -1;
+		}
+	}
+	for (unsigned i = 0; i < pipeline->stage_count; i++) {
+		struct xtm_pipeline_stage *stage = &pipeline->stages[i];
+		stage->pipeline = pipeline;
+		stage->input = &pipeline->links[i];
+		stage->output = &pipeline->links[i + 1];
+		stage->is_last = (i == pipeline->stage_count - 1);
+	}
+	return 0;
+}
+
+/**
+ * Close the pipeline input, wait until stage threads handle all
+ * pushed items, discarding the ones, which reach the owner, and
+ * join them.
+ */
+static int
+pipeline_stop(struct xtm_pipeline *pipeline)
+{
+	int rc = 0;
+	__atomic_store_n(&pipeline->input_count, pipeline->push_seq,
+			 __ATOMIC_RELEASE);
+	if (xtm_flush_notifications() != 0 ||
+	    notify_fd(pipeline->close_write_fd) != 0)
+		rc = -1;
+	if (pipeline->started_count < pipeline->stage_count) {
+		/* Pipeline is not fully started, nothing can be pushed. */
+		assert(pipeline->push_seq == 0);
+	} else {
+		void *items[XTM_PIPELINE_BATCH];
+		while (pipeline->pop_seq < pipeline->push_seq) {
+			if (xtm_pipeline_pop(pipeline, items,
+					     XTM_PIPELINE_BATCH) > 0)
+				continue;
+			int fd = pipeline->output_read_fd;
+			if (pipeline_wait_fds(fd, -1) != 0)
+				xtm_queue_consume(fd);
+		}
+	}
+	for (unsigned i = 0; i < pipeline->started_count; i++) {
+		struct xtm_pipeline_stage *stage = &pipeline->stages[i];
+		for (unsigned j = 0; j < stage->thread_count; j++) {
+			int err = pthread_join(stage->threads[j].thread, NULL);
+			if (err != 0) {
+				errno = err;
+				rc = -1;
+			}
+		}
+	}
+	return rc;
+}
+
+static int
+pipeline_destroy(struct xtm_pipeline *pipeline)
+{
+	int rc = 0;
+	if (pipeline->close_write_fd >= 0 && pipeline_stop(pipeline) != 0)
+		rc = -1;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; pipeline->links != NULL &&
+	     i <= pipeline->stage_count; i++) {
+		struct xtm_pipeline_link *link = &pipeline->links[i];
+		unsigned count = link->producer_count * link->consumer_count;
+		for (unsigned j = 0; link->queues != NULL && j < count; j++) {
+			if (link->queues[j] != NULL &&
+			    xtm_queue_delete(link->queues[j], flags) != 0)
+				rc = -1;
+		}
+		free(link->queues);
+	}
+	free(pipeline->links);
+	for (unsigned i = 0; i < pipeline->stage_count; i++)
+		free(pipeline->stages[i].threads);
+	free(pipeline->stages);
+	if (pipeline_close_fds(pipeline->close_read_fd,
+			       pipeline->close_write_fd) != 0 ||
+	    pipeline_close_fds(pipeline->output_read_fd,
+			       pipeline->output_write_fd) != 0)
+		rc = -1;
+	free(pipeline);
+	return rc;
+}
+
+int
+xtm_pipeline_start(struct xtm_pipeline *pipeline)
+{
+	if (pipeline->stage_count == 0 || pipeline->links != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (pipeline_create_links(pipeline) != 0 ||
+	    create_fds(&pipeline->output_read_fd,
+		       &pipeline->output_write_fd) != 0 ||
+	    create_fds(&pipeline->close_read_fd,
+		       &pipeline->close_write_fd) != 0)
+		return -1;
+	for (unsigned i = 0; i < pipeline->stage_count; i++) {
+		struct xtm_pipeline_stage *stage = &pipeline->stages[i];
+		for (unsigned j = 0; j < stage->thread_count; j++) {
+			struct xtm_pipeline_thread *thread = &stage->threads[j];
+			thread->stage = stage;
+			thread->index = j;
+			int err = pthread_create(&thread->thread, NULL,
+						 pipeline_thread_f, thread);
+			if (err != 0) {
+				/*
+				 * Threads of complete stages are stopped on
+				 * delete, stop the rest at once.
+				 */
+				__atomic_store_n(&pipeline->input_count, 0,
+						 __ATOMIC_RELEASE);
+				notify_fd(pipeline->close_write_fd);
+				for (unsigned k = 0; k < j; k++)
+					pthread_join(stage->threads[k].thread,
+						     NULL);
+				errno = err;
+				return -1;
+			}
+		}
+		pipeline->started_count++;
+	}
+	return 0;
+}
+
+int
+xtm_pipeline_push(struct xtm_pipeline *pipeline, void *item)
+{
+	assert(pipeline->started_count == pipeline->stage_count);
+	assert(item != NULL);
+	struct xtm_queue *queue = pipeline_link_queue(&pipeline->links[0],
+						      pipeline->push_seq);
+	if (xtm_queue_push_ptr(queue, item, XTM_QUEUE_DEFERRED_NOTIFY) != 0)
+		return -1;
+	pipeline->push_seq++;
+	return 0;
+}
+
+unsigned
+xtm_pipeline_pop(struct xtm_pipeline *pipeline, void **items, unsigned count)
+{
+	struct xtm_pipeline_link *link = &pipeline->links[pipeline->stage_count];
+	unsigned popped = 0;
+	void *item;
+	while (popped < count &&
+	       pipeline_link_pop(link, pipeline->pop_seq, &item)) {
+		pipeline->pop_seq++;
+		if (item != NULL)
+			items[popped++] = item;
+	}
+	return popped;
+}
+
+int
+xtm_pipeline_output_fd(struct xtm_pipeline *pipeline)
+{
+	return pipeline->output_read_fd;
+}
+
+int
+xtm_pipeline_stage_stats(struct xtm_pipeline *pipeline, unsigned stage,
+			 struct xtm_pipeline_stage_stats *stats)
+{
+	if (stage >= pipeline->stage_count) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	struct xtm_pipeline_stage *s = &pipeline->stages[stage];
+	for (unsigned i = 0; i < s->thread_count; i++) {
+		struct xtm_pipeline_stage_stats *thread_stats =
+			&s->threads[i].stats;
+		stats->items += __atomic_load_n(&thread_stats->items,
+						__ATOMIC_RELAXED);
+		stats->busy_nsec += __atomic_load_n(&thread_stats->busy_nsec,
+						    __ATOMIC_RELAXED);
+		stats->input_wait_nsec +=
+			__atomic_load_n(&thread_stats->input_wait_nsec,
+					__ATOMIC_RELAXED);
+		stats->output_wait_nsec +=
+			__atomic_load_n(&thread_stats->output_wait_nsec,
+					__ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+int
+xtm_pipeline_delete(struct xtm_pipeline *pipeline)
+{
+	return pipeline_destroy(pipeline);
+}
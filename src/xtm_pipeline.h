@@ -0,0 +1,171 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_api.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Pipeline of stages, connected with xtm queues. Items are pushed to
+ * the pipeline by its owner thread, pass through all stages in order,
+ * and are popped by the owner thread in the order they were pushed.
+ * Stage may run on several threads: k-th item of the pipeline is
+ * handled by thread k % N of a stage with N threads, so the next stage
+ * (or the owner) restores item order by reading queues of threads of
+ * the previous stage round-robin, with no per-item sequence numbers
+ * and with reorder window as large as the queues between stages.
+ * Stage threads pass items in batches, notifying each downstream
+ * queue once per batch.
+ */
+struct xtm_pipeline;
+
+/**
+ * Stage function, called by stage thread for each item.
+ * @param[in] ctx  - stage context, passed to xtm_pipeline_add_stage.
+ * @param[in] item - item, returned by the previous stage, or pushed
+ *                   to the pipeline, never NULL.
+ * @retval    item to pass to the next stage, or NULL to drop the item.
+ */
+typedef void *(*xtm_pipeline_fun_t)(void *ctx, void *item);
+
+/**
+ * Throughput counters of a pipeline stage, summed over its threads.
+ */
+struct xtm_pipeline_stage_stats {
+	/** Count of items, which stage function was called for. */
+	uint64_t items;
+	/** Time spent in stage function, in nanoseconds. */
+	uint64_t busy_nsec;
+	/** Time spent waiting for items from the previous stage. */
+	uint64_t input_wait_nsec;
+	/** Time spent waiting for space in queues to the next stage. */
+	uint64_t output_wait_nsec;
+};
+
+/**
+ * Create pipeline without stages.
+ * @param[in] queue_size - size of each queue between stages, must be
+ *                         power of two and greater than one.
+ * @retval    pointer to new xtm_pipeline or NULL in case of error.
+ */
+struct xtm_pipeline *
+xtm_pipeline_new(unsigned queue_size);
+
+/**
+ * Append stage to the pipeline, which is not started yet.
+ * @param[in] pipeline     - xtm_pipeline to add stage to.
+ * @param[in] fun          - stage function.
+ * @param[in] ctx          - stage function context.
+ * @param[in] thread_count - count of stage threads, must be positive.
+ * @retval    index of the stage. Otherwise -1 with errno set to EINVAL,
+ *            if pipeline is started or thread count is zero, or to
+ *            ENOMEM.
+ */
+int
+xtm_pipeline_add_stage(struct xtm_pipeline *pipeline, xtm_pipeline_fun_t fun,
+		       void *ctx, unsigned thread_count);
+
+/**
+ * Create queues between stages and start stage threads. The calling
+ * thread becomes the owner of the pipeline.
+ * @param[in] pipeline - xtm_pipeline to start.
+ * @retval    0 on success. Otherwise -1 with errno set to EINVAL, if
+ *            pipeline has no stages or is already started, or
+ *            appropriately (as in pthread_create(3) or eventfd(2)),
+ *            pipeline can only be deleted then.
+ */
+int
+xtm_pipeline_start(struct xtm_pipeline *pipeline);
+
+/**
+ * Push item to the first stage. Queue is marked as dirty (see
+ * XTM_QUEUE_DEFERRED_NOTIFY), so owner should call
+ * xtm_flush_notifications after pushing a batch of items.
+ * Must be called from owner thread.
+ * @param[in] pipeline - started xtm_pipeline.
+ * @param[in] item     - item to push, must not be NULL.
+ * @retval    0 on success. Otherwise -1 with errno set to ENOBUFS,
+ *            if queue for this item is full.
+ */
+int
+xtm_pipeline_push(struct xtm_pipeline *pipeline, void *item);
+
+/**
+ * Pop items, returned by the last stage, in the order they were
+ * pushed. Dropped items are skipped. Must be called from owner thread.
+ * @param[in]  pipeline - started xtm_pipeline.
+ * @param[out] items    - array to fill with items.
+ * @param[in]  count    - maximum count of items to pop.
+ * @retval     count of popped items.
+ */
+unsigned
+xtm_pipeline_pop(struct xtm_pipeline *pipeline, void **items,
+		 unsigned count);
+
+/**
+ * Returns file descriptor, that should be watched by owner thread to
+ * become readable, when the last stage returns items. Owner should
+ * consume it with xtm_queue_consume before popping items.
+ * @param[in] pipeline - started xtm_pipeline.
+ * @retval    pipeline output file descriptor.
+ */
+int
+xtm_pipeline_output_fd(struct xtm_pipeline *pipeline);
+
+/**
+ * Get throughput counters of the stage. The stage with the largest
+ * busy time per thread is the bottleneck, stages before it wait for
+ * output, stages after it wait for input.
+ * @param[in]  pipeline - xtm_pipeline to get counters.
+ * @param[in]  stage    - index of the stage.
+ * @param[out] stats    - counters to fill.
+ * @retval     0 on success. Otherwise -1 with errno set to EINVAL, if
+ *             there is no such stage.
+ */
+int
+xtm_pipeline_stage_stats(struct xtm_pipeline *pipeline, unsigned stage,
+			 struct xtm_pipeline_stage_stats *stats);
+
+/**
+ * Shut the pipeline down: stage threads process all pushed items and
+ * exit, items, which owner hasn't popped, are discarded. Then pipeline
+ * is freed. Must be called from owner thread.
+ * @param[in] pipeline - xtm_pipeline to delete.
+ * @retval    0 on success. Otherwise -1 with errno set appropriately.
+ */
+int
+xtm_pipeline_delete(struct xtm_pipeline *pipeline);
+
+#if defined(__cplusplus)
+}
+#endif /* defined(__cplusplus) */
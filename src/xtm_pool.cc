@@ -0,0 +1,588 @@
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_pool.h"
+#include "xtm_config.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+#include <poll.h>
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+
+/**
+ * Count of rounds, which idle worker spends trying to find work in
+ * its ingress queue and in deques of its peers before parking.
+ */
+#define XTM_POOL_SPIN_COUNT 16
+#ifndef TARANTOOL_XTM_HAVE_FUTEX
+/**
+ * Without futex workers can't wake each other, so parked worker
+ * looks for tasks to steal with this period.
+ */
+#define XTM_POOL_PARK_TIMEOUT_MSEC 1
+#endif /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+
+/**
+ * Task of the pool, as it is stored in worker deque. Thieves may
+ * read a slot, which is being overwritten by the owner, so fields
+ * are accessed atomically, and torn values are discarded, since
+ * thief fails to claim the slot in this case.
+ */
+struct xtm_pool_task {
+	xtm_queue_fun_t fun;
+	void *arg;
+};
+
+/**
+ * Fixed-size Chase-Lev work-stealing deque. Owner pushes and takes
+ * tasks at the bottom, thieves steal them from the top. Memory
+ * ordering follows "Correct and Efficient Work-Stealing for Weak
+ * Memory Models" by Le, Pop, Cohen and Zappa Nardelli.
+ */
+struct xtm_pool_deque {
+	/** Index of the oldest task, advanced by thieves and owner. */
+	alignas(64) int64_t top;
+	/** Index past the newest task, modified only by owner. */
+	alignas(64) int64_t bottom;
+	/** Ring of tasks. */
+	struct xtm_pool_task *tasks;
+	/** Ring size minus one, ring size is power of two. */
+	int64_t mask;
+};
+
+struct alignas(64) xtm_pool_worker {
+	/** Deque of tasks, moved from ingress queue. */
+	struct xtm_pool_deque deque;
+	/** Queue from submitter thread to this worker. */
+	struct xtm_queue *ingress;
+	/** Pool, which owns this worker. */
+	struct xtm_pool *pool;
+	/** Index of this worker in pool workers array. */
+	unsigned index;
+	/** State of pseudo-random generator, used to choose victim. */
+	uint32_t rand_state;
+	/** Count of tasks, which this worker stole from its peers. */
+	unsigned long long steal_count;
+	/** Worker thread. */
+	pthread_t thread;
+	/**
+	 * Flag, which submitter thread sets, when it pushes task to
+	 * ingress queue, and clears on flush.
+	 */
+	bool has_pending;
+	/** Futex word, incremented each time the worker is woken. */
+	alignas(64) uint32_t wake_seq;
+	/** Flag, which worker sets before it parks. */
+	int is_parked;
+};
+
+struct xtm_pool {
+	/** Array of workers. */
+	struct xtm_pool_worker *workers;
+	/** Count of workers. */
+	unsigned worker_count;
+	/** Index of worker, which gets next submitted task. */
+	unsigned next_worker;
+	/** Count of parked workers. */
+	int parked_count;
+	/** Flag, which is set when pool is being deleted. */
+	bool is_stopping;
+};
+
+static int
+xtm_pool_deque_create(struct xtm_pool_deque *deque, unsigned size)
+{
+	deque->tasks = (struct xtm_pool_task *)
+		calloc(size, sizeof(struct xtm_pool_task));
+	if (deque->tasks == NULL)
+		return -1;
+	deque->top = 0;
+	deque->bottom = 0;
+	deque->mask = size - 1;
+	return 0;
+}
+
+static void
+xtm_pool_deque_destroy(struct xtm_pool_deque *deque)
+{
+	free(deque->tasks);
+}
+
+/**
+ * Count of tasks in the deque. Exact, when called by owner,
+ * otherwise it's a snapshot.
+ */
+static inline int64_t
+xtm_pool_deque_count(struct xtm_pool_deque *deque)
+{
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	return (b > t ? b - t : 0);
+}
+
+static inline void
+xtm_pool_task_store(struct xtm_pool_task *slot, const struct xtm_queue_msg *msg)
+{
+	__atomic_store_n(&slot->fun, msg->fun, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->arg, msg->arg, __ATOMIC_RELAXED);
+}
+
+static inline void
+xtm_pool_task_load(struct xtm_pool_task *slot, struct xtm_pool_task *task)
+{
+	task->fun = __atomic_load_n(&slot->fun, __ATOMIC_RELAXED);
+	task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+}
+
+/**
+ * Pushes up to count messages to the bottom of the deque,
+ * called by owner only.
+ * @retval count of pushed messages.
+ */
+static unsigned
+xtm_pool_deque_push(struct xtm_pool_deque *deque,
+		    const struct xtm_queue_msg *msgs, unsigned count)
+{
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	int64_t free_count = deque->mask + 1 - (b - t);
+	if ((int64_t)count > free_count)
+		count = free_count;
+	for (unsigned i = 0; i < count; i++)
+		xtm_pool_task_store(&deque->tasks[(b + i) & deque->mask],
+				    &msgs[i]);
+	/* Tasks must be visible before thieves see new bottom. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&deque->bottom, b + count, __ATOMIC_RELAXED);
+	return count;
+}
+
+/**
+ * Takes the newest task from the bottom of the deque,
+ * called by owner only.
+ * @retval true if task was taken, false if deque is empty.
+ */
+static bool
+xtm_pool_deque_take(struct xtm_pool_deque *deque, struct xtm_pool_task *task)
+{
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	xtm_pool_task_load(&deque->tasks[b & deque->mask], task);
+	if (t < b)
+		return true;
+	/* Last task, race against thieves for it. */
+	bool taken = __atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+						 __ATOMIC_SEQ_CST,
+						 __ATOMIC_RELAXED);
+	__atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+	return taken;
+}
+
+/**
+ * Steals the oldest task from the top of the deque,
+ * called by thieves.
+ * @retval true if task was stolen, false if deque is empty or
+ *         other thread has claimed the task first.
+ */
+static bool
+xtm_pool_deque_steal(struct xtm_pool_deque *deque, struct xtm_pool_task *task)
+{
+	int64_t t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b)
+		return false;
+	xtm_pool_task_load(&deque->tasks[t & deque->mask], task);
+	return __atomic_compare_exchange_n(&deque->top, &t, t + 1, false,
+					   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+static void
+xtm_pool_futex_wait(uint32_t *addr, uint32_t value)
+{
+	/* Spurious wakeups are fine, caller rechecks for work. */
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void
+xtm_pool_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+
+/**
+ * Wakes worker, if it is parked or going to park.
+ * @retval true if worker was parked.
+ */
+static bool
+xtm_pool_worker_wake(struct xtm_pool_worker *worker)
+{
+	if (__atomic_exchange_n(&worker->is_parked, 0, __ATOMIC_SEQ_CST) == 0)
+		return false;
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+	__atomic_add_fetch(&worker->wake_seq, 1, __ATOMIC_RELEASE);
+	xtm_pool_futex_wake(&worker->wake_seq);
+#else /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	xtm_queue_notify_consumer(worker->ingress);
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	return true;
+}
+
+/**
+ * Wakes one parked peer to steal tasks, which are left in deque of
+ * the worker. Without futex parked workers poll deques of their
+ * peers periodically instead.
+ */
+static void
+xtm_pool_wake_peer(struct xtm_pool_worker *worker)
+{
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+	struct xtm_pool *pool = worker->pool;
+	if (__atomic_load_n(&pool->parked_count, __ATOMIC_RELAXED) == 0)
+		return;
+	for (unsigned i = 1; i < pool->worker_count; i++) {
+		unsigned index = (worker->index + i) % pool->worker_count;
+		if (xtm_pool_worker_wake(&pool->workers[index]))
+			return;
+	}
+#else /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	(void)worker;
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+}
+
+/**
+ * Moves tasks from ingress queue of the worker to its deque,
+ * where peers can steal them.
+ * @retval count of moved tasks.
+ */
+static unsigned
+xtm_pool_worker_refill(struct xtm_pool_worker *worker)
+{
+	struct xtm_queue_span spans[2];
+	if (xtm_queue_peek(worker->ingress, spans) == 0)
+		return 0;
+	unsigned moved = 0;
+	for (unsigned i = 0; i < 2 && spans[i].count > 0; i++) {
+		unsigned rc = xtm_pool_deque_push(&worker->deque,
+						  spans[i].msgs,
+						  spans[i].count);
+		moved += rc;
+		if (rc < spans[i].count)
+			break;
+	}
+	xtm_queue_release(worker->ingress, moved);
+	return moved;
+}
+
+static inline uint32_t
+xtm_pool_worker_rand(struct xtm_pool_worker *worker)
+{
+	uint32_t x = worker->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	worker->rand_state = x;
+	return x;
+}
+
+/**
+ * Steals a task from deque of one of the peers, starting from the
+ * random one, so that thieves don't crowd on the same victim.
+ * @retval true if task was stolen.
+ */
+static bool
+xtm_pool_worker_steal(struct xtm_pool_worker *worker,
+		      struct xtm_pool_task *task)
+{
+	struct xtm_pool *pool = worker->pool;
+	unsigned start = xtm_pool_worker_rand(worker) % pool->worker_count;
+	for (unsigned i = 0; i < pool->worker_count; i++) {
+		struct xtm_pool_worker *victim =
+			&pool->workers[(start + i) % pool->worker_count];
+		if (victim == worker ||
+		    !xtm_pool_deque_steal(&victim->deque, task))
+			continue;
+		__atomic_store_n(&worker->steal_count, worker->steal_count + 1,
+				 __ATOMIC_RELAXED);
+		/* Let one more peer help, if victim still has tasks. */
+		if (xtm_pool_deque_count(&victim->deque) > 0)
+			xtm_pool_wake_peer(worker);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Finds the next task for the worker: takes it from own deque,
+ * refilling it from ingress queue if needed, or steals from peers.
+ * @retval true if task was found.
+ */
+static bool
+xtm_pool_worker_find_task(struct xtm_pool_worker *worker,
+			  struct xtm_pool_task *task)
+{
+	if (xtm_pool_deque_take(&worker->deque, task))
+		return true;
+	unsigned moved = xtm_pool_worker_refill(worker);
+	if (moved > 1)
+		xtm_pool_wake_peer(worker);
+	if (moved > 0 && xtm_pool_deque_take(&worker->deque, task))
+		return true;
+	return xtm_pool_worker_steal(worker, task);
+}
+
+/**
+ * Checks whether there is some work for the worker: either in its
+ * ingress queue or in deque of any worker.
+ */
+static bool
+xtm_pool_worker_has_work(struct xtm_pool_worker *worker)
+{
+	struct xtm_pool *pool = worker->pool;
+	if (xtm_queue_count(worker->ingress) > 0)
+		return true;
+	for (unsigned i = 0; i < pool->worker_count; i++) {
+		if (xtm_pool_deque_count(&pool->workers[i].deque) > 0)
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Parks the worker until it is woken. Worker announces, that it is
+ * parked, before the last check for work, and waker checks that
+ * flag after it publishes work, so wakeup can't be lost.
+ * @retval true if pool is stopping and there is no work left.
+ */
+static bool
+xtm_pool_worker_park(struct xtm_pool_worker *worker)
+{
+	struct xtm_pool *pool = worker->pool;
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+	uint32_t seq = __atomic_load_n(&worker->wake_seq, __ATOMIC_ACQUIRE);
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	__atomic_store_n(&worker->is_parked, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&pool->parked_count, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bool is_stopping = __atomic_load_n(&pool->is_stopping,
+					   __ATOMIC_ACQUIRE);
+	bool has_work = xtm_pool_worker_has_work(worker);
+	if (!has_work && !is_stopping) {
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+		xtm_pool_futex_wait(&worker->wake_seq, seq);
+#else /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+		int fd = xtm_queue_consumer_fd(worker->ingress);
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, XTM_POOL_PARK_TIMEOUT_MSEC) > 0)
+			xtm_queue_consume(fd);
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	}
+	__atomic_store_n(&worker->is_parked, 0, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pool->parked_count, 1, __ATOMIC_RELAXED);
+	return !has_work && is_stopping;
+}
+
+static void *
+xtm_pool_worker_f(void *arg)
+{
+	struct xtm_pool_worker *worker = (struct xtm_pool_worker *)arg;
+	struct xtm_pool_task task;
+	for (;;) {
+		bool found = false;
+		for (unsigned i = 0; i < XTM_POOL_SPIN_COUNT && !found; i++)
+			found = xtm_pool_worker_find_task(worker, &task);
+		if (found)
+			task.fun(task.arg);
+		else if (xtm_pool_worker_park(worker))
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * Stops and joins first count workers, and frees all resources of
+ * the pool.
+ */
+static int
+xtm_pool_destroy(struct xtm_pool *pool, unsigned count)
+{
+	int rc = 0;
+	__atomic_store_n(&pool->is_stopping, true, __ATOMIC_RELEASE);
+	for (unsigned i = 0; i < count; i++) {
+		struct xtm_pool_worker *worker = &pool->workers[i];
+		/* Wake the worker, even if it hasn't reported parking yet. */
+		__atomic_store_n(&worker->is_parked, 1, __ATOMIC_SEQ_CST);
+		xtm_pool_worker_wake(worker);
+	}
+	for (unsigned i = 0; i < count; i++) {
+		int err = pthread_join(pool->workers[i].thread, NULL);
+		if (err != 0) {
+			errno = err;
+			rc = -1;
+		}
+	}
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < pool->worker_count; i++) {
+		struct xtm_pool_worker *worker = &pool->workers[i];
+		if (worker->ingress != NULL &&
+		    xtm_queue_delete(worker->ingress, flags) != 0)
+			rc = -1;
+		xtm_pool_deque_destroy(&worker->deque);
+	}
+	free(pool->workers);
+	free(pool);
+	return rc;
+}
+
+struct xtm_pool *
+xtm_pool_new(unsigned worker_count, unsigned queue_size)
+{
+	if (worker_count == 0 || queue_size <= 1 ||
+	    (queue_size & (queue_size - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct xtm_pool *pool = (struct xtm_pool *)
+		calloc(1, sizeof(struct xtm_pool));
+	if (pool == NULL)
+		return NULL;
+	void *workers;
+	size_t workers_size = worker_count * sizeof(struct xtm_pool_worker);
+	if (posix_memalign(&workers, alignof(struct xtm_pool_worker),
+			   workers_size) != 0) {
+		free(pool);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(workers, 0, workers_size);
+	pool->workers = (struct xtm_pool_worker *)workers;
+	pool->worker_count = worker_count;
+#ifdef TARANTOOL_XTM_HAVE_FUTEX
+	unsigned flags = XTM_QUEUE_POLLED;
+#else /* !defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	unsigned flags = 0;
+#endif /* defined(TARANTOOL_XTM_HAVE_FUTEX) */
+	for (unsigned i = 0; i < worker_count; i++) {
+		struct xtm_pool_worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		worker->rand_state = 2654435761u * (i + 1);
+		if (xtm_pool_deque_create(&worker->deque, queue_size) != 0 ||
+		    (worker->ingress = xtm_queue_new_ex(queue_size,
+							flags)) == NULL) {
+			int save_errno = errno;
+			xtm_pool_destroy(pool, 0);
+			errno = save_errno;
+			return NULL;
+		}
+	}
+	for (unsigned i = 0; i < worker_count; i++) {
+		struct xtm_pool_worker *worker = &pool->workers[i];
+		int err = pthread_create(&worker->thread, NULL,
+					 xtm_pool_worker_f, worker);
+		if (err != 0) {
+			xtm_pool_destroy(pool, i);
+			errno = err;
+			return NULL;
+		}
+	}
+	return pool;
+}
+
+int
+xtm_pool_delete(struct xtm_pool *pool)
+{
+	return xtm_pool_destroy(pool, pool->worker_count);
+}
+
+int
+xtm_pool_submit(struct xtm_pool *pool, xtm_queue_fun_t fun, void *arg)
+{
+	assert(!pool->is_stopping);
+	for (unsigned i = 0; i < pool->worker_count; i++) {
+		struct xtm_pool_worker *worker =
+			&pool->workers[pool->next_worker];
+		if (++pool->next_worker == pool->worker_count)
+			pool->next_worker = 0;
+		if (xtm_queue_push_fun(worker->ingress, fun, arg, 0) == 0) {
+			worker->has_pending = true;
+			return 0;
+		}
+	}
+	errno = ENOBUFS;
+	return -1;
+}
+
+unsigned
+xtm_pool_flush(struct xtm_pool *pool)
+{
+	unsigned woken = 0;
+	/* Order pushes before checks of parked flags, see park. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (unsigned i = 0; i < pool->worker_count; i++) {
+		struct xtm_pool_worker *worker = &pool->workers[i];
+		if (!worker->has_pending)
+			continue;
+		worker->has_pending = false;
+		if (xtm_pool_worker_wake(worker))
+			woken++;
+	}
+	return woken;
+}
+
+unsigned long long
+xtm_pool_steal_count(struct xtm_pool *pool)
+{
+	unsigned long long count = 0;
+	for (unsigned i = 0; i < pool->worker_count; i++)
+		count += __atomic_load_n(&pool->workers[i].steal_count,
+					 __ATOMIC_RELAXED);
+	return count;
+}
@@ -0,0 +1,105 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_api.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/**
+ * Work-stealing pool of worker threads built on xtm queues.
+ * Each worker owns an ingress xtm queue, fed by a single submitter
+ * thread (usually the event loop), and a local deque, which worker
+ * refills from its ingress queue. Worker takes tasks from its own
+ * deque and, when it is empty, steals from deques of its peers, so
+ * a long task doesn't hold up tasks queued behind it. Idle workers
+ * park on a futex (or on consumer fd of their ingress queue, if
+ * futex is not available) and are woken by xtm_pool_flush.
+ */
+struct xtm_pool;
+
+/**
+ * Create pool and start its worker threads.
+ * @param[in] worker_count - count of worker threads, must be positive.
+ * @param[in] queue_size   - size of ingress queue and deque of each
+ *                           worker, must be power of two and greater
+ *                           than one.
+ * @retval    pointer to new xtm_pool or NULL in case of error.
+ */
+struct xtm_pool *
+xtm_pool_new(unsigned worker_count, unsigned queue_size);
+
+/**
+ * Wake workers, wait until all submitted tasks are executed, stop
+ * worker threads and free the pool. Must be called by submitter thread.
+ * @param[in] pool - xtm_pool to delete.
+ * @retval    0 on success, otherwise -1 with errno set appropriately.
+ */
+int
+xtm_pool_delete(struct xtm_pool *pool);
+
+/**
+ * Submit task to the pool. Tasks are spread over ingress queues of
+ * workers round-robin, skipping full queues. This function doesn't
+ * wake workers, so that event loop can submit a batch of tasks and
+ * then call xtm_pool_flush once. Pool has a single submitter thread,
+ * all submit and flush calls must be made by it.
+ * @param[in] pool - xtm_pool to submit task to.
+ * @param[in] fun  - task function.
+ * @param[in] arg  - task function argument.
+ * @retval    0 on success, otherwise -1 with errno set to ENOBUFS,
+ *            if ingress queues of all workers are full.
+ */
+int
+xtm_pool_submit(struct xtm_pool *pool, xtm_queue_fun_t fun, void *arg);
+
+/**
+ * Wake parked workers, which got tasks since the previous flush.
+ * Workers, which are busy, aren't disturbed, so flush costs no
+ * syscalls while the pool keeps up with the submitter.
+ * @param[in] pool - xtm_pool to flush.
+ * @retval    count of woken workers.
+ */
+unsigned
+xtm_pool_flush(struct xtm_pool *pool);
+
+/**
+ * Get count of tasks, which workers stole from their peers.
+ * @param[in] pool - xtm_pool to get statistics.
+ * @retval    count of stolen tasks.
+ */
+unsigned long long
+xtm_pool_steal_count(struct xtm_pool *pool);
+
+#if defined(__cplusplus)
+}
+#endif /* defined(__cplusplus) */
@@ -30,7 +30,15 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
+
+/** Size of cache line, assumed by prefetching. */
+#define XTM_CACHE_LINE_SIZE 64
+
 template <class T>
+struct xtm_scsp_queue;
+
+template <class T, class Q = xtm_scsp_queue<T>>
 struct xtm_scsp_queue_read_iterator;
 
 /**
@@ -59,6 +67,7 @@ struct xtm_scsp_queue {
 		write = 0;
 		read = 0;
 		len_minus_1 = size - 1;
+		staged = 0;
 		return 0;
 	}
 	/**
@@ -85,6 +94,79 @@ struct xtm_scsp_queue {
 		__atomic_store_n(&write, queue_write, __ATOMIC_RELEASE);
 		return i;
 	}
+	/**
+	 * Same as put, but doesn't make elements visible to consumer until
+	 * publish is called. Queue must be filled either with put or with
+	 * stage and publish only.
+	 * @param[in] data - array of elements to add
+	 * @param[in] num - count of elements to add
+	 * @retval number of elements actually written.
+	 */
+	unsigned
+	stage(T *data, unsigned num)
+	{
+		unsigned i;
+		unsigned queue_write = staged;
+		unsigned new_write = queue_write;
+		unsigned queue_read = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < num; i++) {
+			new_write = (new_write + 1) & len_minus_1;
+			if (new_write == queue_read)
+				break;
+			buffer[queue_write] = data[i];
+			queue_write = new_write;
+		}
+		staged = queue_write;
+		return i;
+	}
+	/**
+	 * Make elements, added with stage, visible to consumer.
+	 */
+	void
+	publish(void)
+	{
+		__atomic_store_n(&write, staged, __ATOMIC_RELEASE);
+	}
+	/**
+	 * Get elements available for reading without reading them.
+	 * Elements are returned as up to two contiguous spans of the
+	 * ring buffer, second span is not empty only if elements wrap
+	 * around the end of the buffer.
+	 * @param[out] first        - first span of elements.
+	 * @param[out] first_count  - count of elements in first span.
+	 * @param[out] second       - second span of elements.
+	 * @param[out] second_count - count of elements in second span.
+	 * @retval total count of elements in both spans.
+	 */
+	unsigned
+	peek(T **first, unsigned *first_count,
+	     T **second, unsigned *second_count)
+	{
+		unsigned queue_read = read;
+		unsigned queue_write = __atomic_load_n(&write, __ATOMIC_ACQUIRE);
+		*first = &buffer[queue_read];
+		*second = &buffer[0];
+		if (queue_write >= queue_read) {
+			*first_count = queue_write - queue_read;
+			*second_count = 0;
+		} else {
+			*first_count = len_minus_1 + 1 - queue_read;
+			*second_count = queue_write;
+		}
+		return *first_count + *second_count;
+	}
+	/**
+	 * Remove num elements, previously returned by peek, from queue.
+	 * @param[in] num - count of elements to remove, must not be greater
+	 *                  than count returned by peek.
+	 */
+	void
+	release(unsigned num)
+	{
+		__atomic_store_n(&read, (read + num) & len_minus_1,
+				 __ATOMIC_RELEASE);
+	}
 	/**
  	 * Get num of available elements in the queue
 	 * @retval num of available elements in the queue
@@ -107,29 +189,167 @@ struct xtm_scsp_queue {
 		unsigned queue_read = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
 		return (len_minus_1 + 1 + queue_write - queue_read) & len_minus_1;
 	}
+	/**
+	 * Get positions of the queue, may be called from any thread.
+	 * Positions are loaded separately, so they are only an estimate,
+	 * while producer and consumer are working.
+	 * @param[out] write_pos - position of the next element to write.
+	 * @param[out] read_pos  - position of the next element to read.
+	 */
+	void
+	positions(unsigned *write_pos, unsigned *read_pos)
+	{
+		*read_pos = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
+		*write_pos = __atomic_load_n(&write, __ATOMIC_ACQUIRE);
+	}
+	/**
+	 * Get position, at which the next element will be written.
+	 * Must be called by producer.
+	 */
+	unsigned
+	write_pos(void) const
+	{
+		return write;
+	}
+	/**
+	 * Get circular buffer of the queue, e.g. to release its memory.
+	 */
+	T *
+	data(void)
+	{
+		return buffer;
+	}
+	/**
+	 * Get size of circular buffer of the queue.
+	 */
+	unsigned
+	size(void) const
+	{
+		return len_minus_1 + 1;
+	}
 private:
+	/** Mask for calculation of position in circular buffer. */
+	unsigned
+	mask(void) const
+	{
+		return len_minus_1;
+	}
 	/** Next position to be written */
 	unsigned write;
 	/** Next position to be read */
 	unsigned read;
 	/** Circular buffer length */
 	unsigned len_minus_1;
+	/** Next position to be written by stage, accessed only by producer */
+	unsigned staged;
 	/** Buffer contains objects */
 	T buffer[];
 };
 
+/**
+ * Single consumer, single producer queue, same as xtm_scsp_queue,
+ * but with capacity known at compile time. Buffer is stored inline,
+ * so the queue can be embedded in other objects, and position mask
+ * is a constant. Queue holds up to N - 1 elements.
+ */
+template <class T, unsigned N>
+struct xtm_scsp_queue_fixed {
+	static_assert(N > 1 && (N & (N - 1)) == 0,
+		      "size of xtm_scsp_queue_fixed must be power of two");
+	friend struct xtm_scsp_queue_read_iterator<T, xtm_scsp_queue_fixed>;
+	/**
+	 * Init scsp queue struct.
+	 */
+	void
+	create(void)
+	{
+		write = 0;
+		read = 0;
+	}
+	/**
+	 * Add num elements into queue
+	 * @param[in] data - array of elements to add
+	 * @param[in] num - count of elements to add
+	 * @retval number of elements actually written.
+	 */
+	unsigned
+	put(const T *data, unsigned num)
+	{
+		unsigned queue_write = write;
+		unsigned queue_read = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
+		unsigned free_cnt = (queue_read - queue_write - 1) & mask();
+		/*
+		 * Branches are used instead of conditional moves, so that
+		 * write index doesn't depend on the load of read index.
+		 */
+		if (__builtin_expect(num > free_cnt, 0))
+			num = free_cnt;
+		if (__builtin_expect(queue_write + num <= N, 1)) {
+			for (unsigned i = 0; i < num; i++)
+				buffer[queue_write + i] = data[i];
+		} else {
+			/* Copy in two parts, split at the buffer end. */
+			unsigned tail_cnt = N - queue_write;
+			for (unsigned i = 0; i < tail_cnt; i++)
+				buffer[queue_write + i] = data[i];
+			for (unsigned i = tail_cnt; i < num; i++)
+				buffer[i - tail_cnt] = data[i];
+		}
+		__atomic_store_n(&write, (queue_write + num) & mask(),
+				 __ATOMIC_RELEASE);
+		return num;
+	}
+	/**
+	 * Get num of available elements in the queue
+	 * @retval num of available elements in the queue
+	 */
+	unsigned
+	free_count(void)
+	{
+		unsigned queue_write = __atomic_load_n(&write, __ATOMIC_ACQUIRE);
+		unsigned queue_read = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
+		return (queue_read - queue_write - 1) & mask();
+	}
+	/**
+	 * Get num of elements in the queue
+	 * @retval return num of elements in the queue
+	 */
+	unsigned
+	count(void)
+	{
+		unsigned queue_write = __atomic_load_n(&write, __ATOMIC_ACQUIRE);
+		unsigned queue_read = __atomic_load_n(&read, __ATOMIC_ACQUIRE);
+		return (queue_write - queue_read) & mask();
+	}
+private:
+	/** Mask for calculation of position in circular buffer. */
+	static constexpr unsigned
+	mask(void)
+	{
+		return N - 1;
+	}
+	/** Next position to be written */
+	unsigned write;
+	/** Next position to be read */
+	unsigned read;
+	/** Buffer contains objects */
+	T buffer[N];
+};
+
 /**
  * Read iterator for single consumer, single producer queue.
- * Template parameter must be same, as in queue to iterate.
+ * Template parameters must be same, as in queue to iterate: T is
+ * type of elements, Q is type of queue (xtm_scsp_queue<T> or
+ * xtm_scsp_queue_fixed<T, N>).
  */
-template <class T>
+template <class T, class Q>
 struct xtm_scsp_queue_read_iterator {
 	/**
 	 * Create new queue read iterator
 	 * @param[in] queue - queue to iterate
 	 */
 	void
-	begin(struct xtm_scsp_queue<T> *q)
+	begin(Q *q)
 	{
 		queue = q;
 		read_pos = queue->read;
@@ -144,11 +364,60 @@ struct xtm_scsp_queue_read_iterator {
 	{
 		if (read_pos != end_of_read) {
 			const T *rc = &queue->buffer[read_pos];
-			read_pos = (read_pos + 1) & queue->len_minus_1;
+			read_pos = (read_pos + 1) & queue->mask();
 			return rc;
 		}
 		return nullptr;
 	}
+	/**
+	 * Get element, which is n positions ahead of the next element
+	 * to read, without reading it.
+	 * @param[in] n - distance from the next element to read.
+	 * @retval element or nullptr if iterator hasn't seen it.
+	 */
+	const T*
+	peek(unsigned n) const
+	{
+		if (((end_of_read - read_pos) & queue->mask()) <= n)
+			return nullptr;
+		return &queue->buffer[(read_pos + n) & queue->mask()];
+	}
+	/**
+	 * Prefetch element, which is n positions ahead of the next
+	 * element to read, into the cache, if it is the first element
+	 * of its cache line, so that when elements are read one by one,
+	 * each cache line is prefetched once.
+	 * @param[in] n - distance from the next element to read.
+	 */
+	void
+	prefetch(unsigned n) const
+	{
+		if (((end_of_read - read_pos) & queue->mask()) <= n)
+			return;
+		const T *elem = &queue->buffer[(read_pos + n) & queue->mask()];
+		if ((uintptr_t)elem % XTM_CACHE_LINE_SIZE < sizeof(T))
+			__builtin_prefetch(elem);
+	}
+	/**
+	 * Check if all elements, seen by the iterator, have been read.
+	 * @retval true if next read returns nullptr.
+	 */
+	bool
+	is_end(void) const
+	{
+		return read_pos == end_of_read;
+	}
+	/**
+	 * Reload last position to be read, so that elements written
+	 * after begin become readable.
+	 * @retval true if there are elements to read.
+	 */
+	bool
+	update(void)
+	{
+		end_of_read = __atomic_load_n(&queue->write, __ATOMIC_ACQUIRE);
+		return read_pos != end_of_read;
+	}
 	/**
 	 * Store new read index to the queue.
 	 */
@@ -163,6 +432,6 @@ private:
 	/** Last position to be read. */
 	unsigned end_of_read;
 	/** Single consumer, single producer queue to iterate. */
-	struct xtm_scsp_queue<T> *queue;
+	Q *queue;
 };
 
@@ -0,0 +1,51 @@
+#pragma once
+/*
+ * Copyright 2010-2021, Tarantool AUTHORS, please see AUTHORS file.
+ *
+ * Redistribution and use in source and binary forms, with or
+ * without modification, are permitted provided that the following
+ * conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above
+ *    copyright notice, this list of conditions and the
+ *    following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY <COPYRIGHT HOLDER> ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL
+ * <COPYRIGHT HOLDER> OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "xtm_config.h"
+
+/*
+ * Statically defined tracepoints (USDT) of provider "xtm", which can
+ * be attached to by perf, bpftrace or SystemTap without rebuilding.
+ * Enabled probe site is a single nop, arguments are evaluated even
+ * if nobody is attached, so they must be cheap. Without
+ * TARANTOOL_XTM_ENABLE_USDT probes compile to nothing. Not a part
+ * of public API, see perf/xtm.bt for the list of probes.
+ */
+
+#ifdef TARANTOOL_XTM_ENABLE_USDT
+#include <sys/sdt.h>
+
+#define XTM_PROBE1(name, a1) DTRACE_PROBE1(xtm, name, a1)
+#define XTM_PROBE2(name, a1, a2) DTRACE_PROBE2(xtm, name, a1, a2)
+#else /* !defined(TARANTOOL_XTM_ENABLE_USDT) */
+#define XTM_PROBE1(name, a1) do { } while (0)
+#define XTM_PROBE2(name, a1, a2) do { } while (0)
+#endif /* defined(TARANTOOL_XTM_ENABLE_USDT) */
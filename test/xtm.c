@@ -1,9 +1,13 @@
 #include <xtm_api.h>
 
 #include <pthread.h>
+#include <stdint.h>
 #include <time.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
 #include <sys/time.h>
 #include <string.h>
@@ -22,6 +26,8 @@ struct xtm_test_settings {
 	unsigned xtm_queue_size;
 	/** Timeout between pushing to queue */
 	unsigned xtm_push_timeout;
+	/** Flags passed to xtm_queue_new_ex */
+	unsigned xtm_queue_flags;
 };
 
 /** Message sent by the producer thread to consumer thread. */
@@ -73,7 +79,9 @@ xtm_test_start(struct xtm_test_settings *settings)
 {
 	xtm_queue_size = settings->xtm_queue_size;
 	xtm_push_timeout = settings->xtm_push_timeout;
-	fail_unless((xtm_queue = xtm_queue_new(xtm_queue_size)) != NULL);
+	fail_unless((xtm_queue = xtm_queue_new_ex(xtm_queue_size,
+						  settings->xtm_queue_flags))
+		    != NULL);
 }
 
 static void
@@ -193,6 +201,165 @@ consumer_thread_push_and_invoke_fun(MAYBE_UNUSED void *arg)
 	return (void *)NULL;
 }
 
+static void
+consumer_ptr_f(void *ptr, void *ctx)
+{
+	unsigned *received = (unsigned *)ctx;
+	consumer_msg_f(ptr);
+	++*received;
+}
+
+static void *
+consumer_thread_drain_ptrs(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_consumer_fd(xtm_queue);
+	unsigned received = 0;
+
+	while (received < XTM_MSG_MAX) {
+		fail_unless(wait_for_fd(fd) > 0);
+		unsigned prev = received;
+		int rc = xtm_queue_drain(xtm_queue, consumer_ptr_f, &received);
+		fail_unless(rc >= 0 && (unsigned)rc == received - prev);
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	return (void *)NULL;
+}
+
+static void *
+consumer_thread_drain_funs(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_consumer_fd(xtm_queue);
+	unsigned invoked = 0;
+
+	while (invoked < XTM_MSG_MAX) {
+		fail_unless(wait_for_fd(fd) > 0);
+		int rc = xtm_queue_drain(xtm_queue, NULL, NULL);
+		fail_unless(rc >= 0);
+		invoked += rc;
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	return (void *)NULL;
+}
+
+static void *
+consumer_thread_peek_release(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_consumer_fd(xtm_queue);
+	unsigned received = 0;
+
+	while (received < XTM_MSG_MAX) {
+		fail_unless(wait_for_fd(fd) > 0);
+		fail_unless(xtm_queue_consume(fd) == 0);
+		struct xtm_queue_span spans[2];
+		unsigned rc;
+		/* Unbounded queue returns one segment at once. */
+		while ((rc = xtm_queue_peek(xtm_queue, spans)) != 0) {
+			fail_unless(rc == spans[0].count + spans[1].count);
+			fail_unless(rc < xtm_queue_size);
+			for (unsigned i = 0; i < 2; i++) {
+				for (unsigned j = 0; j < spans[i].count; j++) {
+					fail_unless(spans[i].msgs[j].fun == NULL);
+					consumer_msg_f(spans[i].msgs[j].arg);
+				}
+				/* Producer may reuse space of the first span. */
+				xtm_queue_release(xtm_queue, spans[i].count);
+			}
+			received += rc;
+		}
+		/* Try to notify producer again, if queue was full */
+		if (xtm_queue_get_reset_was_full(xtm_queue))
+			fail_unless(xtm_queue_notify_producer(xtm_queue) == 0);
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	return (void *)NULL;
+}
+
+/** Count of arguments handled by batch function. */
+static unsigned batch_args_count;
+
+static void
+consumer_batch_f(void **args, unsigned count)
+{
+	fail_unless(count > 0);
+	for (unsigned i = 0; i < count; i++)
+		consumer_msg_f(args[i]);
+	batch_args_count += count;
+}
+
+static void *
+consumer_thread_batch_funs(void *arg)
+{
+	batch_args_count = 0;
+	fail_unless(xtm_queue_set_batch_fun(xtm_queue, consumer_msg_f,
+					    consumer_batch_f) == 0);
+	consumer_thread_push_and_invoke_fun(arg);
+	fail_unless(batch_args_count == XTM_MSG_MAX);
+	return (void *)NULL;
+}
+
+static void *
+consumer_thread_drain_batch_funs(void *arg)
+{
+	batch_args_count = 0;
+	fail_unless(xtm_queue_set_batch_fun(xtm_queue, consumer_msg_f,
+					    consumer_batch_f) == 0);
+	consumer_thread_drain_funs(arg);
+	fail_unless(batch_args_count == XTM_MSG_MAX);
+	return (void *)NULL;
+}
+
+static void *
+consumer_thread_edge_triggered(MAYBE_UNUSED void *arg)
+{
+	int epfd = epoll_create1(0);
+	unsigned invoked = 0;
+
+	fail_unless(epfd >= 0);
+	fail_unless(xtm_queue_consumer_epoll_add(xtm_queue, epfd, NULL) == 0);
+	while (invoked < XTM_MSG_MAX) {
+		struct epoll_event ev;
+		int rc;
+		while ((rc = epoll_wait(epfd, &ev, 1, -1)) < 0 && errno == EINTR)
+			;
+		fail_unless(rc == 1);
+		/* Notifications are not consumed in edge-triggered mode. */
+		invoked += xtm_queue_invoke_funs_all(xtm_queue);
+		/* Try to notify producer again, if queue was full */
+		if (xtm_queue_get_reset_was_full(xtm_queue))
+			fail_unless(xtm_queue_notify_producer(xtm_queue) == 0);
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	fail_unless(close(epfd) == 0);
+	return (void *)NULL;
+}
+
+static void *
+consumer_thread_edge_triggered_ptrs(MAYBE_UNUSED void *arg)
+{
+	int epfd = epoll_create1(0);
+	unsigned received = 0;
+
+	fail_unless(epfd >= 0);
+	fail_unless(xtm_queue_consumer_epoll_add(xtm_queue, epfd, NULL) == 0);
+	while (received < XTM_MSG_MAX) {
+		struct epoll_event ev;
+		int rc;
+		while ((rc = epoll_wait(epfd, &ev, 1, -1)) < 0 && errno == EINTR)
+			;
+		fail_unless(rc == 1);
+		rc = xtm_queue_drain(xtm_queue, consumer_ptr_f, &received);
+		fail_unless(rc >= 0);
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	fail_unless(close(epfd) == 0);
+	return (void *)NULL;
+}
+
 static void *
 producer_thread_push_and_pop_ptr(MAYBE_UNUSED void *arg)
 {
@@ -215,6 +382,125 @@ producer_thread_push_and_invoke_fun(MAYBE_UNUSED void *arg)
 	return NULL;
 }
 
+static void *
+producer_thread_deferred_notify(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_producer_fd(xtm_queue);
+	unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS |
+			 XTM_QUEUE_DEFERRED_NOTIFY;
+	for (unsigned msgcnt = 0; msgcnt < XTM_MSG_MAX; msgcnt++) {
+		struct xtm_msg *msg =
+			(struct xtm_msg *)malloc(sizeof(struct xtm_msg));
+		fail_unless(msg != NULL);
+		msg->owner = pthread_self();
+		while (xtm_queue_push_ptr(xtm_queue, msg, flags) != 0) {
+			fail_unless(xtm_flush_notifications() == 0);
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+		/* Flush as at the end of event loop iteration. */
+		if (msgcnt % 3 == 2 || msgcnt == XTM_MSG_MAX - 1)
+			fail_unless(xtm_flush_notifications() == 0);
+		fail_unless(sleep_for_n_microseconds(xtm_push_timeout) == 0);
+	}
+	return NULL;
+}
+
+static void *
+producer_thread_unbounded(MAYBE_UNUSED void *arg)
+{
+	for (unsigned msgcnt = 0; msgcnt < XTM_MSG_MAX; msgcnt++) {
+		struct xtm_msg *msg =
+			(struct xtm_msg *)malloc(sizeof(struct xtm_msg));
+		fail_unless(msg != NULL);
+		msg->owner = pthread_self();
+		/* Unbounded queue is never full. */
+		fail_unless(xtm_queue_probe(xtm_queue) == 0);
+		fail_unless(xtm_queue_push_ptr(xtm_queue, msg, 0) == 0);
+		if (msgcnt % 3 == 2 || msgcnt == XTM_MSG_MAX - 1)
+			fail_unless(xtm_queue_notify_consumer(xtm_queue) == 0);
+		fail_unless(sleep_for_n_microseconds(xtm_push_timeout) == 0);
+	}
+	return NULL;
+}
+
+static void *
+producer_thread_polled(MAYBE_UNUSED void *arg)
+{
+	for (unsigned msgcnt = 0; msgcnt < XTM_MSG_MAX; msgcnt++) {
+		struct xtm_msg *msg =
+			(struct xtm_msg *)malloc(sizeof(struct xtm_msg));
+		fail_unless(msg != NULL);
+		msg->owner = pthread_self();
+		while (xtm_queue_push_ptr(xtm_queue, msg, 0) != 0)
+			fail_unless(sched_yield() == 0);
+		/* Notification of polled queue does nothing. */
+		fail_unless(xtm_queue_notify_consumer(xtm_queue) == 0);
+		fail_unless(sleep_for_n_microseconds(xtm_push_timeout) == 0);
+	}
+	return NULL;
+}
+
+static void *
+consumer_thread_polled(MAYBE_UNUSED void *arg)
+{
+	unsigned received = 0;
+
+	fail_unless(xtm_queue_consumer_fd(xtm_queue) < 0 && errno == EINVAL);
+	while (received < XTM_MSG_MAX) {
+		void *ptr_array[XTM_MSG_MAX];
+		unsigned rc = xtm_queue_pop_ptrs(xtm_queue, ptr_array,
+						 XTM_MSG_MAX);
+		for (unsigned i = 0; i < rc; i++)
+			consumer_msg_f(ptr_array[i]);
+		received += rc;
+		if (rc == 0)
+			fail_unless(sched_yield() == 0);
+	}
+
+	fail_unless(xtm_queue_count(xtm_queue) == 0);
+	return (void *)NULL;
+}
+
+/**
+ * Create queue, run producer and consumer threads,
+ * wait for them and delete queue.
+ */
+static void
+xtm_test_run(struct xtm_test_settings *settings,
+	     void *(*producer_f)(void *), void *(*consumer_f)(void *))
+{
+	xtm_test_start(settings);
+	fail_unless(pthread_create(&producer, NULL, producer_f, NULL) == 0);
+	fail_unless(pthread_create(&consumer, NULL, consumer_f, NULL) == 0);
+
+	start_test_timer();
+	fail_unless(pthread_join(producer, NULL) == 0);
+	fail_unless(pthread_join(consumer, NULL) == 0);
+	xtm_test_finish();
+}
+
+static void *
+producer_thread_auto_notify(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_producer_fd(xtm_queue);
+	unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+	fail_unless(xtm_queue_set_auto_notify(xtm_queue, 4, 100) == 0);
+	for (unsigned msgcnt = 0; msgcnt < XTM_MSG_MAX; msgcnt++) {
+		struct xtm_msg *msg =
+			(struct xtm_msg *)malloc(sizeof(struct xtm_msg));
+		fail_unless(msg != NULL);
+		msg->owner = pthread_self();
+		/* Consumer is notified by push itself. */
+		while (xtm_queue_push_ptr(xtm_queue, msg, flags) != 0) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+		fail_unless(sleep_for_n_microseconds(xtm_push_timeout) == 0);
+	}
+	return NULL;
+}
+
 static void
 xtm_push_and_invoke_fun_test(struct xtm_test_settings *settings)
 {
@@ -261,18 +547,953 @@ xtm_push_and_pop_ptr_test(struct xtm_test_settings *settings)
 	footer();
 }
 
+static void
+xtm_drain_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_drain_funs);
+	xtm_test_run(settings, producer_thread_push_and_pop_ptr,
+		     consumer_thread_drain_ptrs);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_peek_release_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	xtm_test_run(settings, producer_thread_push_and_pop_ptr,
+		     consumer_thread_peek_release);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_batch_fun_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_batch_funs);
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_drain_batch_funs);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_auto_notify_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_AUTO_NOTIFY;
+	xtm_test_run(settings, producer_thread_auto_notify,
+		     consumer_thread_drain_ptrs);
+	settings->xtm_queue_flags = XTM_QUEUE_AUTO_NOTIFY |
+				    XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_auto_notify,
+		     consumer_thread_edge_triggered_ptrs);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_edge_triggered_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_edge_triggered);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_deferred_notify_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	xtm_test_run(settings, producer_thread_deferred_notify,
+		     consumer_thread_push_and_pop_ptr);
+	settings->xtm_queue_flags = XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_deferred_notify,
+		     consumer_thread_edge_triggered_ptrs);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_unbounded_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_UNBOUNDED;
+	xtm_test_run(settings, producer_thread_unbounded,
+		     consumer_thread_push_and_pop_ptr);
+	xtm_test_run(settings, producer_thread_unbounded,
+		     consumer_thread_peek_release);
+	settings->xtm_queue_flags = XTM_QUEUE_UNBOUNDED |
+				    XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_unbounded,
+		     consumer_thread_edge_triggered_ptrs);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_lazy_fds_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_LAZY_FDS;
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_push_and_invoke_fun);
+	xtm_test_run(settings, producer_thread_push_and_pop_ptr,
+		     consumer_thread_drain_ptrs);
+	settings->xtm_queue_flags = XTM_QUEUE_POLLED;
+	xtm_test_run(settings, producer_thread_polled,
+		     consumer_thread_polled);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_ptr_only_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_PTR_ONLY;
+	xtm_test_run(settings, producer_thread_push_and_pop_ptr,
+		     consumer_thread_push_and_pop_ptr);
+	xtm_test_run(settings, producer_thread_push_and_pop_ptr,
+		     consumer_thread_drain_ptrs);
+	settings->xtm_queue_flags = XTM_QUEUE_PTR_ONLY | XTM_QUEUE_UNBOUNDED;
+	xtm_test_run(settings, producer_thread_unbounded,
+		     consumer_thread_push_and_pop_ptr);
+	settings->xtm_queue_flags = XTM_QUEUE_PTR_ONLY |
+				    XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_deferred_notify,
+		     consumer_thread_edge_triggered_ptrs);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_deferred_publish_test(struct xtm_test_settings *settings)
+{
+	header();
+	plan(0);
+
+	settings->xtm_queue_flags = XTM_QUEUE_DEFERRED_PUBLISH;
+	xtm_test_run(settings, producer_thread_deferred_notify,
+		     consumer_thread_push_and_pop_ptr);
+	xtm_test_run(settings, producer_thread_push_and_invoke_fun,
+		     consumer_thread_drain_funs);
+	settings->xtm_queue_flags = XTM_QUEUE_DEFERRED_PUBLISH |
+				    XTM_QUEUE_UNBOUNDED;
+	xtm_test_run(settings, producer_thread_unbounded,
+		     consumer_thread_push_and_pop_ptr);
+	settings->xtm_queue_flags = XTM_QUEUE_DEFERRED_PUBLISH |
+				    XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_run(settings, producer_thread_deferred_notify,
+		     consumer_thread_edge_triggered_ptrs);
+	settings->xtm_queue_flags = 0;
+
+	check_plan();
+	footer();
+}
+
+/**
+ * Return the lowest file descriptor number, which is not used.
+ */
+static int
+next_free_fd(void)
+{
+	int fd = open("/dev/null", O_RDONLY);
+	fail_unless(fd >= 0);
+	fail_unless(close(fd) == 0);
+	return fd;
+}
+
+static void
+xtm_fds_creation_test(void)
+{
+	header();
+	plan(4);
+
+	struct xtm_queue *queue;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	int fd = next_free_fd();
+	fail_unless((queue = xtm_queue_new_ex(16, XTM_QUEUE_LAZY_FDS)) != NULL);
+	is(next_free_fd(), fd, "lazy queue is created without fds");
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_notify_consumer(queue) == 0);
+	struct pollfd pfd;
+	pfd.fd = xtm_queue_consumer_fd(queue);
+	pfd.events = POLLIN;
+	ok(pfd.fd >= 0 && poll(&pfd, 1, 0) == 1,
+	   "consumer fd is created by the first notification");
+	fail_unless(xtm_queue_delete(queue, flags) == 0);
+
+	fail_unless((queue = xtm_queue_new_ex(16, XTM_QUEUE_POLLED)) != NULL);
+	ok(next_free_fd() == fd && xtm_queue_producer_fd(queue) < 0 &&
+	   errno == EINVAL && xtm_queue_notify_producer(queue) == 0 &&
+	   next_free_fd() == fd, "polled queue has no fds");
+	fail_unless(xtm_queue_delete(queue, flags) == 0);
+	ok(xtm_queue_new_ex(16, XTM_QUEUE_POLLED | XTM_QUEUE_AUTO_NOTIFY) ==
+	   NULL && errno == EINVAL,
+	   "polled queue can't notify consumer automatically");
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_queue_pool_test(void)
+{
+	header();
+	plan(5);
+
+	struct xtm_queue_pool *pool;
+	struct xtm_queue *queue;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	int fd = next_free_fd();
+	fail_unless((pool = xtm_queue_pool_new(4, 0, 2)) != NULL);
+	int pool_fd = next_free_fd();
+	fail_unless((queue = xtm_queue_pool_acquire(pool)) != NULL);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_notify_consumer(queue) == 0);
+	fail_unless(xtm_queue_notify_producer(queue) == 0);
+	fail_unless(xtm_queue_pool_release(pool, queue) == 0);
+	struct pollfd pfds[2];
+	pfds[0].fd = xtm_queue_consumer_fd(queue);
+	pfds[1].fd = xtm_queue_producer_fd(queue);
+	pfds[0].events = pfds[1].events = POLLIN;
+	ok(xtm_queue_count(queue) == 0 && poll(pfds, 2, 0) == 0,
+	   "released queue is reset and its fds are drained");
+	ok(xtm_queue_pool_acquire(pool) == queue &&
+	   next_free_fd() == pool_fd, "released queue is reused");
+
+	struct xtm_queue *queues[3] = {queue};
+	for (unsigned i = 1; i < 3; i++)
+		fail_unless((queues[i] = xtm_queue_pool_acquire(pool)) != NULL);
+	for (unsigned i = 0; i < 3; i++)
+		fail_unless(xtm_queue_pool_release(pool, queues[i]) == 0);
+	fail_unless(xtm_queue_pool_delete(pool) == 0);
+	is(next_free_fd(), fd, "queues released to full pool are deleted");
+
+	fail_unless((pool = xtm_queue_pool_new(2, XTM_QUEUE_UNBOUNDED,
+					       1)) != NULL);
+	fail_unless((queue = xtm_queue_pool_acquire(pool)) != NULL);
+	for (uintptr_t i = 0; i < 8; i++)
+		fail_unless(xtm_queue_push_ptr(queue, (void *)i, 0) == 0);
+	fail_unless(xtm_queue_pool_release(pool, queue) == 0);
+	fail_unless(xtm_queue_pool_acquire(pool) == queue);
+	is(xtm_queue_count(queue), 0, "unbounded queue is reset");
+	void *ptrs[4];
+	for (uintptr_t i = 0; i < 4; i++)
+		fail_unless(xtm_queue_push_ptr(queue, (void *)i, 0) == 0);
+	ok(xtm_queue_pop_ptrs(queue, ptrs, 4) == 4 && ptrs[0] == NULL &&
+	   ptrs[3] == (void *)3, "reset unbounded queue is usable");
+	fail_unless(xtm_queue_delete(queue, flags) == 0);
+	fail_unless(xtm_queue_pool_delete(pool) == 0);
+
+	check_plan();
+	footer();
+}
+
+static long
+resident_pages(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+	fail_unless(f != NULL);
+	fail_unless(fscanf(f, "%ld %ld", &size, &resident) == 2);
+	fclose(f);
+	return resident;
+}
+
+static void
+xtm_idle_trim_test(void)
+{
+	header();
+	plan(5);
+
+	enum { QUEUE_SIZE = 64 * 1024, IDLE_USEC = 10000 };
+	struct xtm_queue *queue;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	void *ptrs[4];
+	fail_unless((queue = xtm_queue_new(QUEUE_SIZE)) != NULL);
+	fail_unless(xtm_queue_set_idle_trim(queue, IDLE_USEC) == 0);
+	for (unsigned i = 0; i < QUEUE_SIZE - 1; i++)
+		fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	while (xtm_queue_pop_ptrs(queue, ptrs, 4) > 0)
+		;
+	is(xtm_queue_trim(queue), 0, "active queue is not trimmed");
+	fail_unless(sleep_for_n_microseconds(2 * IDLE_USEC) == 0);
+	long resident = resident_pages();
+	is(xtm_queue_trim(queue), 1, "idle queue is trimmed");
+	/* Ring takes 256 pages of 4 KiB. */
+	ok(resident - resident_pages() >= 128, "resident memory is reduced");
+	is(xtm_queue_trim(queue), 0, "queue is trimmed once per idle period");
+	for (uintptr_t i = 1; i <= 4; i++)
+		fail_unless(xtm_queue_push_ptr(queue, (void *)i, 0) == 0);
+	ok(xtm_queue_pop_ptrs(queue, ptrs, 4) == 4 && ptrs[0] == (void *)1 &&
+	   ptrs[3] == (void *)4, "trimmed queue is usable");
+	fail_unless(xtm_queue_delete(queue, flags) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_publish_batch_test(void)
+{
+	header();
+	plan(6);
+
+	struct xtm_queue *queue;
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	fail_unless((queue = xtm_queue_new_ex(8,
+		XTM_QUEUE_DEFERRED_PUBLISH)) != NULL);
+	fail_unless(xtm_queue_set_publish_batch(queue, 3) == 0);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	is(xtm_queue_count(queue), 0, "incomplete batch is not published");
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	is(xtm_queue_count(queue), 3, "complete batch is published");
+	fail_unless(xtm_queue_flush(queue) == 0);
+	is(xtm_queue_count(queue), 4, "flush publishes messages");
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_notify_consumer(queue) == 0);
+	is(xtm_queue_count(queue), 5, "notification publishes messages");
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	ok(xtm_queue_push_ptr(queue, NULL, 0) != 0 &&
+	   xtm_queue_count(queue) == 7, "full queue is published");
+	ok(xtm_queue_set_publish_batch(queue, 0) != 0 && errno == EINVAL &&
+	   xtm_queue_new_ex(8, XTM_QUEUE_DEFERRED_PUBLISH |
+			       XTM_QUEUE_AUTO_NOTIFY) == NULL &&
+	   errno == EINVAL, "invalid publish settings are rejected");
+	fail_unless(xtm_queue_delete(queue, flags) == 0);
+
+	check_plan();
+	footer();
+}
+
+static struct xtm_mailbox *mailbox;
+
+static void *
+mailbox_writer_thread(MAYBE_UNUSED void *arg)
+{
+	for (uint64_t value = 1; value <= XTM_MSG_MAX; value++)
+		fail_unless(xtm_mailbox_write(mailbox, &value) == 0);
+	return NULL;
+}
+
+static void
+xtm_mailbox_test(void)
+{
+	header();
+	plan(6);
+
+	const uint64_t *value;
+	uint64_t val = 1;
+	fail_unless((mailbox = xtm_mailbox_new(sizeof(uint64_t))) != NULL);
+	struct pollfd pfd;
+	pfd.fd = xtm_mailbox_consumer_fd(mailbox);
+	pfd.events = POLLIN;
+	ok(xtm_mailbox_read(mailbox) == NULL && poll(&pfd, 1, 0) == 0,
+	   "empty mailbox has no value");
+	for (; val <= 3; val++)
+		fail_unless(xtm_mailbox_write(mailbox, &val) == 0);
+	uint64_t cnt = 0;
+	fail_unless(read(pfd.fd, &cnt, sizeof(cnt)) == sizeof(cnt));
+	is(cnt, 1, "consumer is notified once for unread values");
+	value = (const uint64_t *)xtm_mailbox_read(mailbox);
+	ok(value != NULL && *value == 3, "the latest value is read");
+	ok(xtm_mailbox_read(mailbox) == NULL, "value is read once");
+	fail_unless(xtm_mailbox_write(mailbox, &val) == 0);
+	value = (const uint64_t *)xtm_mailbox_read(mailbox);
+	ok(poll(&pfd, 1, 0) == 1 && value != NULL && *value == 4,
+	   "consumer is notified for value written after read");
+	fail_unless(xtm_queue_consume(pfd.fd) == 0);
+
+	pthread_t writer;
+	uint64_t last = 0;
+	bool is_ordered = true;
+	fail_unless(pthread_create(&writer, NULL, mailbox_writer_thread,
+				   NULL) == 0);
+	while (last < XTM_MSG_MAX) {
+		fail_unless(wait_for_fd(pfd.fd) > 0);
+		fail_unless(xtm_queue_consume(pfd.fd) == 0);
+		value = (const uint64_t *)xtm_mailbox_read(mailbox);
+		if (value == NULL)
+			continue;
+		if (*value <= last)
+			is_ordered = false;
+		last = *value;
+	}
+	fail_unless(pthread_join(writer, NULL) == 0);
+	ok(is_ordered && xtm_mailbox_read(mailbox) == NULL,
+	   "consumer reads values in order up to the latest");
+	fail_unless(xtm_mailbox_delete(mailbox,
+		XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_flush_notifications_test(void)
+{
+	header();
+	plan(5);
+
+	enum { QUEUE_COUNT = 3 };
+	struct xtm_queue *queues[QUEUE_COUNT];
+	struct pollfd pfds[QUEUE_COUNT];
+	unsigned flags = XTM_QUEUE_DEFERRED_NOTIFY;
+	for (unsigned i = 0; i < QUEUE_COUNT; i++) {
+		fail_unless((queues[i] = xtm_queue_new(16)) != NULL);
+		pfds[i].fd = xtm_queue_consumer_fd(queues[i]);
+		pfds[i].events = POLLIN;
+	}
+
+	fail_unless(xtm_queue_push_ptr(queues[0], NULL, flags) == 0);
+	fail_unless(xtm_queue_push_ptr(queues[0], NULL, flags) == 0);
+	fail_unless(xtm_queue_push_ptr(queues[1], NULL, flags) == 0);
+	is(poll(pfds, QUEUE_COUNT, 0), 0, "consumers are not notified on push");
+	fail_unless(xtm_flush_notifications() == 0);
+	ok(poll(pfds, QUEUE_COUNT, 0) == 2 && pfds[0].revents == POLLIN &&
+	   pfds[1].revents == POLLIN, "dirty queues are notified on flush");
+	uint64_t val = 0;
+	fail_unless(read(pfds[0].fd, &val, sizeof(val)) == sizeof(val));
+	ok(val == 1 && poll(pfds, 1, 0) == 0,
+	   "dirty queue is notified once");
+	fail_unless(xtm_queue_consume(pfds[1].fd) == 0);
+	fail_unless(xtm_flush_notifications() == 0);
+	is(poll(pfds, QUEUE_COUNT, 0), 0, "flush without dirty queues is no-op");
+	fail_unless(xtm_queue_push_ptr(queues[2], NULL, flags) == 0);
+	fail_unless(xtm_queue_push_ptr(queues[1], NULL, flags) == 0);
+	flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+		XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	fail_unless(xtm_queue_delete(queues[2], flags) == 0);
+	fail_unless(xtm_flush_notifications() == 0);
+	is(poll(pfds, QUEUE_COUNT - 1, 0), 1,
+	   "deleted dirty queue is removed from the list");
+	for (unsigned i = 0; i < QUEUE_COUNT - 1; i++)
+		fail_unless(xtm_queue_delete(queues[i], flags) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_flush_fd_test(void)
+{
+	header();
+	plan(8);
+
+	struct xtm_test_settings settings;
+	settings.xtm_queue_size = 16;
+	settings.xtm_push_timeout = 0;
+	settings.xtm_queue_flags = XTM_QUEUE_AUTO_NOTIFY;
+	xtm_test_start(&settings);
+	int consumer_fd = xtm_queue_consumer_fd(xtm_queue);
+	int flush_fd = xtm_queue_flush_fd(xtm_queue);
+	struct pollfd pfd;
+	pfd.fd = consumer_fd;
+	pfd.events = POLLIN;
+	fail_unless(flush_fd >= 0);
+	struct pollfd flush_pfd;
+	flush_pfd.fd = flush_fd;
+	flush_pfd.events = POLLIN;
+	fail_unless(xtm_queue_set_auto_notify(xtm_queue, 8, 1000) == 0);
+
+	fail_unless(xtm_queue_push_ptr(xtm_queue, NULL, 0) == 0);
+	is(poll(&pfd, 1, 0), 1, "waiting consumer is notified immediately");
+	fail_unless(xtm_queue_consume(consumer_fd) == 0);
+	for (unsigned i = 0; i < 4; i++)
+		fail_unless(xtm_queue_push_ptr(xtm_queue, NULL, 0) == 0);
+	is(poll(&pfd, 1, 0), 0, "busy consumer is not notified");
+	is(wait_for_fd(flush_fd), 1, "flush fd is readable after linger");
+	fail_unless(xtm_queue_consume(flush_fd) == 0);
+	fail_unless(xtm_queue_flush(xtm_queue) == 0);
+	is(poll(&pfd, 1, 0), 1, "consumer is notified on flush");
+	fail_unless(xtm_queue_consume(consumer_fd) == 0);
+	fail_unless(xtm_queue_push_ptr(xtm_queue, NULL, 0) == 0);
+	fail_unless(xtm_queue_flush(xtm_queue) == 0);
+	fail_unless(xtm_queue_consume(consumer_fd) == 0);
+	fail_unless(sleep_for_n_microseconds(2000) == 0);
+	is(poll(&flush_pfd, 1, 0), 0, "flush disarms linger timer");
+	for (unsigned i = 0; i < 8; i++)
+		fail_unless(xtm_queue_push_ptr(xtm_queue, NULL, 0) == 0);
+	is(poll(&pfd, 1, 0), 1, "consumer is notified after batch");
+	fail_unless(xtm_queue_consume(consumer_fd) == 0);
+	fail_unless(sleep_for_n_microseconds(2000) == 0);
+	is(poll(&flush_pfd, 1, 0), 0,
+	   "notification of batch disarms linger timer");
+	fail_unless(xtm_queue_flush(xtm_queue) == 0);
+	is(poll(&pfd, 1, 0), 0, "flush without new messages is no-op");
+	xtm_test_finish();
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_dispatcher_test(void)
+{
+	header();
+	plan(5);
+
+	enum { QUEUE_COUNT = 4, QUEUE_SIZE = 16, AFFINITY_LIMIT = 4 };
+	struct xtm_queue *queues[QUEUE_COUNT];
+	struct xtm_queue *queue;
+	struct xtm_dispatcher *dispatcher;
+	void *ptrs[QUEUE_SIZE];
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	for (unsigned i = 0; i < QUEUE_COUNT; i++)
+		fail_unless((queues[i] = xtm_queue_new(QUEUE_SIZE)) != NULL);
+	fail_unless((dispatcher = xtm_dispatcher_new(queues, QUEUE_COUNT,
+						     AFFINITY_LIMIT)) != NULL);
+	/*
+	 * The first queue stays the most loaded one, so it loses
+	 * against any other sampled queue.
+	 */
+	for (unsigned i = 0; i < 10; i++)
+		fail_unless(xtm_queue_push_ptr(queues[0], NULL, 0) == 0);
+	for (unsigned i = 0; i < 9; i++) {
+		fail_unless((queue = xtm_dispatcher_select(dispatcher)) != NULL);
+		fail_unless(xtm_queue_push_ptr(queue, NULL,
+					       XTM_QUEUE_DEFERRED_NOTIFY) == 0);
+	}
+	is(xtm_queue_count(queues[0]), 10, "loaded queue is not selected");
+	fail_unless(xtm_flush_notifications() == 0);
+	unsigned selected = 0, notified = 0;
+	for (unsigned i = 0; i < QUEUE_COUNT; i++) {
+		struct pollfd pfd;
+		pfd.fd = xtm_queue_consumer_fd(queues[i]);
+		pfd.events = POLLIN;
+		if (i > 0 && xtm_queue_count(queues[i]) > 0)
+			selected++;
+		if (poll(&pfd, 1, 0) == 1) {
+			fail_unless(xtm_queue_consume(pfd.fd) == 0);
+			notified++;
+		}
+		while (xtm_queue_pop_ptrs(queues[i], ptrs, QUEUE_SIZE) > 0)
+			;
+	}
+	is(notified, selected, "selected queues are notified once on flush");
+
+	const uint64_t key = 42;
+	fail_unless((queue = xtm_dispatcher_select_key(dispatcher,
+						       key)) != NULL);
+	unsigned same = 0;
+	for (unsigned i = 0; i <= AFFINITY_LIMIT; i++) {
+		same += (xtm_dispatcher_select_key(dispatcher, key) == queue);
+		fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+	}
+	is(same, AFFINITY_LIMIT + 1, "messages with the same key are "
+	   "dispatched to the same queue");
+	ok(xtm_dispatcher_select_key(dispatcher, key) != queue,
+	   "overloaded queue is bypassed");
+
+	unsigned pushed = AFFINITY_LIMIT + 1;
+	while ((queue = xtm_dispatcher_select(dispatcher)) != NULL) {
+		fail_unless(xtm_queue_push_ptr(queue, NULL, 0) == 0);
+		pushed++;
+	}
+	ok(errno == ENOBUFS && pushed == QUEUE_COUNT * (QUEUE_SIZE - 1),
+	   "queues are selected until all of them are full");
+
+	xtm_dispatcher_delete(dispatcher);
+	for (unsigned i = 0; i < QUEUE_COUNT; i++)
+		fail_unless(xtm_queue_delete(queues[i], flags) == 0);
+
+	check_plan();
+	footer();
+}
+
+/** Epoll instances of consumers in xtm_consumer_handoff_test. */
+static int handoff_epfd[2];
+/** Next pointer expected by consumers in xtm_consumer_handoff_test. */
+static uintptr_t handoff_expected;
+/** Count of pointers received out of order during handoff. */
+static unsigned handoff_misordered;
+
+static void *
+handoff_producer_f(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_producer_fd(xtm_queue);
+	unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+	for (uintptr_t i = 0; i < XTM_MSG_MAX; i++) {
+		while (xtm_queue_push_ptr(xtm_queue, (void *)i, flags) != 0) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+		fail_unless(xtm_queue_notify_consumer(xtm_queue) == 0);
+	}
+	return NULL;
+}
+
+/**
+ * Pop pointers in edge-triggered mode, until limit is reached.
+ */
+static void
+handoff_consume(int epfd, uintptr_t limit)
+{
+	while (handoff_expected < limit) {
+		void *ptrs[4];
+		unsigned count = xtm_queue_pop_ptrs(xtm_queue, ptrs, 4);
+		for (unsigned i = 0; i < count; i++) {
+			if ((uintptr_t)ptrs[i] != handoff_expected)
+				handoff_misordered++;
+			handoff_expected++;
+		}
+		if (xtm_queue_get_reset_was_full(xtm_queue))
+			fail_unless(xtm_queue_notify_producer(xtm_queue) == 0);
+		if (count < 4 && handoff_expected < limit) {
+			struct epoll_event ev;
+			int rc;
+			while ((rc = epoll_wait(epfd, &ev, 1, -1)) < 0 &&
+			       errno == EINTR)
+				;
+			fail_unless(rc == 1);
+		}
+	}
+}
+
+static void *
+handoff_old_consumer_f(MAYBE_UNUSED void *arg)
+{
+	handoff_consume(handoff_epfd[0], XTM_MSG_MAX / 2);
+	fail_unless(xtm_queue_consumer_epoll_del(xtm_queue,
+						 handoff_epfd[0]) == 0);
+	fail_unless(xtm_queue_consumer_release(xtm_queue) == 0);
+	return NULL;
+}
+
+static void *
+handoff_new_consumer_f(MAYBE_UNUSED void *arg)
+{
+	fail_unless(xtm_queue_consumer_epoll_add(xtm_queue, handoff_epfd[1],
+						 NULL) == 0);
+	while (xtm_queue_consumer_acquire(xtm_queue) != 0) {
+		fail_unless(errno == EBUSY);
+		sched_yield();
+	}
+	handoff_consume(handoff_epfd[1], XTM_MSG_MAX);
+	return NULL;
+}
+
+static void
+xtm_consumer_handoff_test(void)
+{
+	header();
+	plan(4);
+
+	struct xtm_test_settings settings;
+	settings.xtm_queue_size = 8;
+	settings.xtm_push_timeout = 0;
+	settings.xtm_queue_flags = XTM_QUEUE_EDGE_TRIGGERED;
+	xtm_test_start(&settings);
+	errno = 0;
+	ok(xtm_queue_consumer_acquire(xtm_queue) != 0 && errno == EBUSY,
+	   "queue, which isn't released, can't be acquired");
+	fail_unless(xtm_queue_consumer_release(xtm_queue) == 0);
+	errno = 0;
+	ok(xtm_queue_consumer_release(xtm_queue) != 0 && errno == EINVAL,
+	   "queue can't be released twice");
+	fail_unless(xtm_queue_consumer_acquire(xtm_queue) == 0);
+	struct pollfd pfd;
+	pfd.fd = xtm_queue_consumer_fd(xtm_queue);
+	pfd.events = POLLIN;
+	ok(poll(&pfd, 1, 0) == 1, "new consumer is notified on acquire");
+	fail_unless(xtm_queue_consume(pfd.fd) == 0);
+
+	/* Consumer is handed off in the middle of the stream. */
+	pthread_t new_consumer;
+	for (unsigned i = 0; i < 2; i++)
+		fail_unless((handoff_epfd[i] = epoll_create1(0)) >= 0);
+	fail_unless(xtm_queue_consumer_epoll_add(xtm_queue, handoff_epfd[0],
+						 NULL) == 0);
+	handoff_expected = 0;
+	handoff_misordered = 0;
+	fail_unless(pthread_create(&producer, NULL,
+				   handoff_producer_f, NULL) == 0);
+	fail_unless(pthread_create(&consumer, NULL,
+				   handoff_old_consumer_f, NULL) == 0);
+	fail_unless(pthread_create(&new_consumer, NULL,
+				   handoff_new_consumer_f, NULL) == 0);
+	fail_unless(pthread_join(producer, NULL) == 0);
+	fail_unless(pthread_join(consumer, NULL) == 0);
+	fail_unless(pthread_join(new_consumer, NULL) == 0);
+	ok(handoff_expected == XTM_MSG_MAX && handoff_misordered == 0,
+	   "all messages are received in order across handoff");
+	for (unsigned i = 0; i < 2; i++)
+		fail_unless(close(handoff_epfd[i]) == 0);
+	xtm_test_finish();
+
+	check_plan();
+	footer();
+}
+
+static void
+profiled_fast_fun(MAYBE_UNUSED void *arg)
+{
+}
+
+static void
+profiled_slow_fun(MAYBE_UNUSED void *arg)
+{
+	fail_unless(sleep_for_n_microseconds(100) == 0);
+}
+
+static void
+profiled_batch_fun(MAYBE_UNUSED void **args, MAYBE_UNUSED unsigned count)
+{
+}
+
+/**
+ * Find statistics of the function, returned by xtm_queue_get_fun_stats.
+ */
+static struct xtm_queue_fun_stats *
+find_fun_stats(struct xtm_queue_fun_stats *stats, unsigned count,
+	       xtm_queue_fun_t fun)
+{
+	for (unsigned i = 0; i < count; i++) {
+		if (stats[i].fun == fun)
+			return &stats[i];
+	}
+	return NULL;
+}
+
+static void
+xtm_profiling_test(void)
+{
+	header();
+	plan(5);
+
+	enum { QUEUE_SIZE = 256, FAST_COUNT = 100, SLOW_COUNT = 10 };
+	struct xtm_queue_fun_stats stats[4];
+	struct xtm_queue_fun_stats *fast, *slow;
+	unsigned count;
+	fail_unless((xtm_queue = xtm_queue_new(QUEUE_SIZE)) != NULL);
+	is(xtm_queue_get_fun_stats(xtm_queue, stats, 4), 0,
+	   "profiler is disabled by default");
+
+	fail_unless(xtm_queue_set_profiling(xtm_queue, 1) == 0);
+	for (unsigned i = 0; i < FAST_COUNT; i++) {
+		fail_unless(xtm_queue_push_fun(xtm_queue, profiled_fast_fun,
+					       NULL, 0) == 0);
+		if (i < SLOW_COUNT)
+			fail_unless(xtm_queue_push_fun(xtm_queue,
+						       profiled_slow_fun,
+						       NULL, 0) == 0);
+	}
+	fail_unless(xtm_queue_invoke_funs_all(xtm_queue) ==
+		    FAST_COUNT + SLOW_COUNT);
+	count = xtm_queue_get_fun_stats(xtm_queue, stats, 4);
+	fast = find_fun_stats(stats, count, profiled_fast_fun);
+	slow = find_fun_stats(stats, count, profiled_slow_fun);
+	ok(count == 2 && fast != NULL && slow != NULL &&
+	   fast->calls == FAST_COUNT && slow->calls == SLOW_COUNT,
+	   "invocations are aggregated by function");
+	ok(slow->max_nsec >= 100000 && slow->total_nsec > fast->total_nsec,
+	   "the slow function is the most expensive one");
+
+	fail_unless(xtm_queue_set_profiling(xtm_queue, 4) == 0);
+	for (unsigned i = 0; i < FAST_COUNT; i++)
+		fail_unless(xtm_queue_push_fun(xtm_queue, profiled_fast_fun,
+					       NULL, 0) == 0);
+	fail_unless(xtm_queue_invoke_funs_all(xtm_queue) == FAST_COUNT);
+	count = xtm_queue_get_fun_stats(xtm_queue, stats, 4);
+	fast = find_fun_stats(stats, count, profiled_fast_fun);
+	ok(count == 1 && fast->calls == FAST_COUNT / 4,
+	   "one of sample period invocations is timed");
+
+	fail_unless(xtm_queue_set_batch_fun(xtm_queue, profiled_fast_fun,
+					    profiled_batch_fun) == 0);
+	fail_unless(xtm_queue_set_profiling(xtm_queue, 1) == 0);
+	for (unsigned i = 0; i < FAST_COUNT; i++)
+		fail_unless(xtm_queue_push_fun(xtm_queue, profiled_fast_fun,
+					       NULL, 0) == 0);
+	fail_unless(xtm_queue_invoke_funs_all(xtm_queue) == FAST_COUNT);
+	count = xtm_queue_get_fun_stats(xtm_queue, stats, 4);
+	fast = find_fun_stats(stats, count, profiled_fast_fun);
+	ok(count == 1 && fast->calls == FAST_COUNT,
+	   "batch function is accounted to the pushed function");
+	fail_unless(xtm_queue_set_profiling(xtm_queue, 0) == 0);
+	xtm_test_finish();
+
+	check_plan();
+	footer();
+}
+
+/** Count of monitor function calls and arguments of the last call. */
+static unsigned monitor_cb_count;
+static bool monitor_cb_is_over;
+static struct xtm_monitor_stats monitor_cb_stats;
+
+static void
+monitor_cb(struct xtm_queue *queue, const struct xtm_monitor_stats *stats,
+	   bool is_over, MAYBE_UNUSED void *ctx)
+{
+	fail_unless(queue == xtm_queue);
+	monitor_cb_count++;
+	monitor_cb_is_over = is_over;
+	monitor_cb_stats = *stats;
+}
+
+static void
+xtm_monitor_test(void)
+{
+	header();
+	plan(11);
+
+	enum {
+		QUEUE_SIZE = 16,
+		DEPTH_THRESHOLD = 4,
+		AGE_THRESHOLD_USEC = 20000,
+		STALL_USEC = 50000,
+	};
+	void *ptr_array[QUEUE_SIZE];
+	struct xtm_monitor_stats stats;
+	struct xtm_monitor *monitor;
+	fail_unless((monitor = xtm_monitor_new(monitor_cb, NULL)) != NULL);
+	fail_unless((xtm_queue = xtm_queue_new(QUEUE_SIZE)) != NULL);
+	fail_unless(xtm_monitor_add(monitor, xtm_queue, DEPTH_THRESHOLD,
+				    AGE_THRESHOLD_USEC,
+				    AGE_THRESHOLD_USEC) == 0);
+
+	for (unsigned i = 0; i < DEPTH_THRESHOLD; i++)
+		fail_unless(xtm_queue_push_ptr(xtm_queue, &i, 0) == 0);
+	ok(xtm_monitor_poll(monitor) == 0 && monitor_cb_count == 0,
+	   "queue below thresholds isn't reported");
+	fail_unless(xtm_queue_push_ptr(xtm_queue, ptr_array, 0) == 0);
+	ok(xtm_monitor_poll(monitor) == 1 && monitor_cb_count == 1 &&
+	   monitor_cb_is_over && monitor_cb_stats.depth == DEPTH_THRESHOLD + 1,
+	   "queue over depth threshold is reported");
+	ok(xtm_monitor_poll(monitor) == 1 && monitor_cb_count == 1,
+	   "queue is reported once until it returns below thresholds");
+	fail_unless(xtm_queue_pop_ptrs(xtm_queue, ptr_array, QUEUE_SIZE) ==
+		    DEPTH_THRESHOLD + 1);
+	ok(xtm_monitor_poll(monitor) == 0 && monitor_cb_count == 2 &&
+	   !monitor_cb_is_over && monitor_cb_stats.depth == 0 &&
+	   monitor_cb_stats.oldest_age_usec == 0 &&
+	   monitor_cb_stats.stall_usec == 0,
+	   "drained queue returns below thresholds");
+
+	/* Consumer is stuck, while the first message waits in queue. */
+	fail_unless(xtm_queue_push_ptr(xtm_queue, ptr_array, 0) == 0);
+	fail_unless(xtm_monitor_poll(monitor) == 0);
+	fail_unless(sleep_for_n_microseconds(STALL_USEC) == 0);
+	fail_unless(xtm_queue_push_ptr(xtm_queue, ptr_array, 0) == 0);
+	is(xtm_monitor_poll(monitor), 1, "stalled consumer is reported");
+	fail_unless(xtm_monitor_get_stats(monitor, xtm_queue, &stats) == 0);
+	ok(stats.depth == 2 && stats.oldest_age_usec >= STALL_USEC &&
+	   stats.stall_usec >= STALL_USEC,
+	   "age of the oldest message and stall time are measured");
+	/* Only the newest message is left. */
+	fail_unless(xtm_queue_pop_ptrs(xtm_queue, ptr_array, 1) == 1);
+	fail_unless(xtm_monitor_poll(monitor) == 0);
+	fail_unless(xtm_monitor_get_stats(monitor, xtm_queue, &stats) == 0);
+	ok(monitor_cb_count == 4 && !monitor_cb_is_over &&
+	   stats.depth == 1 && stats.oldest_age_usec < STALL_USEC &&
+	   stats.stall_usec == 0,
+	   "age follows the oldest unread message");
+
+	ok(xtm_monitor_add(monitor, xtm_queue, 0, 0, 0) == -1 &&
+	   errno == EEXIST, "queue is watched once");
+	fail_unless(xtm_monitor_remove(monitor, xtm_queue) == 0);
+	ok(xtm_monitor_get_stats(monitor, xtm_queue, &stats) == -1 &&
+	   errno == ENOENT, "removed queue isn't watched");
+	xtm_test_finish();
+
+	fail_unless((xtm_queue = xtm_queue_new_ex(QUEUE_SIZE,
+						  XTM_QUEUE_UNBOUNDED)) != NULL);
+	ok(xtm_monitor_add(monitor, xtm_queue, 0, 0, 0) == -1 &&
+	   errno == EINVAL, "unbounded queue can't be watched");
+	xtm_test_finish();
+	xtm_monitor_delete(monitor);
+	is(monitor_cb_count, 4, "monitor function is called on transitions");
+
+	check_plan();
+	footer();
+}
+
 int main()
 {
 	header();
-	plan(2 * 2 * 5);
+	plan(5 * 2 * 12 + 11);
+
+	xtm_flush_fd_test();
+	xtm_flush_notifications_test();
+	xtm_fds_creation_test();
+	xtm_queue_pool_test();
+	xtm_idle_trim_test();
+	xtm_publish_batch_test();
+	xtm_mailbox_test();
+	xtm_dispatcher_test();
+	xtm_consumer_handoff_test();
+	xtm_profiling_test();
+	xtm_monitor_test();
 
 	for (unsigned timeout = 0; timeout <= 1; timeout++) {
 		for (unsigned size = 2; size <= 32; size *= 2) {
 			struct xtm_test_settings settings;
 			settings.xtm_push_timeout = timeout;
 			settings.xtm_queue_size = size;
+			settings.xtm_queue_flags = 0;
 			xtm_push_and_invoke_fun_test(&settings);
 			xtm_push_and_pop_ptr_test(&settings);
+			xtm_drain_test(&settings);
+			xtm_peek_release_test(&settings);
+			xtm_batch_fun_test(&settings);
+			xtm_deferred_notify_test(&settings);
+			xtm_unbounded_test(&settings);
+			xtm_lazy_fds_test(&settings);
+			xtm_ptr_only_test(&settings);
+			xtm_deferred_publish_test(&settings);
+			xtm_auto_notify_test(&settings);
+			xtm_edge_triggered_test(&settings);
 		}
 	}
 
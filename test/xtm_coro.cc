@@ -0,0 +1,197 @@
+#include <xtm_coro.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+
+#include "unit.h"
+
+enum {
+	/** Count of messages sent in each direction */
+	XTM_MSG_MAX = 10000,
+	/** Size of xtm queues, small enough to make them full */
+	XTM_QUEUE_SIZE = 4,
+	/** Maximum count of pointers popped by coroutine at once */
+	XTM_POP_BATCH = 3,
+	/** Timeout waiting for test completion */
+	XTM_TEST_TIMEOUT = 2,
+};
+
+/** Queue from plain producer thread to coroutine. */
+static struct xtm_queue *to_coro;
+/** Queue from coroutine to plain consumer thread. */
+static struct xtm_queue *from_coro;
+/** Count of messages received by consumer coroutine. */
+static unsigned coro_received;
+/** Count of messages pushed by producer coroutine. */
+static unsigned coro_pushed;
+
+/**
+ * Fire-and-forget coroutine type, enough to drive awaiters.
+ */
+struct xtm_test_task {
+	struct promise_type {
+		xtm_test_task
+		get_return_object(void)
+		{
+			return xtm_test_task();
+		}
+		std::suspend_never
+		initial_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+		std::suspend_never
+		final_suspend(void) noexcept
+		{
+			return std::suspend_never();
+		}
+		void
+		return_void(void) {}
+		void
+		unhandled_exception(void)
+		{
+			abort();
+		}
+	};
+};
+
+static void
+timer_handler(int signum)
+{
+	fail_unless(signum == SIGALRM);
+	fail("timeout", "expired");
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void *
+producer_thread(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_producer_fd(to_coro);
+	unsigned flags = XTM_QUEUE_PRODUCER_NEEDS_NOTIFICATIONS;
+	for (uintptr_t i = 1; i <= XTM_MSG_MAX; i++) {
+		while (xtm_queue_push_ptr(to_coro, (void *)i, flags) != 0) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+		fail_unless(xtm_queue_notify_consumer(to_coro) == 0);
+	}
+	return NULL;
+}
+
+static void *
+consumer_thread(MAYBE_UNUSED void *arg)
+{
+	int fd = xtm_queue_consumer_fd(from_coro);
+	uintptr_t expected = 1;
+	while (expected <= XTM_MSG_MAX) {
+		fail_unless(wait_for_fd(fd) > 0);
+		fail_unless(xtm_queue_consume(fd) == 0);
+		void *ptr_array[XTM_QUEUE_SIZE];
+		unsigned rc = xtm_queue_pop_ptrs(from_coro, ptr_array,
+						 XTM_QUEUE_SIZE);
+		for (unsigned i = 0; i < rc; i++)
+			fail_unless((uintptr_t)ptr_array[i] == expected++);
+		if (xtm_queue_get_reset_was_full(from_coro))
+			fail_unless(xtm_queue_notify_producer(from_coro) == 0);
+	}
+	return NULL;
+}
+
+static xtm_test_task
+consumer_coro(struct xtm_coro_queue *q)
+{
+	uintptr_t expected = 1;
+	while (expected <= XTM_MSG_MAX) {
+		void *ptr_array[XTM_POP_BATCH];
+		unsigned rc = co_await q->pop_batch(ptr_array, XTM_POP_BATCH);
+		fail_unless(rc > 0 && rc <= XTM_POP_BATCH);
+		for (unsigned i = 0; i < rc; i++)
+			fail_unless((uintptr_t)ptr_array[i] == expected++);
+		coro_received += rc;
+	}
+}
+
+static xtm_test_task
+producer_coro(struct xtm_coro_queue *q)
+{
+	for (uintptr_t i = 1; i <= XTM_MSG_MAX; i++) {
+		fail_unless(co_await q->push((void *)i) == 0);
+		coro_pushed++;
+	}
+}
+
+static void
+xtm_coro_test(void)
+{
+	header();
+	plan(4);
+
+	pthread_t producer, consumer;
+	struct xtm_coro_epoll_reactor reactor;
+	fail_unless(reactor.create() == 0);
+	fail_unless((to_coro = xtm_queue_new(XTM_QUEUE_SIZE)) != NULL);
+	fail_unless((from_coro = xtm_queue_new(XTM_QUEUE_SIZE)) != NULL);
+	{
+		struct xtm_coro_queue in(to_coro, &reactor);
+		struct xtm_coro_queue out(from_coro, &reactor);
+		fail_unless(pthread_create(&producer, NULL,
+					   producer_thread, NULL) == 0);
+		fail_unless(pthread_create(&consumer, NULL,
+					   consumer_thread, NULL) == 0);
+		consumer_coro(&in);
+		producer_coro(&out);
+		while (coro_received < XTM_MSG_MAX ||
+		       coro_pushed < XTM_MSG_MAX)
+			fail_unless(reactor.run_once(-1) >= 0);
+		/* Last pushes are notified at the end of iteration. */
+		fail_unless(out.flush() == 0);
+		fail_unless(pthread_join(producer, NULL) == 0);
+		fail_unless(pthread_join(consumer, NULL) == 0);
+	}
+	is(coro_received, XTM_MSG_MAX, "coroutine received all messages");
+	is(coro_pushed, XTM_MSG_MAX, "coroutine pushed all messages");
+	is(xtm_queue_count(to_coro), 0, "queue to coroutine is empty");
+	is(xtm_queue_count(from_coro), 0, "queue from coroutine is empty");
+
+	unsigned flags = XTM_QUEUE_MUST_CLOSE_PRODUCER_READFD |
+			 XTM_QUEUE_MUST_CLOSE_CONSUMER_READFD;
+	fail_unless(xtm_queue_delete(to_coro, flags) == 0);
+	fail_unless(xtm_queue_delete(from_coro, flags) == 0);
+	reactor.destroy();
+
+	check_plan();
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(1);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &timer_handler;
+	fail_unless(sigaction(SIGALRM, &sa, NULL) == 0);
+	alarm(XTM_TEST_TIMEOUT);
+
+	xtm_coro_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}
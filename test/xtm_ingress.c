@@ -0,0 +1,178 @@
+#include <xtm_api.h>
+#include <xtm_ingress.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include "unit.h"
+
+enum {
+	/** Count of producer threads */
+	XTM_PRODUCER_COUNT = 8,
+	/** Count of pointers pushed by each producer */
+	XTM_PUSH_COUNT = 10000,
+	/** Size of ring of each CPU, small enough to make it full */
+	XTM_RING_SIZE = 64,
+	/** Maximum count of pointers popped at once */
+	XTM_POP_BATCH = 32,
+	/** Timeout waiting for test completion */
+	XTM_TEST_TIMEOUT = 10,
+};
+
+static struct xtm_ingress *ingress;
+/** Count of pops of each pushed pointer. */
+static unsigned ptr_hits[XTM_PRODUCER_COUNT * XTM_PUSH_COUNT];
+
+static void
+timer_handler(int signum)
+{
+	fail_unless(signum == SIGALRM);
+	fail("timeout", "expired");
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void *
+producer_thread(void *arg)
+{
+	uintptr_t first = (uintptr_t)arg * XTM_PUSH_COUNT;
+	for (uintptr_t i = first; i < first + XTM_PUSH_COUNT; i++) {
+		while (xtm_ingress_push(ingress, (void *)i) != 0) {
+			fail_unless(errno == ENOBUFS);
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+static void
+xtm_ingress_new_test(void)
+{
+	header();
+	plan(2);
+
+	errno = 0;
+	ok(xtm_ingress_new(3) == NULL && errno == EINVAL,
+	   "ingress with ring size not power of two is not created");
+	fail_unless((ingress = xtm_ingress_new(XTM_RING_SIZE)) != NULL);
+	note("ingress %s rseq", xtm_ingress_uses_rseq(ingress) ?
+	     "uses" : "doesn't use");
+	struct pollfd pfd;
+	pfd.fd = xtm_ingress_consumer_fd(ingress);
+	pfd.events = POLLIN;
+	fail_unless(xtm_ingress_push(ingress, NULL) == 0);
+	ok(poll(&pfd, 1, 0) == 1, "the first push notifies consumer");
+	fail_unless(xtm_ingress_delete(ingress) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_ingress_full_test(void)
+{
+	header();
+	plan(2);
+
+	/* Stay on one CPU, so that all pointers go to the same ring. */
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(sched_getcpu(), &set);
+	fail_unless(sched_setaffinity(0, sizeof(set), &set) == 0);
+	fail_unless((ingress = xtm_ingress_new(XTM_RING_SIZE)) != NULL);
+	unsigned pushed = 0;
+	while (xtm_ingress_push(ingress, (void *)(uintptr_t)pushed) == 0)
+		pushed++;
+	ok(errno == ENOBUFS && pushed == XTM_RING_SIZE,
+	   "push to full ring fails with ENOBUFS");
+	void *ptrs[XTM_RING_SIZE];
+	unsigned popped = xtm_ingress_pop(ingress, ptrs, XTM_RING_SIZE);
+	unsigned in_order = 0;
+	for (unsigned i = 0; i < popped; i++)
+		in_order += (ptrs[i] == (void *)(uintptr_t)i);
+	ok(popped == XTM_RING_SIZE && in_order == popped,
+	   "pointers pushed on one CPU are popped in order");
+	fail_unless(xtm_ingress_delete(ingress) == 0);
+	CPU_ZERO(&set);
+	for (int i = 0; i < CPU_SETSIZE; i++)
+		CPU_SET(i, &set);
+	fail_unless(sched_setaffinity(0, sizeof(set), &set) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_ingress_producers_test(void)
+{
+	header();
+	plan(2);
+
+	pthread_t producers[XTM_PRODUCER_COUNT];
+	fail_unless((ingress = xtm_ingress_new(XTM_RING_SIZE)) != NULL);
+	for (uintptr_t i = 0; i < XTM_PRODUCER_COUNT; i++)
+		fail_unless(pthread_create(&producers[i], NULL,
+					   producer_thread, (void *)i) == 0);
+	int fd = xtm_ingress_consumer_fd(ingress);
+	unsigned popped = 0;
+	while (popped < XTM_PRODUCER_COUNT * XTM_PUSH_COUNT) {
+		void *ptrs[XTM_POP_BATCH];
+		unsigned count = xtm_ingress_pop(ingress, ptrs, XTM_POP_BATCH);
+		for (unsigned i = 0; i < count; i++)
+			ptr_hits[(uintptr_t)ptrs[i]]++;
+		popped += count;
+		if (count < XTM_POP_BATCH &&
+		    popped < XTM_PRODUCER_COUNT * XTM_PUSH_COUNT) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+	}
+	for (unsigned i = 0; i < XTM_PRODUCER_COUNT; i++)
+		fail_unless(pthread_join(producers[i], NULL) == 0);
+	unsigned popped_once = 0;
+	for (unsigned i = 0; i < XTM_PRODUCER_COUNT * XTM_PUSH_COUNT; i++)
+		popped_once += (ptr_hits[i] == 1);
+	is(popped_once, XTM_PRODUCER_COUNT * XTM_PUSH_COUNT,
+	   "each pushed pointer is popped once");
+	void *ptr;
+	is(xtm_ingress_pop(ingress, &ptr, 1), 0, "ingress is empty");
+	fail_unless(xtm_ingress_delete(ingress) == 0);
+
+	check_plan();
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(3);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &timer_handler;
+	fail_unless(sigaction(SIGALRM, &sa, NULL) == 0);
+	alarm(XTM_TEST_TIMEOUT);
+
+	xtm_ingress_new_test();
+	xtm_ingress_full_test();
+	xtm_ingress_producers_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}
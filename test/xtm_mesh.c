@@ -0,0 +1,208 @@
+#include <xtm_api.h>
+#include <xtm_mesh.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include "unit.h"
+
+enum {
+	/** Count of mesh threads */
+	XTM_THREAD_COUNT = 4,
+	/** Count of pointers sent by each thread to each thread */
+	XTM_MSG_MAX = 10000,
+	/** Size of rings, small enough to make them full */
+	XTM_RING_SIZE = 8,
+	/** Timeout waiting for test completion */
+	XTM_TEST_TIMEOUT = 10,
+};
+
+static struct xtm_mesh *mesh;
+/** Barrier, which threads pass after they attached to mesh. */
+static pthread_barrier_t attached;
+
+/** State of a mesh thread. */
+struct mesh_thread {
+	/** Id of the thread in mesh. */
+	unsigned id;
+	/** Next value expected from each sender. */
+	uintptr_t expected[XTM_THREAD_COUNT];
+	/** Count of received pointers. */
+	unsigned received;
+	/** Count of pointers, received out of order. */
+	unsigned misordered;
+};
+
+static struct mesh_thread threads[XTM_THREAD_COUNT];
+
+static void
+timer_handler(int signum)
+{
+	fail_unless(signum == SIGALRM);
+	fail("timeout", "expired");
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+static void
+receive_fun(void *ctx, unsigned from, void *ptr)
+{
+	struct mesh_thread *thread = (struct mesh_thread *)ctx;
+	if ((uintptr_t)ptr != thread->expected[from])
+		thread->misordered++;
+	thread->expected[from] = (uintptr_t)ptr + 1;
+	thread->received++;
+}
+
+static void *
+mesh_thread_f(void *arg)
+{
+	struct mesh_thread *thread = (struct mesh_thread *)arg;
+	fail_unless(xtm_mesh_attach(mesh, thread->id) == 0);
+	pthread_barrier_wait(&attached);
+	for (uintptr_t i = 0; i < XTM_MSG_MAX; i++) {
+		for (unsigned to = 0; to < XTM_THREAD_COUNT; to++) {
+			while (xtm_mesh_push(mesh, thread->id, to,
+					     (void *)i) != 0) {
+				fail_unless(errno == ENOBUFS);
+				/* Peers may be blocked on us, serve them. */
+				fail_unless(xtm_mesh_flush(mesh,
+							   thread->id) >= 0);
+				xtm_mesh_poll_all(mesh, thread->id,
+						  receive_fun, thread);
+				sched_yield();
+			}
+		}
+	}
+	fail_unless(xtm_mesh_flush(mesh, thread->id) >= 0);
+	int fd = xtm_mesh_fd(mesh, thread->id);
+	while (thread->received < XTM_THREAD_COUNT * XTM_MSG_MAX) {
+		if (xtm_mesh_poll_all(mesh, thread->id,
+				      receive_fun, thread) == 0) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+	}
+	return NULL;
+}
+
+static void
+xtm_mesh_new_test(void)
+{
+	header();
+	plan(4);
+
+	errno = 0;
+	ok(xtm_mesh_new(XTM_THREAD_COUNT, 3) == NULL && errno == EINVAL,
+	   "mesh with ring size not power of two is not created");
+	fail_unless((mesh = xtm_mesh_new(2, XTM_RING_SIZE)) != NULL);
+	fail_unless(xtm_mesh_attach(mesh, 0) == 0);
+	errno = 0;
+	ok(xtm_mesh_push(mesh, 0, 1, NULL) != 0 && errno == ENOTCONN,
+	   "push to thread, which hasn't attached, fails");
+	errno = 0;
+	ok(xtm_mesh_push(mesh, 1, 0, NULL) != 0 && errno == ENOTCONN,
+	   "push from thread, which hasn't attached, fails");
+	fail_unless(xtm_mesh_push(mesh, 0, 0, NULL) == 0);
+	is(xtm_mesh_flush(mesh, 0), 1, "the first flush notifies receiver");
+	fail_unless(xtm_mesh_delete(mesh) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_mesh_poll_test(void)
+{
+	header();
+	plan(4);
+
+	struct mesh_thread *thread = &threads[0];
+	fail_unless((mesh = xtm_mesh_new(2, XTM_RING_SIZE)) != NULL);
+	fail_unless(xtm_mesh_attach(mesh, 0) == 0);
+	fail_unless(xtm_mesh_attach(mesh, 1) == 0);
+	is(xtm_mesh_poll_all(mesh, 0, receive_fun, thread), 0,
+	   "nothing to poll in new mesh");
+	unsigned pushed = 0;
+	while (xtm_mesh_push(mesh, 1, 0, (void *)(uintptr_t)pushed) == 0)
+		pushed++;
+	ok(errno == ENOBUFS && pushed == XTM_RING_SIZE,
+	   "push to full ring fails with ENOBUFS");
+	is(xtm_mesh_poll_all(mesh, 0, receive_fun, thread), 0,
+	   "ring isn't polled before flush");
+	fail_unless(xtm_mesh_flush(mesh, 1) == 1);
+	ok(xtm_mesh_poll_all(mesh, 0, receive_fun, thread) == pushed &&
+	   thread->misordered == 0, "ring is polled in order after flush");
+	fail_unless(xtm_mesh_delete(mesh) == 0);
+	memset(thread, 0, sizeof(*thread));
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_mesh_all_to_all_test(void)
+{
+	header();
+	plan(2);
+
+	pthread_t tids[XTM_THREAD_COUNT];
+	fail_unless((mesh = xtm_mesh_new(XTM_THREAD_COUNT,
+					 XTM_RING_SIZE)) != NULL);
+	fail_unless(pthread_barrier_init(&attached, NULL,
+					 XTM_THREAD_COUNT) == 0);
+	for (unsigned i = 0; i < XTM_THREAD_COUNT; i++) {
+		threads[i].id = i;
+		fail_unless(pthread_create(&tids[i], NULL, mesh_thread_f,
+					   &threads[i]) == 0);
+	}
+	unsigned received = 0, misordered = 0;
+	for (unsigned i = 0; i < XTM_THREAD_COUNT; i++) {
+		fail_unless(pthread_join(tids[i], NULL) == 0);
+		received += threads[i].received;
+		misordered += threads[i].misordered;
+	}
+	is(received, XTM_THREAD_COUNT * XTM_THREAD_COUNT * XTM_MSG_MAX,
+	   "each thread received all pointers from all threads");
+	is(misordered, 0, "pointers from each sender are received in order");
+	fail_unless(pthread_barrier_destroy(&attached) == 0);
+	fail_unless(xtm_mesh_delete(mesh) == 0);
+
+	check_plan();
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(3);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &timer_handler;
+	fail_unless(sigaction(SIGALRM, &sa, NULL) == 0);
+	alarm(XTM_TEST_TIMEOUT);
+
+	xtm_mesh_new_test();
+	xtm_mesh_poll_test();
+	xtm_mesh_all_to_all_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}
@@ -0,0 +1,202 @@
+#include <xtm_pipeline.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include "unit.h"
+
+enum {
+	/** Count of items pushed to the pipeline */
+	XTM_ITEM_MAX = 100000,
+	/** Size of queues between stages, small enough to make them full */
+	XTM_QUEUE_SIZE = 16,
+	/** Every DROP_STEP-th item is dropped by the second stage */
+	XTM_DROP_STEP = 10,
+	/** Maximum count of items popped at once */
+	XTM_POP_BATCH = 32,
+	/** Timeout waiting for test completion */
+	XTM_TEST_TIMEOUT = 10,
+};
+
+static void
+timer_handler(int signum)
+{
+	fail_unless(signum == SIGALRM);
+	fail("timeout", "expired");
+}
+
+static int
+wait_for_fd(int fd)
+{
+	int rc;
+	struct pollfd pfds[1];
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	while ((rc = poll(pfds, 1, -1)) < 0 && errno == EINTR)
+		;
+	return (rc <= 0 ? rc : pfds[0].revents & POLLIN);
+}
+
+/** Stage function, which adds value of its context to the item. */
+static void *
+add_stage(void *ctx, void *item)
+{
+	/* Let threads of the stage finish items out of order. */
+	if ((uintptr_t)item % 7 == 0)
+		sched_yield();
+	return (void *)((uintptr_t)item + (uintptr_t)ctx);
+}
+
+/** Stage function, which drops every XTM_DROP_STEP-th item. */
+static void *
+drop_stage(MAYBE_UNUSED void *ctx, void *item)
+{
+	if ((uintptr_t)item % XTM_DROP_STEP == 0)
+		return NULL;
+	return item;
+}
+
+/** Stage function, which should never be called. */
+static void *
+never_stage(MAYBE_UNUSED void *ctx, void *item)
+{
+	fail("stage", "called");
+	return item;
+}
+
+static void
+xtm_pipeline_new_test(void)
+{
+	header();
+	plan(4);
+
+	errno = 0;
+	ok(xtm_pipeline_new(12) == NULL && errno == EINVAL,
+	   "pipeline with queue size not power of two is not created");
+	struct xtm_pipeline *pipeline = xtm_pipeline_new(XTM_QUEUE_SIZE);
+	fail_unless(pipeline != NULL);
+	errno = 0;
+	ok(xtm_pipeline_start(pipeline) != 0 && errno == EINVAL,
+	   "pipeline without stages is not started");
+	is(xtm_pipeline_add_stage(pipeline, never_stage, NULL, 2), 0,
+	   "stage is added");
+	fail_unless(xtm_pipeline_start(pipeline) == 0);
+	errno = 0;
+	ok(xtm_pipeline_add_stage(pipeline, never_stage, NULL, 1) != 0 &&
+	   errno == EINVAL, "stage is not added to started pipeline");
+	fail_unless(xtm_pipeline_delete(pipeline) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_pipeline_order_test(void)
+{
+	header();
+	plan(4);
+
+	struct xtm_pipeline *pipeline = xtm_pipeline_new(XTM_QUEUE_SIZE);
+	fail_unless(pipeline != NULL);
+	fail_unless(xtm_pipeline_add_stage(pipeline, drop_stage, NULL, 1) == 0);
+	fail_unless(xtm_pipeline_add_stage(pipeline, add_stage,
+					   (void *)1, 3) == 1);
+	fail_unless(xtm_pipeline_add_stage(pipeline, add_stage,
+					   (void *)2, 2) == 2);
+	fail_unless(xtm_pipeline_start(pipeline) == 0);
+	int fd = xtm_pipeline_output_fd(pipeline);
+
+	uintptr_t pushed = 1, expected = 1;
+	unsigned popped = 0, in_order = 0;
+	while (expected <= XTM_ITEM_MAX) {
+		while (pushed <= XTM_ITEM_MAX &&
+		       xtm_pipeline_push(pipeline, (void *)pushed) == 0)
+			pushed++;
+		fail_unless(pushed > XTM_ITEM_MAX || errno == ENOBUFS);
+		fail_unless(xtm_flush_notifications() == 0);
+		void *items[XTM_POP_BATCH];
+		unsigned count = xtm_pipeline_pop(pipeline, items,
+						  XTM_POP_BATCH);
+		for (unsigned i = 0; i < count; i++) {
+			while (expected % XTM_DROP_STEP == 0)
+				expected++;
+			in_order += ((uintptr_t)items[i] == expected + 3);
+			expected++;
+		}
+		popped += count;
+		while (expected <= XTM_ITEM_MAX &&
+		       expected % XTM_DROP_STEP == 0)
+			expected++;
+		if (count == 0 && expected <= XTM_ITEM_MAX) {
+			fail_unless(wait_for_fd(fd) > 0);
+			fail_unless(xtm_queue_consume(fd) == 0);
+		}
+	}
+	unsigned kept = XTM_ITEM_MAX - XTM_ITEM_MAX / XTM_DROP_STEP;
+	is(popped, kept, "all items, which are not dropped, are popped");
+	is(in_order, kept, "items are popped in order");
+
+	struct xtm_pipeline_stage_stats stats[3];
+	for (unsigned i = 0; i < 3; i++)
+		fail_unless(xtm_pipeline_stage_stats(pipeline, i,
+						     &stats[i]) == 0);
+	ok(stats[0].items == XTM_ITEM_MAX && stats[1].items == kept &&
+	   stats[2].items == kept, "stage counters count handled items");
+	errno = 0;
+	ok(xtm_pipeline_stage_stats(pipeline, 3, &stats[0]) != 0 &&
+	   errno == EINVAL, "there are no counters of missing stage");
+	fail_unless(xtm_pipeline_delete(pipeline) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_pipeline_delete_test(void)
+{
+	header();
+	plan(1);
+
+	struct xtm_pipeline *pipeline = xtm_pipeline_new(XTM_QUEUE_SIZE);
+	fail_unless(pipeline != NULL);
+	fail_unless(xtm_pipeline_add_stage(pipeline, add_stage,
+					   (void *)1, 2) == 0);
+	fail_unless(xtm_pipeline_add_stage(pipeline, add_stage,
+					   (void *)1, 1) == 1);
+	fail_unless(xtm_pipeline_start(pipeline) == 0);
+	unsigned pushed = 0;
+	while (xtm_pipeline_push(pipeline, (void *)1) == 0)
+		pushed++;
+	fail_unless(xtm_flush_notifications() == 0);
+	/* Items in flight and not popped ones are discarded. */
+	ok(pushed > 0 && xtm_pipeline_delete(pipeline) == 0,
+	   "pipeline with items in flight is deleted");
+
+	check_plan();
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(3);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &timer_handler;
+	fail_unless(sigaction(SIGALRM, &sa, NULL) == 0);
+	alarm(XTM_TEST_TIMEOUT);
+
+	xtm_pipeline_new_test();
+	xtm_pipeline_order_test();
+	xtm_pipeline_delete_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}
@@ -0,0 +1,214 @@
+#include <xtm_pool.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+
+#include "unit.h"
+
+enum {
+	/** Count of tasks submitted by the first test */
+	XTM_TASK_MAX = 100000,
+	/** Count of tasks submitted between flushes */
+	XTM_SUBMIT_BATCH = 16,
+	/** Count of short tasks, queued along with a long one */
+	XTM_SHORT_TASK_COUNT = 31,
+	/** Timeout waiting for test completion */
+	XTM_TEST_TIMEOUT = 10,
+};
+
+/** Count of executions of each task. */
+static unsigned task_hits[XTM_TASK_MAX];
+/** Count of short tasks executed. */
+static unsigned short_done;
+/** Flag, set by long task, if it has seen all short tasks done. */
+static bool long_task_saw_all;
+/** Flag, set by blocking task, when it is started. */
+static bool long_task_started;
+/** Flag, which releases blocking task. */
+static bool long_task_released;
+
+static void
+timer_handler(int signum)
+{
+	fail_unless(signum == SIGALRM);
+	fail("timeout", "expired");
+}
+
+static void
+sleep_msec(unsigned msec)
+{
+	struct timespec ts;
+	ts.tv_sec = msec / 1000;
+	ts.tv_nsec = (msec % 1000) * 1000000L;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static void
+hit_task(void *arg)
+{
+	__atomic_add_fetch(&task_hits[(uintptr_t)arg], 1, __ATOMIC_RELAXED);
+}
+
+static void
+short_task(MAYBE_UNUSED void *arg)
+{
+	__atomic_add_fetch(&short_done, 1, __ATOMIC_RELEASE);
+}
+
+static void
+long_task(MAYBE_UNUSED void *arg)
+{
+	while (__atomic_load_n(&short_done, __ATOMIC_ACQUIRE) <
+	       XTM_SHORT_TASK_COUNT)
+		sched_yield();
+	__atomic_store_n(&long_task_saw_all, true, __ATOMIC_RELEASE);
+}
+
+static void
+blocking_task(MAYBE_UNUSED void *arg)
+{
+	__atomic_store_n(&long_task_started, true, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&long_task_released, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void
+xtm_pool_new_test(void)
+{
+	header();
+	plan(3);
+
+	errno = 0;
+	ok(xtm_pool_new(0, 64) == NULL && errno == EINVAL,
+	   "pool without workers is not created");
+	errno = 0;
+	ok(xtm_pool_new(2, 48) == NULL && errno == EINVAL,
+	   "pool with queue size not power of two is not created");
+	struct xtm_pool *pool = xtm_pool_new(2, 64);
+	ok(pool != NULL, "pool is created");
+	fail_unless(xtm_pool_delete(pool) == 0);
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_pool_submit_test(void)
+{
+	header();
+	plan(2);
+
+	struct xtm_pool *pool = xtm_pool_new(4, 64);
+	fail_unless(pool != NULL);
+	for (uintptr_t i = 0; i < XTM_TASK_MAX; i++) {
+		while (xtm_pool_submit(pool, hit_task, (void *)i) != 0) {
+			fail_unless(errno == ENOBUFS);
+			xtm_pool_flush(pool);
+			sched_yield();
+		}
+		if (i % XTM_SUBMIT_BATCH == XTM_SUBMIT_BATCH - 1)
+			xtm_pool_flush(pool);
+	}
+	xtm_pool_flush(pool);
+	/* Delete waits until all submitted tasks are executed. */
+	fail_unless(xtm_pool_delete(pool) == 0);
+	unsigned executed = 0, executed_once = 0;
+	for (unsigned i = 0; i < XTM_TASK_MAX; i++) {
+		executed += task_hits[i];
+		executed_once += (task_hits[i] == 1);
+	}
+	is(executed, XTM_TASK_MAX, "all tasks are executed");
+	is(executed_once, XTM_TASK_MAX, "each task is executed once");
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_pool_full_test(void)
+{
+	header();
+	plan(2);
+
+	long_task_started = false;
+	long_task_released = false;
+	struct xtm_pool *pool = xtm_pool_new(1, 4);
+	fail_unless(pool != NULL);
+	fail_unless(xtm_pool_submit(pool, blocking_task, NULL) == 0);
+	xtm_pool_flush(pool);
+	while (!__atomic_load_n(&long_task_started, __ATOMIC_ACQUIRE))
+		sched_yield();
+	unsigned submitted = 0;
+	while (xtm_pool_submit(pool, short_task, NULL) == 0)
+		submitted++;
+	is(errno, ENOBUFS, "submit to full pool fails with ENOBUFS");
+	__atomic_store_n(&long_task_released, true, __ATOMIC_RELEASE);
+	xtm_pool_flush(pool);
+	fail_unless(xtm_pool_delete(pool) == 0);
+	is(short_done, submitted, "tasks queued to full pool are executed");
+
+	check_plan();
+	footer();
+}
+
+static void
+xtm_pool_steal_test(void)
+{
+	header();
+	plan(2);
+
+	short_done = 0;
+	long_task_saw_all = false;
+	struct xtm_pool *pool = xtm_pool_new(2, 64);
+	fail_unless(pool != NULL);
+	/* Let workers park, so that each of them takes its tasks at once. */
+	sleep_msec(100);
+	/*
+	 * Tasks are spread round-robin, the long task is the last one
+	 * of the first worker, so the worker takes it first, and its
+	 * short tasks can be executed only by its peer.
+	 */
+	for (unsigned i = 0; i < XTM_SHORT_TASK_COUNT; i++) {
+		if (i == XTM_SHORT_TASK_COUNT - 1)
+			fail_unless(xtm_pool_submit(pool, long_task,
+						    NULL) == 0);
+		fail_unless(xtm_pool_submit(pool, short_task, NULL) == 0);
+	}
+	xtm_pool_flush(pool);
+	while (!__atomic_load_n(&long_task_saw_all, __ATOMIC_ACQUIRE))
+		sched_yield();
+	is(short_done, XTM_SHORT_TASK_COUNT,
+	   "short tasks are executed during long one");
+	ok(xtm_pool_steal_count(pool) > 0, "tasks are stolen");
+	fail_unless(xtm_pool_delete(pool) == 0);
+
+	check_plan();
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(4);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &timer_handler;
+	fail_unless(sigaction(SIGALRM, &sa, NULL) == 0);
+	alarm(XTM_TEST_TIMEOUT);
+
+	xtm_pool_new_test();
+	xtm_pool_submit_test();
+	xtm_pool_full_test();
+	xtm_pool_steal_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}
@@ -0,0 +1,108 @@
+#include <xtm_scsp_queue.h>
+
+#include <stdint.h>
+
+#include "unit.h"
+
+enum {
+	/** Size of ring buffer of queues, small enough to wrap often. */
+	XTM_QUEUE_SIZE = 8,
+};
+
+typedef struct xtm_scsp_queue<uintptr_t> dynamic_queue;
+typedef struct xtm_scsp_queue_fixed<uintptr_t, XTM_QUEUE_SIZE> fixed_queue;
+
+/**
+ * Put batch of consecutive numbers, starting from first, to the queue.
+ * @retval count of numbers actually put.
+ */
+template <class Q>
+static unsigned
+put_numbers(Q *queue, uintptr_t first, unsigned count)
+{
+	uintptr_t data[2 * XTM_QUEUE_SIZE];
+	fail_unless(count <= 2 * XTM_QUEUE_SIZE);
+	for (unsigned i = 0; i < count; i++)
+		data[i] = first + i;
+	return queue->put(data, count);
+}
+
+/**
+ * Read all elements of the queue and check that they are consecutive
+ * numbers, starting from first.
+ * @retval true if count elements in order are read.
+ */
+template <class Q>
+static bool
+read_numbers(Q *queue, uintptr_t first, unsigned count)
+{
+	struct xtm_scsp_queue_read_iterator<uintptr_t, Q> iter;
+	const uintptr_t *elem;
+	unsigned read = 0;
+	bool is_ordered = true;
+	iter.begin(queue);
+	while ((elem = iter.read()) != nullptr) {
+		if (*elem != first + read)
+			is_ordered = false;
+		read++;
+	}
+	iter.end();
+	return is_ordered && read == count;
+}
+
+template <class Q>
+static void
+wrap_test(Q *queue)
+{
+	plan(4);
+
+	/* Queue holds one element less, than its buffer. */
+	is(put_numbers(queue, 1, 2 * XTM_QUEUE_SIZE), XTM_QUEUE_SIZE - 1,
+	   "put is limited by free space");
+	ok(read_numbers(queue, 1, XTM_QUEUE_SIZE - 1),
+	   "full queue is read in order");
+	/* Write position is at the last slot of the buffer. */
+	is(put_numbers(queue, 100, XTM_QUEUE_SIZE / 2 + 1),
+	   XTM_QUEUE_SIZE / 2 + 1, "batch is put across buffer end");
+	ok(read_numbers(queue, 100, XTM_QUEUE_SIZE / 2 + 1),
+	   "batch put across buffer end is read in order");
+
+	check_plan();
+}
+
+static void
+xtm_scsp_queue_wrap_test(void)
+{
+	header();
+	dynamic_queue *queue = (dynamic_queue *)
+		malloc(sizeof(dynamic_queue) +
+		       XTM_QUEUE_SIZE * sizeof(uintptr_t));
+	fail_unless(queue != NULL);
+	fail_unless(queue->create(XTM_QUEUE_SIZE) == 0);
+	wrap_test(queue);
+	free(queue);
+	footer();
+}
+
+static void
+xtm_scsp_queue_fixed_wrap_test(void)
+{
+	header();
+	fixed_queue queue;
+	queue.create();
+	wrap_test(&queue);
+	footer();
+}
+
+int main()
+{
+	header();
+	plan(2);
+
+	xtm_scsp_queue_wrap_test();
+	xtm_scsp_queue_fixed_wrap_test();
+
+	int rc = check_plan();
+	footer();
+	return rc;
+}